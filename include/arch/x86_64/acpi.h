@@ -191,5 +191,100 @@ struct [[gnu::packed]] madt_io_apic_entry {
 
 static_assert(sizeof(struct madt_io_apic_entry) == 12);
 
+/*
+** The header of all entries within the SRAT.
+*/
+struct [[gnu::packed]] srat_entry_header {
+    uint8_t type;
+    uint8_t length;
+};
+
+static_assert(sizeof(struct srat_entry_header) == 2);
+
+/*
+** The different values that `srat_entry_header.type` can take.
+**
+** NOTE: This enum is incomplete, only the required values are present.
+*/
+enum srat_entries {
+    SRAT_PROCESSOR_LOCAL_APIC_AFFINITY = 0,
+    SRAT_MEMORY_AFFINITY = 1,
+    SRAT_PROCESSOR_LOCAL_X2APIC_AFFINITY = 2,
+
+    // ...
+};
+
+/*
+** System Resource Affinity Table (SRAT).
+**
+** It associates CPUs and memory ranges with proximity domains (NUMA nodes).
+*/
+struct [[gnu::packed]] srat {
+    struct sdth;
+
+    uint32_t _reserved1;
+    uint64_t _reserved2;
+    uint8_t entries[];
+};
+
+static_assert(sizeof(struct srat) == 48);
+
+#define SRAT_AFFINITY_ENABLED       0b00000001
+
+struct [[gnu::packed]] srat_processor_local_apic_affinity_entry {
+    struct srat_entry_header;
+
+    uint8_t proximity_domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t local_sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+};
+
+static_assert(sizeof(struct srat_processor_local_apic_affinity_entry) == 16);
+
+struct [[gnu::packed]] srat_memory_affinity_entry {
+    struct srat_entry_header;
+
+    uint32_t proximity_domain;
+    uint16_t _reserved1;
+    uint64_t base;
+    uint64_t len;
+    uint32_t _reserved2;
+    uint32_t flags;
+    uint64_t _reserved3;
+};
+
+static_assert(sizeof(struct srat_memory_affinity_entry) == 40);
+
+struct [[gnu::packed]] srat_processor_local_x2apic_affinity_entry {
+    struct srat_entry_header;
+
+    uint16_t _reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t _reserved2;
+};
+
+static_assert(sizeof(struct srat_processor_local_x2apic_affinity_entry) == 24);
+
+/*
+** System Locality Information Table (SLIT).
+**
+** It contains a `localities * localities` matrix of the relative distance
+** between each proximity domain. The distance of a domain to itself is 10.
+*/
+struct [[gnu::packed]] slit {
+    struct sdth;
+
+    uint64_t localities;
+    uint8_t entries[];
+};
+
+static_assert(sizeof(struct slit) == 44);
+
 
 void acpi_init(void);
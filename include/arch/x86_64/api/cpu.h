@@ -14,6 +14,18 @@
 
 struct cpu;
 
+/*
+** The states a CPU can be in regarding TLB shootdowns.
+**
+** An idle CPU is in lazy TLB mode: instead of being interrupted by shootdowns, it
+** flushes its whole TLB once it wakes up if any was skipped in the meantime.
+*/
+enum tlb_state {
+    TLB_ACTIVE = 0,             // Shootdowns must interrupt the CPU.
+    TLB_LAZY,                   // The CPU is idle.
+    TLB_LAZY_FLUSH,             // The CPU is idle and skipped a shootdown.
+};
+
 /*
 ** A structure representing the architecture-specific values of a single CPU.
 */
@@ -21,6 +33,16 @@ struct arch_cpu {
     struct cpuid cpuid;         // CPUID
     uint32 acpi_id;             // ACPI Processor id
     uint32 apic_id;             // Local APIC id
+
+    // TLB shootdowns. Unlike the rest of `struct cpu`, these are also written by
+    // the CPU initiating a shootdown, so they are only accessed atomically.
+    uint tlb_state;             // See `enum tlb_state`.
+    bool tlb_shootdown_pending; // Set if a shootdown targets this CPU and isn't done yet.
+
+    // PCIDs. Only accessed by the CPU itself.
+    bool tlb_pcid;              // `true` if PCIDs are enabled (CR4.PCIDE).
+    uint64 tlb_generation;      // Generation of the PCIDs the TLB may hold entries of.
+    uint64 tlb_stale_pcids[64]; // PCIDs whose TLB entries must be flushed before they are used again.
 };
 
 /*
@@ -36,3 +58,6 @@ arch_fetch_current_cpu_local_data(
 ) {
     return (struct cpu_local_data __seg_gs*)0;
 }
+
+size_t arch_cpu_cache_way_size(void);
+void arch_cpu_relax(void);
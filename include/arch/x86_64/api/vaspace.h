@@ -0,0 +1,34 @@
+/******************************************************************************\
+**
+**  This file is part of the Poseidon Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2018-2024 - The Poseidon Authors
+**
+\******************************************************************************/
+
+/*
+** Architecture-dependent values of a virtual address space.
+*/
+
+#pragma once
+
+#include "poseidon/poseidon.h"
+#include "poseidon/cpu/cpu.h"
+#include "poseidon/memory/memory.h"
+
+/*
+** A structure representing the architecture-specific values of a virtual
+** address space.
+*/
+struct arch_vaspace {
+    physaddr_t pml4;            // Frame of the PML4
+
+    // The PCID tagging the TLB entries of the address space, with the generation
+    // it belongs to in the upper bits. Only used if the CPU supports PCIDs.
+    uint64 pcid;
+
+    // CPUs that must flush the TLB entries tagged with `pcid` before using the
+    // address space again, as some changed while it wasn't loaded.
+    cpumask_t tlb_stale;
+};
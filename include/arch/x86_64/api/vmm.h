@@ -16,7 +16,42 @@
 #include "poseidon/memory/memory.h"
 #include "poseidon/memory/vmm.h"
 
+/*
+** The range of virtual addresses used by `vmalloc()`: the 512GiB right below the
+** recursive mapping of the page tables (the last entry of the PML4).
+*/
+#define ARCH_VMALLOC_START      ((virtaddr_t)0xFFFFFF0000000000ull)
+#define ARCH_VMALLOC_END        ((virtaddr_t)0xFFFFFF8000000000ull)
+
+/*
+** The user half of each address space: the lower half of the canonical addresses,
+** except its first PML4 entry (512GiB) which holds the kernel and its heap.
+**
+** All the other PML4 entries, but the recursive one, belong to the kernel and
+** are shared by all address spaces.
+*/
+#define ARCH_VASPACE_USER_START ((virtaddr_t)0x0000008000000000ull)
+#define ARCH_VASPACE_USER_END   ((virtaddr_t)0x0000800000000000ull)
+
+/*
+** The size of the smallest large page, on which big `vmalloc()` areas are aligned
+** so they can be mapped with large pages.
+*/
+#define ARCH_VMM_LARGE_PAGE_SIZE    (2ul * 1024 * 1024)
+
 bool arch_vmm_is_mapped(virtaddr_const_t va);
 bool arch_vmm_is_mapped_user(virtaddr_const_t va);
+size_t arch_vmm_probe(virtaddr_const_t va, size_t size, bool *mapped, bool *user);
 status_t arch_vmm_map_frame(virtaddr_t va, physaddr_t pa, mmap_flags_t flags);
+status_t arch_vmm_map_frames(virtaddr_t va, physaddr_t pa, size_t size, mmap_flags_t flags, size_t *mapped, struct tlb_gather *tlb);
 void arch_vmm_unmap_frame(virtaddr_t va, munmap_flags_t flags);
+size_t arch_vmm_unmap_frames(virtaddr_t va, size_t size, munmap_flags_t flags, struct tlb_gather *tlb, size_t *unmapped);
+void arch_tlb_flush(virtaddr_t start, virtaddr_t end, bool freed_tables);
+void arch_tlb_lazy_enter(void);
+void arch_tlb_lazy_leave(void);
+status_t arch_vaspace_init(void);
+status_t arch_vaspace_new(struct vaspace *vaspace);
+void arch_vaspace_free(struct vaspace *vaspace);
+void arch_vaspace_switch(struct vaspace *vaspace);
+virtaddr_t arch_vmm_scratch_map(physaddr_t frame, physaddr_t *old);
+void arch_vmm_scratch_unmap(physaddr_t old);
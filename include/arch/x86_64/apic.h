@@ -86,6 +86,7 @@ void apic_eoi(void);
 void apic_map(physaddr_t pa);
 uint32 apic_get_id(void);
 void apic_ipi_broadcast(uint8_t vector);
+void apic_ipi_send(struct cpu const *cpu, uint8_t vector);
 void apic_ipi_send_init(struct cpu const *cpu);
 void apic_ipi_send_startup(struct cpu const *cpu, uintptr addr);
 bool apic_ipi_acked(void);
@@ -11,6 +11,18 @@
 
 #define CPU_TRAMPOLINE_START    (0x10000)
 
+/*
+** Address of the copy of `g_gdt_fatptr` the APs load their GDT from.
+**
+** The APs start in real mode, where they can't reach the original one once the
+** kernel grows past the first 64KiB after 1MiB.
+*/
+#define CPU_TRAMPOLINE_GDT_FATPTR   (CPU_TRAMPOLINE_START + 0x10)
+
+#ifndef __ASSEMBLER__
+
 void start_ap(void);
 void cpu_start_all_aps(void);
 struct cpu_local_data const *cpu_fetch_current_cpu_local_data_manually(void);
+
+#endif /* ! __ASSEMBLER__ */
@@ -63,6 +63,19 @@ struct cpuid {
     uint32 display_family;              // Beautified family ID
     uint32 display_model;               // Beautified model ID
 
+    /*
+    ** Geometry of the last level cache, found by walking the deterministic
+    ** cache parameters (CPUID.EAX=0x4 on Intel, CPUID.EAX=0x8000001D on AMD).
+    **
+    ** All fields are zero if the CPU doesn't report them.
+    */
+    struct {
+        uint32 level;                   // Cache level (eg. 3 for the L3)
+        uint32 line_size;               // Line size, in bytes
+        uint32 ways;                    // Associativity
+        uint32 sets;                    // Amount of sets
+    } llc;
+
     // Feature flags
     union [[gnu::packed]] {
         struct [[gnu::packed]] {
@@ -216,3 +216,5 @@ static_assert(sizeof(struct gdt_fatptr) == 10);
             __VA_ARGS__                                     \
         },                                                  \
     })
+
+extern struct gdt_fatptr const g_gdt_fatptr;
@@ -14,6 +14,7 @@
 #pragma once
 
 #include "poseidon/poseidon.h"
+#include "poseidon/cpu/cpu.h"
 #include "poseidon/memory/memory.h"
 
 /*
@@ -176,5 +177,40 @@ struct [[gnu::packed]] virtaddr_layout {
 
 static_assert(sizeof(struct virtaddr_layout) == sizeof(void *));
 
-/* Target for TLB shootdowns. */
-extern virtaddr_t g_tlb_shootdown_target;
+/*
+** Size of the memory covered by a single entry of each level of the paging
+** structures.
+**
+** A PDPTE or a PDE with the `size` bit set maps a 1GiB or a 2MiB page.
+*/
+#define PML4E_SIZE              (1ul << 39u)
+#define PDPTE_SIZE              (1ul << 30u)
+#define PDE_SIZE                (1ul << 21u)
+
+/*
+** Above this amount of pages, flushing a range of the TLB reloads CR3 instead of
+** invalidating each page.
+*/
+#define TLB_FLUSH_FULL_THRESHOLD    32u
+
+/*
+** Amount of bits of a PCID, and amount of PCIDs. PCID 0 is the kernel's.
+*/
+#define PCID_BITS               12u
+#define PCID_NB                 (1u << PCID_BITS)
+
+/*
+** Target for TLB shootdowns: the range of addresses to invalidate, and the
+** address space it belongs to if it is within the user half (`NULL` otherwise).
+*/
+struct tlb_shootdown_target {
+    struct vaspace *vaspace;
+    virtaddr_t start;
+    virtaddr_t end;
+};
+
+extern struct tlb_shootdown_target g_tlb_shootdown_target;
+
+void tlb_flush_local(struct vaspace *vaspace, virtaddr_t start, virtaddr_t end);
+void tlb_shootdown_poll(void);
+void tlb_cpu_setup(void);
@@ -99,6 +99,11 @@ struct cr3 {
             size_t pagedir: 20;        // Physical address of a page directory
             size_t : 32;
         };
+        struct {
+            size_t pcid: 12;           // Process-context identifier (Requires CR4.PCIDE = 1)
+            size_t : 51;
+            size_t noflush: 1;         // Keep the TLB entries tagged with `pcid` when written (Requires CR4.PCIDE = 1)
+        };
         uintptr value;
     };
 };
@@ -133,3 +138,72 @@ set_cr3(
         : "memory"
     );
 }
+
+/*
+** The Control Register 4.
+**
+** The layout of this structure is defined by Intel.
+*/
+struct cr4 {
+    union {
+        struct {
+            size_t vme: 1;             // Virtual-8086 mode extensions
+            size_t pvi: 1;             // Protected-mode virtual interrupts
+            size_t tsd: 1;             // Time stamp disable
+            size_t de: 1;              // Debugging extensions
+            size_t pse: 1;             // Page size extensions
+            size_t pae: 1;             // Physical address extension
+            size_t mce: 1;             // Machine-check enable
+            size_t pge: 1;             // Page global enable
+            size_t pce: 1;             // Performance-monitoring counter enable
+            size_t osfxsr: 1;          // OS support for FXSAVE and FXRSTOR
+            size_t osxmmexcpt: 1;      // OS support for unmasked SIMD floating-point exceptions
+            size_t umip: 1;            // User-mode instruction prevention
+            size_t la57: 1;            // 57-bit linear addresses
+            size_t vmxe: 1;            // VMX enable
+            size_t smxe: 1;            // SMX enable
+            size_t : 1;
+            size_t fsgsbase: 1;        // FSGSBASE enable
+            size_t pcide: 1;           // PCID enable
+            size_t osxsave: 1;         // XSAVE and processor extended states enable
+            size_t : 1;
+            size_t smep: 1;            // SMEP enable
+            size_t smap: 1;            // SMAP enable
+            size_t pke: 1;             // Protection keys enable
+            size_t : 9;
+            size_t : 32;
+        };
+        uintptr value;
+    };
+};
+
+static_assert(sizeof(struct cr4) == sizeof(uint64));
+
+static inline
+struct cr4
+get_cr4(
+    void
+) {
+    struct cr4 cr4;
+
+    asm volatile (
+        "mov %%cr4, %0"
+        : "=r"(cr4.value)
+        :
+        :
+    );
+    return cr4;
+}
+
+static inline
+void
+set_cr4(
+    struct cr4 cr4
+) {
+    asm volatile (
+        "mov %0, %%cr4"
+        :
+        : "r"(cr4.value)
+        : "memory"
+    );
+}
@@ -11,6 +11,7 @@
 
 #include "poseidon/poseidon.h"
 #include "poseidon/atomic.h"
+#include "arch/target/api/cpu.h"
 
 /*
 ** A simple spin lock.
@@ -37,13 +38,31 @@ spinlock_init(
 
 /*
 ** Acquire a spinlock, blocking until the lock is released.
+**
+** The CPU keeps answering the requests of other CPUs while spinning (see
+** `arch_cpu_relax()`), as the lock may be held by one of them waiting for it.
 */
 static inline
 void
 spinlock_acquire(
     struct spinlock *sl
 ) {
-    while (atomic_exchange(&sl->lock, 1, ATOMIC_ACQUIRE));
+    while (atomic_exchange(&sl->lock, 1, ATOMIC_ACQUIRE)) {
+        arch_cpu_relax();
+    }
+}
+
+/*
+** Try to acquire a spinlock without blocking.
+**
+** Return `true` if the lock was acquired.
+*/
+static inline
+bool
+spinlock_try_acquire(
+    struct spinlock *sl
+) {
+    return !atomic_exchange(&sl->lock, 1, ATOMIC_ACQUIRE);
 }
 
 /*
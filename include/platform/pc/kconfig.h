@@ -53,3 +53,6 @@
 
 // Maximum amount of CPUs theoretically available.
 #define KCONFIG_MAX_CPUS                       16
+
+// Maximum amount of NUMA nodes theoretically available.
+#define KCONFIG_MAX_NUMA_NODES                 8
@@ -65,3 +65,10 @@
 #define atomic_and_fetch(ptr, value, memorder)          __atomic_and_fetch(ptr, value, memorder)
 #define atomic_xor_fetch(ptr, value, memorder)          __atomic_xor_fetch(ptr, value, memorder)
 #define atomic_nand_fetch(ptr, value, memorder)         __atomic_nand_fetch(ptr, value, memorder)
+
+/*
+** Atomically set `*ptr` to `desired` if it is equal to `*expected`, and return `true`.
+** Otherwise, store the content of `*ptr` in `*expected` and return `false`.
+*/
+#define atomic_compare_exchange(ptr, expected, desired, success_memorder, failure_memorder) \
+    __atomic_compare_exchange_n(ptr, expected, desired, false, success_memorder, failure_memorder)
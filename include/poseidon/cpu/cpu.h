@@ -12,9 +12,19 @@
 #include "poseidon/poseidon.h"
 #include "poseidon/kconfig.h"
 #include "poseidon/atomic.h"
+#include "poseidon/memory/pmm.h"
+#include "poseidon/memory/kheap.h"
 #include "arch/target/api/cpu.h"
 
 struct thread;
+struct vaspace;
+
+/*
+** A set of CPUs, holding one bit per `cpu_id`.
+*/
+typedef uint32 cpumask_t;
+
+static_assert(KCONFIG_MAX_CPUS <= sizeof(cpumask_t) * 8);
 
 /*
 ** A structure representing the data local to each CPU.
@@ -47,6 +57,12 @@ struct cpu {
     void *scheduler_stack_top;
 
     size_t cpu_id;                  // ID of the CPU.
+    uint node;                      // NUMA node the CPU belongs to.
+
+    struct vaspace *vaspace;        // Address space currently loaded. Only accessed atomically.
+
+    struct pmm_cpu_cache pmm_cache; // Cache of free frames. Only accessed with interrupts disabled.
+    struct kheap_cpu_cache kheap_cache; // Cache of small heap blocks. Only accessed with interrupts disabled.
 
     // RCU related variables
     struct rcu {
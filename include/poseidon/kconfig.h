@@ -27,3 +27,22 @@
 
 // Use a multiboot-compliant bootloader to set-up graphic mode.
 #define KCONFIG_MULTIBOOT_FRAMEBUFFER           0
+
+/*
+** Amount of physical memory (in bytes) made available by the PMM before other
+** CPUs are started. The rest is made available later by idle CPUs, or when
+** memory runs low.
+*/
+#define KCONFIG_PMM_EARLY_INIT_SIZE             (256ul * 1024 * 1024)
+
+/*
+** Record the allocations made with `kheap_alloc()` by call site and size, and
+** dump them with fragmentation metrics at the end of the boot process (see
+** `kheap_profile_dump()`).
+**
+** Only effective in the debug profile.
+*/
+#define KCONFIG_KHEAP_PROFILE                   0
+
+// Run the kernel's micro-benchmarks at the end of the boot process.
+#define KCONFIG_BENCHMARKS                      0
@@ -31,6 +31,7 @@
 */
 struct kheap_block {
     bool used;
+    bool decommitted;   // Some pages of the content may be unmapped (see `kheap_shrink()`).
     uint32 magic;
     size_t size;
     struct kheap_block *prev;
@@ -45,14 +46,109 @@ static_assert(sizeof(struct kheap_block) % sizeof(void *) == 0);
 #define KHEAP_MAGIC     0xf9f66427
 
 /*
-** We are using a dirty trick to have a quick and functional `kheap_alloc_aligned()`.
+** The content of a free block starts with its links in the free list of its
+** size class.
+*/
+struct kheap_free_links {
+    struct kheap_block *next;
+    struct kheap_block *prev;
+};
+
+/*
+** The smallest size of a block's content, so that free blocks can hold their
+** links.
+*/
+#define KHEAP_MIN_SIZE  (sizeof(struct kheap_free_links))
+
+/*
+** Free blocks are sorted in size classes, each having its own free list.
 **
-** It needs to store the original pointer returned by `kheap_alloc()` before
-** aligning it to a page boundary.
+** The first level of classes is the position of the most significant bit of the
+** block's size. Each of those is split in `2^KHEAP_SL_LOG2` linearly-sized
+** classes, using the bits following the most significant one.
 */
-struct kheap_aligned_metadata {
-    virtaddr_t aligned;
-    virtaddr_t original;
+#define KHEAP_FL_COUNT  64u
+#define KHEAP_SL_LOG2   3u
+#define KHEAP_SL_COUNT  (1u << KHEAP_SL_LOG2)
+
+/*
+** Allocations of at least that many bytes are made with `vmalloc()` instead of
+** coming from the heap.
+**
+** It is above a page so the page-sized blocks of the slab allocator and of the
+** regions come from the heap, instead of each costing a vmalloc area, a guard
+** page and a walk of the paging structures.
+*/
+#define KHEAP_VMALLOC_THRESHOLD     (4u * PAGE_SIZE)
+
+/*
+** The heap is trimmed when its last block is free and spans at least that many
+** bytes worth of whole pages.
+*/
+#define KHEAP_TRIM_THRESHOLD        (16u * PAGE_SIZE)
+
+/*
+** Small allocations are served from a cache of free blocks local to each CPU,
+** with one class per `KHEAP_CPU_CACHE_GRANULE` bytes up to
+** `KHEAP_CPU_CACHE_MAX_SIZE` bytes.
+**
+** Blocks sitting in those caches are still marked as used in the heap.
+*/
+#define KHEAP_CPU_CACHE_GRANULE     16u
+#define KHEAP_CPU_CACHE_CLASSES     16u
+#define KHEAP_CPU_CACHE_MAX_SIZE    (KHEAP_CPU_CACHE_GRANULE * KHEAP_CPU_CACHE_CLASSES)
+
+/*
+** Amount of blocks each class of a per-CPU cache can hold.
+*/
+#define KHEAP_CPU_CACHE_SIZE        8u
+
+/*
+** Amount of blocks moved at once between a per-CPU cache and the heap.
+*/
+#define KHEAP_CPU_CACHE_BATCH       4u
+
+/*
+** A per-CPU cache of small free blocks.
+**
+** Class `i` holds blocks of at least `(i + 1) * KHEAP_CPU_CACHE_GRANULE` bytes.
+*/
+struct kheap_cpu_cache {
+    virtaddr_t blocks[KHEAP_CPU_CACHE_CLASSES][KHEAP_CPU_CACHE_SIZE];
+    uint8 len[KHEAP_CPU_CACHE_CLASSES];
+};
+
+/*
+** Set if the allocations of the kernel's heap are profiled. This never is the
+** case in the release profile.
+*/
+#if KCONFIG_KHEAP_PROFILE && DEBUG
+#define KHEAP_PROFILE               1
+#else
+#define KHEAP_PROFILE               0
+#endif /* KCONFIG_KHEAP_PROFILE && DEBUG */
+
+/*
+** Size of the table of allocation sites kept when profiling.
+** Must be a power of two.
+*/
+#define KHEAP_PROFILE_SITES         512u
+
+/*
+** The allocations made from a given call site, for a given size class.
+**
+** The size class of an allocation is the position of the most significant bit
+** of its usable size.
+*/
+struct kheap_profile_site {
+    virtaddr_const_t caller;    // Return address of the call to the allocator. `NULL` if the entry is unused.
+    uint class;
+    size_t allocs;              // Amount of allocations
+    size_t bytes;               // Sum of their usable size
 };
 
 status_t kheap_init(void);
+
+#if KHEAP_PROFILE
+void kheap_profile_dump(void);
+#endif /* KHEAP_PROFILE */
@@ -55,9 +55,17 @@ typedef const void *virtaddr_const_t;
 extern uint8 kernel_start[];                    // Beginning of the kernel (virtual)
 extern uint8 kernel_end[];                      // End of the kernel (virtual)
 extern uint8 kernel_heap_start[];               // Beginning of the kernel's heap (virtual)
+extern uint8 kernel_boot_text_start[];          // Beginning of the boot text, page-aligned (virtual)
+extern uint8 kernel_boot_text_end[];            // End of the boot text, page-aligned (virtual)
+extern uint8 kernel_boot_rodata_start[];        // Beginning of the boot rodata, page-aligned (virtual)
+extern uint8 kernel_boot_rodata_end[];          // End of the boot rodata, page-aligned (virtual)
+extern uint8 kernel_boot_data_start[];          // Beginning of the boot data, page-aligned (virtual)
+extern uint8 kernel_boot_data_end[];            // End of the boot data, page-aligned (virtual)
+
+void memory_release_boot_memory(void);
 
 virtaddr_t kheap_alloc(size_t);
-virtaddr_t kheap_alloc_aligned(size_t);
+virtaddr_t kheap_alloc_aligned(size_t, size_t);
 virtaddr_t kheap_alloc_device(physaddr_t, size_t);
 virtaddr_t kheap_realloc(virtaddr_t, size_t);
 virtaddr_t kheap_alloc_zero(size_t);
@@ -11,28 +11,216 @@
 
 #include "poseidon/memory/memory.h"
 
+/*
+** The biggest order of a block the buddy allocator can manage.
+**
+** A block of order `n` is made of `2^n` physically contiguous frames and is
+** aligned on its own size. The default value allows allocations of up to 4MiB,
+** which covers 2MiB huge pages.
+*/
+#define PMM_MAX_ORDER           10u
+
+// Size (in bytes) of the biggest block the buddy allocator can manage.
+#define PMM_MAX_BLOCK_SIZE      (PAGE_SIZE << PMM_MAX_ORDER)
+
+/*
+** Maximum depth of a `struct pmm_bitmap`.
+**
+** Each level divides the amount of words of the level below by 64, so six
+** levels are enough to describe 2^36 blocks.
+*/
+#define PMM_BITMAP_MAX_LEVELS   6u
+
+/*
+** A hierarchical bitmap, made of 64-bit words.
+**
+** `levels[0]` holds one bit per block. Each bit of `levels[n + 1]` tells whether
+** the matching word of `levels[n]` has at least one bit set, up to
+** `levels[depth - 1]` which is a single word.
+**
+** Finding a set bit therefore only takes one `tzcnt` per level, whatever the
+** size of the bitmap is.
+*/
+struct pmm_bitmap {
+    uint64 *levels[PMM_BITMAP_MAX_LEVELS];
+    uint depth;
+};
+
+/*
+** Flags of a `struct frame`.
+*/
+enum frame_flags {
+    FRAME_RESERVED          = 0b00000001,   // The frame is reserved and is never freed.
+    FRAME_BOOT_HEAP         = 0b00000010,   // The frame belongs to the boot heap, which holds a reference on it until it is released.
+};
+
+/*
+** What a frame is used for, for accounting purposes.
+*/
+enum frame_owner {
+    FRAME_OWNER_NONE        = 0,
+    FRAME_OWNER_PAGE_TABLE,
+};
+
+/*
+** A descriptor of a single physical frame.
+**
+** Each arena holds an array of descriptors, one for each of its frames,
+** indexed by the frame's position within the arena.
+**
+** A frame is given back to the arenas when its last reference is dropped, which
+** allows a frame to be shared between multiple mappings.
+** The descriptors of free frames are meaningless.
+*/
+struct frame {
+    uint32 refcount;    // Amount of references on the frame. Only accessed atomically.
+    uint16 flags;       // See `enum frame_flags`.
+    uint16 owner;       // See `enum frame_owner`.
+};
+
+static_assert(sizeof(struct frame) == 8);
+
+/*
+** The free blocks of a given order within an arena.
+*/
+struct pmm_free_area {
+    struct pmm_bitmap bitmap;   // One bit per block of this order (1 for free, 0 for taken or split)
+    size_t free_blocks;         // Amount of free blocks of this order
+};
+
 /*
 ** A region of available physical memory.
+**
+** Frames within an arena are managed by a buddy allocator: each order has its
+** own bitmap of free blocks, and two free buddies of the same order are
+** always coalesced into a single block of the order above.
 */
 struct pmm_arena {
     physaddr_t start;   // Inclusive
     physaddr_t end;     // Exclusive
-    uchar *bitmap;
-    size_t bitmap_size;
+    physaddr_t base;    // `start` rounded down to `PMM_MAX_BLOCK_SIZE`. Block indexes are relative to it.
 
-    /*
-    ** The following are intermediate variables to make next allocations faster
-    */
+    struct pmm_free_area areas[PMM_MAX_ORDER + 1];
 
     size_t free_frames; // Amount of frame free
-    size_t next_frame;  // An index within `bitmap` that is susceptible to contain a free frame (heuristic)
+
+    uint node;          // NUMA node the arena belongs to
+
+    physaddr_t deferred; // Frames from here to `end` aren't initialized yet and are considered allocated.
+
+    struct frame *frames; // One descriptor for each frame from `start` to `end`, or `NULL` before `pmm_frames_init()`.
+};
+
+/*
+** A range of physical memory belonging to a given NUMA node, as reported by
+** the firmware.
+*/
+struct pmm_node_range {
+    physaddr_t start;   // Inclusive
+    physaddr_t end;     // Exclusive
+    uint node;
+};
+
+/*
+** Amount of memory (in bytes) initialized at once when the PMM initializes
+** the frames it deferred at boot time.
+*/
+#define PMM_DEFERRED_CHUNK_SIZE (64u * PMM_MAX_BLOCK_SIZE)
+
+/*
+** Amount of frames each per-CPU cache can hold.
+*/
+#define PMM_CPU_CACHE_SIZE      64u
+
+/*
+** Amount of frames moved at once between a per-CPU cache and the arenas.
+*/
+#define PMM_CPU_CACHE_BATCH     32u
+
+/*
+** A per-CPU cache of free frames, sitting in front of the arenas.
+**
+** Single frame allocations and frees are served from the cache of the current
+** CPU without taking any lock. The cache is refilled from, and drained to, the
+** arenas in batches of `PMM_CPU_CACHE_BATCH` frames.
+**
+** Frames within a cache are considered allocated by the arenas.
+*/
+struct pmm_cpu_cache {
+    physaddr_t frames[PMM_CPU_CACHE_SIZE];
+    size_t len;
+};
+
+/*
+** Amount of zeroed frames the PMM keeps ready to be allocated.
+**
+** The pool is filled by idle CPUs, see `pmm_zeroed_pool_fill()`.
+*/
+#define PMM_ZEROED_POOL_SIZE    256u
+
+/*
+** Watermarks on the amount of free frames left within the arenas.
+**
+** When free frames go below `low`, the reclaim thread is woken up and runs the
+** shrinkers until free frames are back above `high`. When an allocation fails
+** or leaves less than `min` free frames, the shrinkers are run right away by
+** the allocating thread.
+*/
+struct pmm_watermarks {
+    size_t min;
+    size_t low;
+    size_t high;
+};
+
+/*
+** The `min` watermark is the amount of frames managed by the arenas divided by
+** this value. `low` and `high` are respectively 5/4 and 3/2 of `min`.
+*/
+#define PMM_WATERMARK_RATIO     256u
+
+/*
+** Frames are colored by the sets of the last level cache they map to: two
+** frames of the same color compete for the same sets, while frames of
+** different colors never do. The color of a frame is its index modulo the
+** amount of colors, which is the size of a way of that cache divided by the
+** size of a frame.
+**
+** Blocks of `PMM_MAX_ORDER` hold every color, so there can't be more colors
+** than that.
+*/
+#define PMM_MAX_COLORS          (1u << PMM_MAX_ORDER)
+
+/*
+** How much memory is needed, as passed to the shrinkers.
+*/
+enum pmm_pressure {
+    PMM_PRESSURE_LOW,   // Free frames went below the `low` watermark. Called from the reclaim thread.
+    PMM_PRESSURE_MIN,   // An allocation is about to fail. Called from the allocating thread.
 };
 
 physaddr_t pmm_alloc_frame(void);
+physaddr_t pmm_alloc_frame_zeroed(void);
+bool pmm_zeroed_pool_fill(void);
+bool pmm_deferred_init_step(void);
+physaddr_t pmm_alloc_frames(uint order);
 void pmm_free_frame(physaddr_t);
+struct frame *pmm_get_frame(physaddr_t);
+void pmm_frame_ref(physaddr_t);
+void pmm_free_frames(physaddr_t, uint order);
+physaddr_t pmm_alloc_frame_node(uint node);
+physaddr_t pmm_alloc_frame_color(uint color);
+uint pmm_frame_color(physaddr_t);
+uint pmm_reserve_colors(size_t nb);
+status_t pmm_alloc_frames_bulk(size_t nb, physaddr_t frames[]);
+void pmm_free_frames_bulk(size_t nb, physaddr_t const frames[]);
 status_t pmm_init(void);
 void pmm_early_init(void);
+status_t pmm_frames_init(void);
+status_t pmm_numa_init(struct pmm_node_range const *ranges, size_t nb_ranges, uint nb_nodes, uint8 const *distances);
 void pmm_mark_range_as_allocated(physaddr_t, size_t);
+void pmm_release_range(physaddr_t, size_t);
+void pmm_release_boot_heap(void);
+size_t pmm_shrink(enum pmm_pressure pressure, size_t target);
 
 /*
 ** A physical memory area marked as reserved for a specific purpose or device.
@@ -57,3 +245,31 @@ struct pmm_reserved_area {
         .start = (physaddr_t)(s),                                       \
         .end = (physaddr_t)(e),                                         \
     }
+
+/*
+** A callback releasing frames the subsystem it belongs to can live without,
+** typically caches.
+**
+** `shrink()` tries to release `target` frames and returns how many it did
+** release. It can be called with interrupts disabled and while any lock is held
+** by the current CPU, so it must not sleep nor wait for a lock that could be
+** held by an allocating thread.
+*/
+struct pmm_shrinker {
+    char const *name;
+    size_t (*shrink)(enum pmm_pressure pressure, size_t target);
+};
+
+/*
+** Usage: `REGISTER_PMM_SHRINKER(name, func)`
+**
+** A macro to easily register a new shrinker.
+*/
+#define REGISTER_PMM_SHRINKER(n, f)                                     \
+    [[gnu::aligned(sizeof(void *))]]                                    \
+    [[gnu::used]]                                                       \
+    [[gnu::section("pmm_shrinker")]]                                    \
+    static struct pmm_shrinker const _pmm_shrinker_##n = {              \
+        .name = #n,                                                     \
+        .shrink = (f),                                                  \
+    }
@@ -0,0 +1,91 @@
+/******************************************************************************\
+**
+**  This file is part of the Poseidon Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2018-2024 - The Poseidon Authors
+**
+\******************************************************************************/
+
+/*
+** Architecture-independent API to make many short-lived allocations that are
+** all freed together.
+*/
+
+#pragma once
+
+#include "poseidon/poseidon.h"
+#include "poseidon/memory/memory.h"
+#include "poseidon/memory/kheap.h"
+
+/*
+** Size of the chunks allocations are carved out of.
+**
+** Chunks come from the kernel's heap, and must stay below the size it forwards
+** to `vmalloc()`. Allocations that don't fit in a chunk get a chunk of their own.
+*/
+#define REGION_CHUNK_SIZE       PAGE_SIZE
+
+static_assert(REGION_CHUNK_SIZE < KHEAP_VMALLOC_THRESHOLD);
+
+/*
+** Alignment of every allocation made within a region.
+*/
+#define REGION_ALIGN            (2 * sizeof(void *))
+
+/*
+** A chunk of memory owned by a region.
+**
+** This header is placed at the beginning of the chunk, and followed by the
+** allocations.
+*/
+struct region_chunk {
+    struct region_chunk *next;  // Next chunk of the region
+};
+
+/*
+** A region: memory allocated by bumping a pointer within chunks, and only ever
+** freed all at once, with `region_release()`.
+**
+** A region isn't thread-safe: it is meant to be owned by a single thread for a
+** short-lived batch of work.
+**
+** Use `REGION_DEFAULT` to initialize a region.
+*/
+struct region {
+    struct region_chunk *chunks;    // All chunks, the one being filled first
+    uchar *cur;                     // Next free byte of the chunk being filled
+    uchar *end;                     // End of the chunk being filled
+};
+
+#define REGION_DEFAULT                  \
+    ((struct region) {                  \
+        .chunks = NULL,                 \
+        .cur = NULL,                    \
+        .end = NULL,                    \
+    })
+
+virtaddr_t region_alloc_slow(struct region *region, size_t size);
+void region_release(struct region *region);
+
+/*
+** Allocate `size` bytes within the given region, aligned to `REGION_ALIGN` bytes.
+**
+** Return `NULL` if there is no memory left.
+*/
+static inline
+virtaddr_t
+region_alloc(
+    struct region *region,
+    size_t size
+) {
+    uchar *ptr;
+
+    size = size ? ALIGN(size, REGION_ALIGN) : REGION_ALIGN;
+    if (likely((size_t)(region->end - region->cur) >= size)) {
+        ptr = region->cur;
+        region->cur += size;
+        return ptr;
+    }
+    return region_alloc_slow(region, size);
+}
@@ -0,0 +1,128 @@
+/******************************************************************************\
+**
+**  This file is part of the Poseidon Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2018-2024 - The Poseidon Authors
+**
+\******************************************************************************/
+
+/*
+** Architecture-independent API to allocate fixed-size kernel objects.
+*/
+
+#pragma once
+
+#include "poseidon/poseidon.h"
+#include "poseidon/memory/memory.h"
+#include "lib/sync/spinlock.h"
+#include "lib/list.h"
+
+/*
+** Amount of objects each per-CPU cache of a `struct kmem_cache` can hold.
+*/
+#define KMEM_CPU_CACHE_SIZE     16u
+
+/*
+** Amount of objects moved at once between a per-CPU cache and the slabs.
+*/
+#define KMEM_CPU_CACHE_BATCH    8u
+
+/*
+** Size of the biggest object a `struct kmem_cache` can hold, so that a slab
+** holds at least a handful of them.
+*/
+#define KMEM_CACHE_MAX_SIZE     (PAGE_SIZE / 8u)
+
+/*
+** A slab: a single page holding objects of a given cache.
+**
+** This header is placed at the beginning of the page, so the slab an object
+** belongs to is found by rounding the object's address down to the page.
+** It is followed by the indexes of the slab's free objects, and then by the
+** objects themselves.
+**
+** Free objects are tracked by index rather than linked together, so that they
+** keep the state given by the cache's constructor.
+*/
+struct kmem_slab {
+    struct kmem_cache *cache;
+    struct linked_list slabs;   // List of slabs the slab belongs to (partial or full)
+    uint16 nb_free;             // Amount of free objects
+    uint16 free[];              // Indexes of the free objects
+};
+
+/*
+** A per-CPU cache of free objects, sitting in front of the slabs.
+**
+** Objects are allocated from, and freed to, the cache of the current CPU
+** without taking any lock. It exchanges objects with the slabs in batches of
+** `KMEM_CPU_CACHE_BATCH` objects.
+*/
+struct kmem_cpu_cache {
+    virtaddr_t objs[KMEM_CPU_CACHE_SIZE];
+    size_t len;
+};
+
+/*
+** A cache of objects of a given type.
+**
+** The objects are carved out of slabs (see `struct kmem_slab`). When a slab is
+** created, the cache's constructor (if any) is called on each of its objects.
+** Objects must be given back to the cache in that same state, so the
+** constructor is only ever called once per object.
+**
+** Use `KMEM_CACHE_DEFAULT()` to initialize a cache.
+*/
+struct kmem_cache {
+    char const *name;
+    size_t size;
+    size_t align;
+    void (*ctor)(virtaddr_t obj);
+
+    // Layout of the slabs, computed when the first slab is created.
+    size_t objs_per_slab;
+    size_t objs_offset;
+
+    struct spinlock lock;               // Protects the slabs
+    struct linked_list partial_slabs;   // Slabs with free objects, roughly the fullest first
+    struct linked_list full_slabs;      // Slabs without free objects
+    size_t nb_empty_slabs;              // Slabs without any allocated object
+
+    struct kmem_cpu_cache cpu_caches[KCONFIG_MAX_CPUS]; // Only accessed with interrupts disabled.
+};
+
+/*
+** Evaluate to `sizeof(type)`, failing to compile if objects of type `type` are
+** too big to be allocated from a cache.
+*/
+#define KMEM_CACHE_OBJ_SIZE(type)                                           \
+    (sizeof(type) + 0 * sizeof(struct {                                     \
+        int unused;                                                         \
+        static_assert(sizeof(type) <= KMEM_CACHE_MAX_SIZE);                 \
+    }))
+
+/*
+** Usage: `static struct kmem_cache cache = KMEM_CACHE_DEFAULT(cache, type, ctor)`
+**
+** Initialize a cache of objects of type `type`, using `ctor` as the constructor
+** (or `NULL` for none).
+**
+** This is a plain initializer rather than a compound literal so it can be used
+** for variables with static storage.
+**
+** Objects bigger than `KMEM_CACHE_MAX_SIZE` are rejected at compile time.
+*/
+#define KMEM_CACHE_DEFAULT(cache, type, c)                                  \
+    {                                                                       \
+        .name = #type,                                                      \
+        .size = KMEM_CACHE_OBJ_SIZE(type),                                  \
+        .align = alignof(type),                                             \
+        .ctor = (c),                                                        \
+        .lock = { .lock = 0 },                                              \
+        .partial_slabs = { &(cache).partial_slabs, &(cache).partial_slabs },\
+        .full_slabs = { &(cache).full_slabs, &(cache).full_slabs },         \
+    }
+
+virtaddr_t kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, virtaddr_t obj);
@@ -0,0 +1,57 @@
+/******************************************************************************\
+**
+**  This file is part of the Poseidon Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2018-2024 - The Poseidon Authors
+**
+\******************************************************************************/
+
+/*
+** Architecture-independent API to allocate large, page-granular, virtually
+** contiguous kernel memory.
+*/
+
+#pragma once
+
+#include "poseidon/poseidon.h"
+#include "poseidon/memory/memory.h"
+#include "poseidon/memory/vmm.h"
+#include "lib/list.h"
+
+/*
+** Number of buckets of the hash table used to find an area from its address.
+*/
+#define VMALLOC_HASH_SIZE   256u
+
+/*
+** An allocation made with `vmalloc()`.
+**
+** Each area is preceded by an unmapped guard page, which also follows the area
+** before it. Areas are kept sorted by address, and hashed by address too.
+*/
+struct vmalloc_area {
+    virtaddr_t start;           // First page of the area
+    size_t size;                // Size of the area, excluding its guard page
+    bool device;                // Maps device memory, whose frames must not be freed
+    struct linked_list areas;   // List of all areas
+    struct vmalloc_area *hash_next; // Next area in the same bucket of the hash table
+};
+
+/*
+** Test whether the given address belongs to the range used by `vmalloc()`.
+*/
+static inline
+bool
+vmalloc_contains(
+    virtaddr_const_t va
+) {
+    return (uchar const *)va >= (uchar const *)ARCH_VMALLOC_START && (uchar const *)va < (uchar const *)ARCH_VMALLOC_END;
+}
+
+virtaddr_t vmalloc(size_t size);
+virtaddr_t vmalloc_zero(size_t size);
+virtaddr_t vmalloc_color(size_t size);
+virtaddr_t vmalloc_device(physaddr_t pa, size_t size);
+size_t vmalloc_size(virtaddr_const_t ptr);
+void vfree(virtaddr_t ptr);
@@ -14,7 +14,10 @@
 #pragma once
 
 #include "poseidon/poseidon.h"
+#include "poseidon/cpu/cpu.h"
 #include "poseidon/memory/memory.h"
+#include "arch/target/api/vaspace.h"
+#include "lib/sync/spinlock.h"
 
 /*
 ** Arch-indepentant flags for mmap
@@ -28,6 +31,9 @@
 #define MMAP_RDWR           0b00000010      // Page is readable and writable. Contradicts `MMAP_RDONLY`.
 #define MMAP_EXEC           0b00000100      // Page is executable.
                                             // Can be used with both `MMAP_RDONLY` and `MMAP_RDWR`.
+#define MMAP_ZERO           0b00001000      // Map frames filled with zeroes. Only meaningful for `vmm_map()`.
+#define MMAP_COLOR          0b00010000      // Spread the frames over the cache colors. Only meaningful for `vmm_map()`.
+                                            // Ignored when used with `MMAP_ZERO`.
 
 /* The integer type matching the above flags. */
 typedef uint mmap_flags_t;
@@ -38,12 +44,83 @@ typedef uint mmap_flags_t;
 /* The integer type matching the above flags. */
 typedef uint munmap_flags_t;
 
+/*
+** Amount of runs of pages whose frames a `struct tlb_gather` holds before it has
+** to be flushed.
+*/
+#define TLB_GATHER_SIZE     16u
+
+/*
+** A batch of TLB invalidations, gathered while mappings are modified and issued
+** at once by `tlb_gather_flush()`.
+**
+** Mapping a page that wasn't mapped doesn't need any invalidation, so a batch
+** only grows when mappings are removed or changed. It is a single range of
+** addresses, so a whole operation costs a single shootdown.
+**
+** The frames of the pages unmapped (and the page tables freed) are only given
+** back to the PMM once the batch is flushed, so no CPU can reach them through
+** a stale translation once they are reused. A batch freeing page tables also
+** interrupts idle CPUs, as their paging-structure caches may still point to
+** them.
+**
+** Use `TLB_GATHER_INIT` to initialize it.
+*/
+struct tlb_gather {
+    uintptr start;          // First address to invalidate
+    uintptr end;            // End of the range to invalidate (exclusive). Empty if `start >= end`.
+
+    // Runs of physically contiguous pages of the same size, whose frames are freed
+    // page by page.
+    size_t nb_pages;        // Amount of runs in `pages`
+    struct {
+        physaddr_t pa;
+        size_t size;        // Size of the whole run
+        size_t page;        // Size of each page
+    } pages[TLB_GATHER_SIZE];
+
+    bool freed_tables;      // Some of the frames are paging structures
+};
+
+#define TLB_GATHER_INIT     { .start = UINTPTR_MAX, .end = 0, .nb_pages = 0, .freed_tables = false }
+
+/*
+** A virtual address space.
+**
+** Only the user half of an address space is its own: the kernel's half is shared
+** by all of them, so a change there is seen everywhere.
+**
+** The VMM functions operate on the address space loaded on the current CPU (see
+** `vaspace_switch()`).
+*/
+struct vaspace {
+    struct arch_vaspace;        // Arch dependant stuff
+
+    // CPUs that may hold translations of the address space in their TLB, and are
+    // therefore concerned by TLB shootdowns of its user half.
+    cpumask_t cpus;
+
+    // Protects the paging structures of the user half. The one of `g_kernel_vaspace`
+    // protects those of the kernel's half, shared by all address spaces.
+    struct spinlock pt_lock;
+};
+
+// The address space of the kernel, which has no user half. Used by all kernel threads.
+extern struct vaspace g_kernel_vaspace;
+
 status_t vmm_map(virtaddr_t, size_t, mmap_flags_t);
 status_t vmm_map_device(virtaddr_t, physaddr_t, size_t, mmap_flags_t);
 status_t vmm_remap(virtaddr_t, physaddr_t, size_t, mmap_flags_t, munmap_flags_t);
-void vmm_unmap(virtaddr_t, size_t, munmap_flags_t);
+size_t vmm_unmap(virtaddr_t, size_t, munmap_flags_t);
 status_t vmm_validate_user_buffer(void const *, size_t);
 status_t vmm_validate_user_str(char const *, size_t *);
+void tlb_gather_add(struct tlb_gather *, virtaddr_const_t, size_t);
+void tlb_gather_free(struct tlb_gather *, physaddr_t, size_t);
+bool tlb_gather_can_free(struct tlb_gather const *, physaddr_t, size_t);
+void tlb_gather_free_table(struct tlb_gather *, physaddr_t);
+void tlb_gather_flush(struct tlb_gather *);
+status_t vaspace_new(struct vaspace **);
+void vaspace_free(struct vaspace *);
 
 /*
 ** Implement safe wrappers around the arch-dependent API.
@@ -73,6 +150,28 @@ vmm_is_mapped_user(
     return arch_vmm_is_mapped_user(va);
 }
 
+/*
+** Return the amount of bytes at the beginning of the `size` bytes starting at
+** `va` that are either all unmapped, or all mapped and all accessible or not to
+** user-space.
+**
+** Whether they are mapped is stored in `*mapped`, and whether they are mapped
+** and accessible to user-space is stored in `*user`.
+**
+** Ranges are walked with a constant amount of work per page at most, instead
+** of a full walk of the paging structures for each page.
+*/
+static inline
+size_t
+vmm_probe(
+    virtaddr_const_t va,
+    size_t size,
+    bool *mapped,
+    bool *user
+) {
+    return arch_vmm_probe(va, size, mapped, user);
+}
+
 /*
 ** Map the virtual address `va` on the physical address `pa` with the
 ** permission described in `flags`.
@@ -89,8 +188,34 @@ vmm_map_frame(
     return arch_vmm_map_frame(va, pa, flags);
 }
 
+/*
+** Map the beginning of the `size` bytes starting at `va` to the contiguous
+** frames starting at `pa`, using pages as big as the alignment of both
+** addresses, `size` and the architecture allow.
+**
+** As many pages as can be mapped with a single walk of the paging structures
+** are. The amount of bytes mapped is stored in `*mapped`, and the invalidations
+** needed are added to `tlb`.
+**
+** This function doesn't overwrite any existing mapping, failing instead.
+*/
+static inline
+status_t
+vmm_map_frames(
+    virtaddr_t va,
+    physaddr_t pa,
+    size_t size,
+    mmap_flags_t flags,
+    size_t *mapped,
+    struct tlb_gather *tlb
+) {
+    return arch_vmm_map_frames(va, pa, size, flags, mapped, tlb);
+}
+
 /*
 ** Unmap the virtual address `va`.
+**
+** If `va` is mapped by a large page, that page is split first.
 */
 static inline
 void
@@ -100,3 +225,114 @@ vmm_unmap_frame(
 ) {
     return arch_vmm_unmap_frame(va, flags);
 }
+
+/*
+** Unmap the page mapping `va`, splitting it first if it is a large page that
+** isn't entirely within the `size` bytes starting at `va`, and as many of the
+** following pages within those bytes as can be reached with the same walk of
+** the paging structures.
+**
+** Return the amount of bytes starting at `va` that are now unmapped, which is
+** at most `size`. The amount of bytes that were actually mapped is added to
+** `*unmapped`.
+**
+** The invalidations and the frames to free are added to `tlb`.
+*/
+static inline
+size_t
+vmm_unmap_frames(
+    virtaddr_t va,
+    size_t size,
+    munmap_flags_t flags,
+    struct tlb_gather *tlb,
+    size_t *unmapped
+) {
+    return arch_vmm_unmap_frames(va, size, flags, tlb, unmapped);
+}
+
+/*
+** Map the current CPU's scratch page, a page of kernel memory only ever accessed
+** by that CPU, to `frame`, storing the frame it was mapped to in `*old` unless
+** `old` is `NULL`, and return its address.
+**
+** Interrupts must be disabled until `vmm_scratch_unmap()` is called.
+*/
+static inline
+virtaddr_t
+vmm_scratch_map(
+    physaddr_t frame,
+    physaddr_t *old
+) {
+    return arch_vmm_scratch_map(frame, old);
+}
+
+/*
+** Map the current CPU's scratch page back to `old`, the frame it was mapped to
+** before `vmm_scratch_map()` was called.
+*/
+static inline
+void
+vmm_scratch_unmap(
+    physaddr_t old
+) {
+    arch_vmm_scratch_unmap(old);
+}
+
+/*
+** Let the current CPU skip TLB shootdowns while it is idle: it flushes its whole
+** TLB once `tlb_lazy_leave()` is called instead, if any was skipped.
+**
+** This must only be called right before halting, with interrupts disabled and
+** the kernel's address space loaded.
+*/
+static inline
+void
+tlb_lazy_enter(
+    void
+) {
+    arch_tlb_lazy_enter();
+}
+
+/*
+** Make TLB shootdowns target the current CPU again (see `tlb_lazy_enter()`).
+**
+** Interrupts must be disabled.
+*/
+static inline
+void
+tlb_lazy_leave(
+    void
+) {
+    arch_tlb_lazy_leave();
+}
+
+/*
+** Prepare the kernel's address space, so that its half can be shared with all
+** the other address spaces.
+**
+** This must be called before the vmalloc area is used.
+*/
+static inline
+status_t
+vaspace_init(
+    void
+) {
+    return arch_vaspace_init();
+}
+
+/*
+** Load the given address space on the current CPU.
+**
+** The TLB entries of the address space it replaces are kept whenever the CPU
+** can tag them, so switching back and forth between address spaces keeps
+** them warm.
+**
+** Interrupts must be disabled.
+*/
+static inline
+void
+vaspace_switch(
+    struct vaspace *vaspace
+) {
+    arch_vaspace_switch(vaspace);
+}
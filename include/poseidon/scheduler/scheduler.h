@@ -12,10 +12,14 @@
 #include "lib/list.h"
 #include "lib/sync/spinlock.h"
 
+struct thread;
+
 extern struct linked_list g_sched_runnable_threads;
 extern struct spinlock g_sched_runnable_threads_lock;
 
 void *reschedule(void *);
 void yield(void);
+void sleep(bool const *wakeup_pending);
+void wakeup(struct thread *thread);
 
 void enter_scheduler(void *scheduler_stack);
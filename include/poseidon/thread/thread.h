@@ -30,6 +30,7 @@ enum thread_state {
     NONE = 0,
     RUNNABLE,
     RUNNING,
+    SLEEPING,
     ZOMBIE,
 };
 
@@ -41,6 +42,7 @@ static char const *thread_state_str[] = {
     [NONE]              = "NONE",
     [RUNNABLE]          = "RUNNABLE",
     [RUNNING]           = "RUNNING",
+    [SLEEPING]          = "SLEEPING",
     [ZOMBIE]            = "ZOMBIE",
 };
 
@@ -66,6 +68,7 @@ struct thread {
     char name[256];                             // Thread's name
     struct thread *parent;                      // Parent thread
     thread_entry entry;                         // Entry point
+    struct vaspace *vaspace;                    // Address space
 
     // The following is protected by the rwlock within the structure.
     struct {
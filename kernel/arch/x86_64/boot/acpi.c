@@ -22,6 +22,7 @@
 #include "arch/x86_64/ioapic.h"
 #include "poseidon/cpu/cpu.h"
 #include "poseidon/memory/memory.h"
+#include "poseidon/memory/pmm.h"
 #include "lib/log.h"
 #include "lib/checksum.h"
 #include "lib/string.h"
@@ -30,6 +31,8 @@ static struct rsdp const *g_rsdp = nullptr;
 static struct rsdt const *g_rsdt = nullptr;
 static struct fadt const *g_fadt = nullptr;
 static struct madt const *g_madt = nullptr;
+static struct srat const *g_srat = nullptr;
+static struct slit const *g_slit = nullptr;
 
 /*
 ** Look for the Root System Description Pointer (RSDP) Structure `start` to `start + len`.
@@ -174,6 +177,172 @@ acpi_parse_madt(
     }
 }
 
+/*
+** Return the NUMA node matching the given proximity domain, allocating a new
+** one if it's the first time that domain is encountered.
+**
+** `domains` holds the proximity domain of each of the `*nb_nodes` nodes
+** allocated so far.
+*/
+static
+uint
+acpi_numa_node(
+    uint32_t *domains,
+    uint *nb_nodes,
+    uint32_t domain
+) {
+    uint node;
+
+    for (node = 0; node < *nb_nodes; ++node) {
+        if (domains[node] == domain) {
+            return node;
+        }
+    }
+
+    if (*nb_nodes == KCONFIG_MAX_NUMA_NODES) {
+        logln("ACPI: too many proximity domains, domain %u is merged with the first one.", domain);
+        return 0;
+    }
+
+    domains[*nb_nodes] = domain;
+    return (*nb_nodes)++;
+}
+
+/*
+** Assign the given NUMA node to the CPU with the given APIC ID, if any.
+*/
+static
+void
+acpi_set_cpu_node(
+    uint32_t apic_id,
+    uint node
+) {
+    struct cpu *cpu;
+
+    for (cpu = g_cpus; cpu < g_cpus + g_cpus_len; ++cpu) {
+        if (cpu->apic_id == apic_id) {
+            cpu->node = node;
+        }
+    }
+}
+
+/*
+** Parse the SRAT and the SLIT, if any, to find the NUMA node of each CPU and
+** memory range, and make the physical memory manager aware of them.
+**
+** This must be called after `acpi_parse_madt()`, once all CPUs are known.
+*/
+void
+acpi_parse_srat(
+    void
+) {
+    struct srat_entry_header const *header;
+    struct pmm_node_range *ranges;
+    uint32_t domains[KCONFIG_MAX_NUMA_NODES];
+    uint8 *distances;
+    size_t nb_ranges;
+    uint nb_nodes;
+    uint node;
+    uint i;
+    uint j;
+
+    if (!g_srat) {
+        return ;
+    }
+
+    // Count the memory ranges to allocate the right amount of `struct pmm_node_range`.
+    nb_ranges = 0;
+    header = (struct srat_entry_header const *)g_srat->entries;
+    while ((char *)header < (char *)g_srat + g_srat->len) {
+        nb_ranges += (header->type == SRAT_MEMORY_AFFINITY);
+        header = (struct srat_entry_header const *)((char *)header + header->length);
+    }
+
+    ranges = nullptr;
+    if (nb_ranges) {
+        ranges = kheap_alloc(sizeof(struct pmm_node_range) * nb_ranges);
+        assert(ranges != nullptr);
+    }
+
+    nb_nodes = 0;
+    nb_ranges = 0;
+    header = (struct srat_entry_header const *)g_srat->entries;
+    while ((char *)header < (char *)g_srat + g_srat->len) {
+        switch (header->type) {
+            case SRAT_PROCESSOR_LOCAL_APIC_AFFINITY: {
+                struct srat_processor_local_apic_affinity_entry const *entry;
+
+                entry = (struct srat_processor_local_apic_affinity_entry const *)header;
+                if (entry->flags & SRAT_AFFINITY_ENABLED) {
+                    node = acpi_numa_node(
+                        domains,
+                        &nb_nodes,
+                        entry->proximity_domain_low
+                            | (entry->proximity_domain_high[0] << 8)
+                            | (entry->proximity_domain_high[1] << 16)
+                            | ((uint32_t)entry->proximity_domain_high[2] << 24)
+                    );
+                    acpi_set_cpu_node(entry->apic_id, node);
+                }
+                break;
+            };
+            case SRAT_PROCESSOR_LOCAL_X2APIC_AFFINITY: {
+                struct srat_processor_local_x2apic_affinity_entry const *entry;
+
+                entry = (struct srat_processor_local_x2apic_affinity_entry const *)header;
+                if (entry->flags & SRAT_AFFINITY_ENABLED) {
+                    node = acpi_numa_node(domains, &nb_nodes, entry->proximity_domain);
+                    acpi_set_cpu_node(entry->x2apic_id, node);
+                }
+                break;
+            };
+            case SRAT_MEMORY_AFFINITY: {
+                struct srat_memory_affinity_entry const *entry;
+
+                entry = (struct srat_memory_affinity_entry const *)header;
+                if (entry->flags & SRAT_AFFINITY_ENABLED) {
+                    ranges[nb_ranges].start = entry->base;
+                    ranges[nb_ranges].end = entry->base + entry->len;
+                    ranges[nb_ranges].node = acpi_numa_node(domains, &nb_nodes, entry->proximity_domain);
+                    ++nb_ranges;
+                }
+                break;
+            };
+            default: break;
+        }
+        header = (struct srat_entry_header const *)((char *)header + header->length);
+    }
+
+    if (!nb_nodes) {
+        kheap_free(ranges);
+        return ;
+    }
+
+    logln("ACPI: %u NUMA node(s) found.", nb_nodes);
+
+    // Translate the SLIT's matrix, indexed by proximity domains, to one indexed by nodes.
+    distances = nullptr;
+    if (g_slit) {
+        distances = kheap_alloc(nb_nodes * nb_nodes);
+        assert(distances != nullptr);
+
+        for (i = 0; i < nb_nodes; ++i) {
+            for (j = 0; j < nb_nodes; ++j) {
+                if (domains[i] < g_slit->localities && domains[j] < g_slit->localities) {
+                    distances[i * nb_nodes + j] = g_slit->entries[domains[i] * g_slit->localities + domains[j]];
+                } else {
+                    distances[i * nb_nodes + j] = (i == j) ? 10 : 20;
+                }
+            }
+        }
+    }
+
+    assert_ok(pmm_numa_init(ranges, nb_ranges, nb_nodes, distances));
+
+    kheap_free(distances);
+    kheap_free(ranges);
+}
+
 /*
 ** Find and parse the ACPI tables.
 */
@@ -216,6 +385,18 @@ acpi_init(
         // Log its signature
         log(", %.4s", sdth->signature);
 
+        // Map the whole table if it doesn't fit in the first mapping.
+        if (sdth->len > PAGE_SIZE) {
+            size_t len;
+
+            len = sdth->len;
+            kheap_free(unaligned_ptr);
+            sdth = acpi_map_table(g_rsdt->entries[i], len, &unaligned_ptr);
+            if (!sdth) {
+                panic("Failed to map an entry of the ACPI's Root Descriptor Table");
+            }
+        }
+
         // Check if that signature matches something we're interested in.
         if (!memcmp(sdth->signature, "FACP", 4)) {
             g_fadt = (struct fadt const *)sdth;
@@ -223,6 +404,12 @@ acpi_init(
         } else  if (!memcmp(sdth->signature, "APIC", 4)) {
             g_madt = (struct madt const *)sdth;
             continue;
+        } else if (!memcmp(sdth->signature, "SRAT", 4)) {
+            g_srat = (struct srat const *)sdth;
+            continue;
+        } else if (!memcmp(sdth->signature, "SLIT", 4)) {
+            g_slit = (struct slit const *)sdth;
+            continue;
         }
 
         // Free the entries we're not interested in
@@ -236,4 +423,5 @@ acpi_init(
     }
 
     acpi_parse_madt();
+    acpi_parse_srat();
 }
@@ -129,6 +129,57 @@ static char const * const g_features_name[ARRAY_LENGTH(((struct cpuid *)NULL)->f
     },
 };
 
+/*
+** Walk the deterministic cache parameters reported by the CPUID function `leaf`
+** (0x4 on Intel, 0x8000001D on AMD), one sub-leaf per cache, and store the
+** geometry of the data or unified cache with the highest level in `cpuid->llc`.
+*/
+static
+void
+cpuid_load_llc(
+    struct cpuid *cpuid,
+    uint32 leaf
+) {
+    uint32 eax;
+    uint32 ebx;
+    uint32 ecx;
+    uint32 type;
+    uint32 level;
+    uint32 i;
+
+    // The amount of sub-leaves isn't reported, but the last one has a null type.
+    for (i = 0; i < 16; ++i) {
+        asm volatile(
+            "cpuid"
+            :
+                "=a"(eax),
+                "=b"(ebx),
+                "=c"(ecx)
+            : "a"(leaf), "c"(i)
+            : "edx"
+        );
+
+        type = eax & 0x1F;
+        level = (eax >> 5) & 0x7;
+
+        if (!type) {
+            break;
+        }
+
+        // Skip instruction caches.
+        if (type != 1 && type != 3) {
+            continue;
+        }
+
+        if (level >= cpuid->llc.level) {
+            cpuid->llc.level = level;
+            cpuid->llc.line_size = (ebx & 0xFFF) + 1;
+            cpuid->llc.ways = ((ebx >> 22) & 0x3FF) + 1;
+            cpuid->llc.sets = ecx + 1;
+        }
+    }
+}
+
 /*
 ** Use the `cpuid` instructio to discover the features available to the currently
 ** running CPU.
@@ -224,6 +275,11 @@ cpuid_load(
         );
     }
 
+    // Load the geometry of the last level cache (CPUID.EAX=0x4)
+    if (cpuid->max_cpuid >= 0x4) {
+        cpuid_load_llc(cpuid, 0x4);
+    }
+
     // Load the maximum input value for extended function CPUID information.
     asm volatile(
         "cpuid"
@@ -267,6 +323,11 @@ cpuid_load(
         }
     }
 
+    // AMD reports its caches through CPUID.EAX=0x8000001D instead.
+    if (!cpuid->llc.level && cpuid->max_extended_cpuid >= 0x8000001D) {
+        cpuid_load_llc(cpuid, 0x8000001D);
+    }
+
     // Find the maximum physical address number
     if (cpuid->max_extended_cpuid >= 0x80000008) {
         uint8 eax[4];
@@ -307,6 +368,14 @@ cpuid_dump(
     logln("model name       | %s", cpuid->brand);
     logln("stepping         | %i", cpuid->version.stepping_id);
     logln("clflush size     | %i", cpuid->clflush_size);
+    logln(
+        "last level cache | L%u, %u KiB, %u-way, %u sets of %u bytes lines",
+        cpuid->llc.level,
+        cpuid->llc.ways * cpuid->llc.sets * cpuid->llc.line_size / 1024,
+        cpuid->llc.ways,
+        cpuid->llc.sets,
+        cpuid->llc.line_size
+    );
     logln(
         "address size     | %i bits physical, %i bits virtual",
         cpuid->maxphyaddr,
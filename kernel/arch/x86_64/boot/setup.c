@@ -19,6 +19,7 @@
 #include "arch/x86_64/acpi.h"
 #include "arch/x86_64/cpu.h"
 #include "arch/x86_64/msr.h"
+#include "arch/x86_64/memory.h"
 #include "poseidon/boot/init_hook.h"
 #include "poseidon/memory/pmm.h"
 #include "poseidon/cpu/cpu.h"
@@ -92,6 +93,8 @@ bsp_setup(
 
     common_setup();
 
+    cpu_get_bsp()->started = true;
+
 #if KCONFIG_SMP
     logln("Number of cpus: %u", g_cpus_len);
 
@@ -107,6 +110,8 @@ REGISTER_INIT_HOOK(bsp_setup, &bsp_setup, INIT_LEVEL_ARCH);
 
 /*
 ** Continue the early initialisation of the other CPUs.
+**
+** The trampoline calls `ap_start()` once this returns.
 */
 [[boot_text]]
 void
@@ -123,6 +128,20 @@ ap_setup(
     cpuid_load(&cpu->cpuid);
 
     common_setup();
+}
+
+/*
+** Let the BSP know the current AP is started, and hand it to the scheduler.
+**
+** The BSP releases the boot sections once all APs are started, so this must
+** not be tagged `[[boot_text]]`, and the AP must not return to boot code
+** afterwards.
+*/
+void
+ap_start(
+    void
+) {
+    atomic_store(&current_cpu()->started, true, ATOMIC_RELEASE);
 
     yield();
 }
@@ -136,12 +155,9 @@ void
 common_setup(
     void
 ) {
-    struct cpu *cpu;
-
     idt_load();
 
-    cpu = current_cpu();
-    cpu->started = true;
+    tlb_cpu_setup();
 }
 
 /*
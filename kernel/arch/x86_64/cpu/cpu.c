@@ -11,11 +11,14 @@
 #include "arch/x86_64/cmos.h"
 #include "arch/x86_64/rdtsc.h"
 #include "arch/x86_64/cpu.h"
+#include "arch/x86_64/gdt.h"
 #include "arch/x86_64/apic.h"
+#include "arch/x86_64/memory.h"
 #include "poseidon/poseidon.h"
 #include "poseidon/cpu/cpu.h"
 #include "poseidon/memory/memory.h"
 #include "lib/log.h"
+#include "lib/string.h"
 
 // Variable shared with the AP starting up to give it its kernel stack.
 [[boot_data]]
@@ -71,7 +74,7 @@ cpu_start_ap(
     assert((addr & 0xFFF00FFF) == 0);
 
     // Allocate stack for the new cpu
-    ap->scheduler_stack = kheap_alloc_aligned(KCONFIG_KERNEL_STACK_SIZE);
+    ap->scheduler_stack = kheap_alloc_aligned(KCONFIG_KERNEL_STACK_SIZE, PAGE_SIZE);
     ap->scheduler_stack_top = (uchar *)ap->scheduler_stack + KCONFIG_KERNEL_STACK_SIZE;
 
     if (ap->scheduler_stack == NULL) {
@@ -120,6 +123,8 @@ cpu_start_all_aps(
     *(ushort *)(CPU_TRAMPOLINE_START + 1) = (uint16)(uintptr)&start_ap + 0x10;
     *(ushort *)(CPU_TRAMPOLINE_START + 3) = 0xFFFF;
 
+    memcpy((void *)CPU_TRAMPOLINE_GDT_FATPTR, &g_gdt_fatptr, sizeof(g_gdt_fatptr));
+
     /* Start all available cpus */
     for (cpu = g_cpus; cpu < g_cpus + g_cpus_len; ++cpu) {
         if (cpu == cpu_get_bsp()) {
@@ -134,9 +139,39 @@ cpu_start_all_aps(
             if (volatile_read(&cpu->started)) {
                 break;
             }
+            arch_cpu_relax();
         }
 
         logln(" done!");
     }
 }
 
+
+/*
+** Hint the CPU that it is spinning, and answer the requests other CPUs may be
+** waiting for in the meantime (see `tlb_shootdown_poll()`).
+**
+** This is called in every busy-wait loop, whether interrupts are enabled or not.
+*/
+void
+arch_cpu_relax(
+    void
+) {
+    asm volatile("pause");
+    tlb_shootdown_poll();
+}
+
+/*
+** Return the size of a single way of the last level cache of the current CPU,
+** that is the stride after which physical addresses map to the same cache sets
+** again, or 0 if the CPU doesn't report it.
+*/
+size_t
+arch_cpu_cache_way_size(
+    void
+) {
+    struct cpuid const *cpuid;
+
+    cpuid = &current_cpu()->cpuid;
+    return (size_t)cpuid->llc.sets * cpuid->llc.line_size;
+}
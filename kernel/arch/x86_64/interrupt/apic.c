@@ -109,6 +109,27 @@ apic_ipi_broadcast(
     );
 }
 
+/*
+** Send the given IPI to the given CPU.
+**
+** NOTE: The CPU *must* have a valid apic_id.
+*/
+void
+apic_ipi_send(
+    struct cpu const *cpu,
+    uint8_t vector
+) {
+    // Wait for the previous IPI to be sent before overwriting the ICR.
+    while (apic_read(APIC_ICR_LOW) & APIC_ICR_PENDING) {
+        arch_cpu_relax();
+    }
+
+    apic_send_ipi_raw(
+        cpu->apic_id << 24u,
+        vector | APIC_ICR_FIXED | APIC_ICR_LEVEL
+    );
+}
+
 /*
 ** Send the init IPI to the given CPU.
 **
@@ -271,18 +292,13 @@ apic_panic_ihandler(
 ** When a core modifies the paging structure and invalidates the TLB it must
 ** notify the other cores to invalidate their TLB too.
 **
-** Soooo, some people write some nice and efficient algorithms to handle this shit,
-** but eeeh, we'll go for the quick & dirty way instead :D
+** The IPI carries a whole range of addresses (see `arch_tlb_flush()`), and the
+** initiator waits until each targeted core is done.
 */
 void
 apic_tlb_ihandler(
     void
 ) {
-    asm volatile(
-        "invlpg (%%rax)"
-        :
-        : "a"(g_tlb_shootdown_target)
-        :
-    );
+    tlb_shootdown_poll();
     apic_eoi();
 }
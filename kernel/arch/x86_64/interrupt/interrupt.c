@@ -9,6 +9,7 @@
 
 #include "arch/x86_64/interrupt.h"
 #include "poseidon/interrupt.h"
+#include "poseidon/memory/vmm.h"
 #include "lib/log.h"
 
 interrupt_handler_t g_irq_handlers[INT_NB];
@@ -32,6 +33,9 @@ common_int_handler(
             panic("Unhandled exception %#x", iframe->int_vector);
             break;
         case INT_IRQ0 ... INT_NB:
+            // An idle CPU may have skipped shootdowns, flush its TLB before it touches anything.
+            tlb_lazy_leave();
+
             if (g_irq_handlers[iframe->int_vector]) {
                 g_irq_handlers[iframe->int_vector](iframe);
             } else {
@@ -23,7 +23,7 @@ ioapic_map(
     physaddr_t pa
 ) {
     /* Mark the frame of the IOAPIC as allocated */
-    pmm_mark_range_as_allocated(pa, pa + PAGE_SIZE);
+    pmm_mark_range_as_allocated(pa, PAGE_SIZE);
 
     /* Map it to memory */
     g_ioapic = kheap_alloc_device(
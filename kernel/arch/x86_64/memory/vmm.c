@@ -10,20 +10,83 @@
 /*
 ** Low-level memory-related functions and types.
 **
+** Pages are mapped through the recursive mapping of the PML4 (its last entry
+** points to itself), which makes every paging structure reachable at a fixed
+** address.
+**
+** Besides regular 4KiB pages, 2MiB pages (a PDE with the `size` bit set) and,
+** when the CPU supports them, 1GiB pages (a PDPTE with the `size` bit set) are
+** used whenever both the virtual and the physical ranges allow it. Unmapping
+** part of a large page splits it first.
+**
+** Ranges are mapped, unmapped and probed by walking the paging structures once
+** and then going through the consecutive entries of the one reached, only
+** walking them again past its end (see `find_page()`).
+**
+** The paging structures are modified and walked with a lock held: the one of
+** the current address space for its user half, and the one of the kernel's
+** address space for the kernel's half (see `pt_lock()`). The paging structures
+** that are missing are allocated before taking it, as running low on memory may
+** unmap pages.
+**
+** Invalidations are gathered in a `struct tlb_gather` and issued once per
+** operation (see `arch_tlb_flush()`). Mapping a page that wasn't mapped needs
+** none, as non-present entries are never cached.
+**
+** Shootdowns only interrupt the CPUs that may hold the translations and aren't
+** idle, and wait for each of them to be done.
+**
+** Each address space has its own PML4, whose kernel entries are copied from the
+** kernel's one. When supported, its TLB entries are tagged with a PCID so they
+** survive switching to another address space and back.
+**
 ** TODO: List all the features supported.
 */
 
 #include "arch/x86_64/memory.h"
 #include "arch/x86_64/apic.h"
 #include "arch/x86_64/interrupt.h"
+#include "poseidon/cpu/cpu.h"
+#include "poseidon/interrupt.h"
 #include "poseidon/memory/pmm.h"
 #include "poseidon/memory/vmm.h"
 #include "lib/string.h"
 #include "lib/sync/spinlock.h"
 
-virtaddr_t g_tlb_shootdown_target;
+/*
+** Bits of an entry of any level of the paging structures holding the address
+** of the frame it points to, and the `size` bit of PDPTEs and PDEs.
+*/
+#define ENTRY_FRAME_MASK        0x000FFFFFFFFFF000ull
+#define ENTRY_SIZE_BIT          (1ull << 7u)
+
+struct tlb_shootdown_target g_tlb_shootdown_target;
 static struct spinlock g_tlb_shootdown_target_lock;
 
+/*
+** The last PCID handed out, with its generation in the upper bits.
+**
+** PCIDs are handed out in order. Once they are all taken, a new generation
+** starts and they are handed out again: an address space whose PCID belongs to
+** an old generation gets a new one the next time it is loaded, and a CPU flushes
+** its whole TLB before using the PCIDs of a new generation.
+*/
+static uint64 g_pcid_last = 1ull << PCID_BITS;
+static struct spinlock g_pcid_lock;
+
+/*
+** Set by `arch_vaspace_init()`, once the PML4 entries of the kernel's half all
+** exist and can be shared.
+*/
+static bool g_vaspace_kernel_shared;
+
+/*
+** A page for each CPU, within the kernel's image, that is temporarily remapped
+** to a frame that CPU needs to access, like the paging structures it fills or
+** the frames the PMM zeroes (see `arch_vmm_scratch_map()`).
+*/
+[[gnu::aligned(PAGE_SIZE)]] static uint8 g_vmm_scratch_pages[KCONFIG_MAX_CPUS][PAGE_SIZE];
+
 /*
 ** Return the address of the current PML4.
 **
@@ -77,32 +140,339 @@ get_pt_of(
 }
 
 /*
-** Invalidate the TLB cache of the given address.
-**
-** This function also sends an IPI to ask the other cores to do the same.
-** It should be called each time the mapping is modified.
+** Invalidate the TLB entry of the given address on the current CPU only.
 */
+static inline
 void
-tlb_invalidate_page(
-    virtaddr_t va
+invlpg(
+    virtaddr_const_t va
 ) {
-    /* Invalidate the page */
     asm volatile(
         "invlpg (%%rax)"
         :
         : "a"(va)
-        :
+        : "memory"
     );
+}
+
+/*
+** Test whether the range of addresses `[start, end)` is within the user half of
+** the address spaces.
+*/
+static inline
+bool
+is_user_range(
+    virtaddr_const_t start,
+    virtaddr_const_t end
+) {
+    return start >= ARCH_VASPACE_USER_START && end <= ARCH_VASPACE_USER_END;
+}
+
+/*
+** Disable interrupts and acquire the lock protecting the paging structures of
+** the range of addresses `[start, end)` in the current address space, storing
+** the interrupt state in `*state`, and return it.
+**
+** It is the lock of the current address space for its user half, and the one
+** of the kernel's address space for the kernel's half.
+*/
+static
+struct spinlock *
+pt_lock(
+    virtaddr_const_t start,
+    virtaddr_const_t end,
+    bool *state
+) {
+    struct vaspace *vaspace;
+    struct spinlock *lock;
+
+    push_interrupts_state(state);
+    disable_interrupts();
+
+    vaspace = NULL;
+    if (is_user_range(start, end)) {
+        vaspace = atomic_load(&current_cpu()->vaspace, ATOMIC_RELAXED);
+    }
+    if (!vaspace) {
+        vaspace = &g_kernel_vaspace;
+    }
+
+    lock = &vaspace->pt_lock;
+    spinlock_acquire(lock);
+    return lock;
+}
+
+/*
+** Release a lock acquired with `pt_lock()` and restore the interrupt state.
+*/
+static
+void
+pt_unlock(
+    struct spinlock *lock,
+    bool *state
+) {
+    spinlock_release(lock);
+    pop_interrupts_state(state);
+}
+
+/*
+** Flush the TLB entries of all PCIDs on the current CPU.
+**
+** Reloading CR3 only flushes the entries of the current PCID, but toggling
+** CR4.PGE flushes them all.
+*/
+static
+void
+tlb_flush_all_local(
+    void
+) {
+    struct cr4 cr4;
+
+    if (!current_cpu()->tlb_pcid) {
+        set_cr3(get_cr3());
+        return ;
+    }
+
+    cr4 = get_cr4();
+    cr4.pge = !cr4.pge;
+    set_cr4(cr4);
+    cr4.pge = !cr4.pge;
+    set_cr4(cr4);
+}
+
+/*
+** Invalidate the TLB entries of the range of addresses `[start, end)` on the
+** current CPU only.
+**
+** If the range is within the user half of `vaspace` and it isn't loaded, its
+** TLB entries are flushed the next time it is instead.
+**
+** Past `TLB_FLUSH_FULL_THRESHOLD` pages, the TLB entries of the current PCID are
+** flushed by reloading CR3, which is cheaper than that many `invlpg`. Global
+** pages aren't used, so this flushes everything else.
+**
+** Both only affect the current PCID, so the kernel's half is also flushed from
+** the other PCIDs before they are used again.
+*/
+void
+tlb_flush_local(
+    struct vaspace *vaspace,
+    virtaddr_t start,
+    virtaddr_t end
+) {
+    struct cpu *cpu;
+    uchar *va;
+    uint pcid;
+
+    cpu = current_cpu();
+
+    if (vaspace && vaspace != atomic_load(&cpu->vaspace, ATOMIC_SEQ_CST)) {
+        return ; // The initiator marked the address space as stale already.
+    }
+
+    if ((uchar *)end - (uchar *)start > TLB_FLUSH_FULL_THRESHOLD * PAGE_SIZE) {
+        set_cr3(get_cr3());
+    } else {
+        for (va = ROUND_DOWN(start, PAGE_SIZE); va < (uchar *)end; va += PAGE_SIZE) {
+            invlpg(va);
+        }
+    }
+
+    if (vaspace) {
+        // This CPU is up to date.
+        atomic_fetch_and(&vaspace->tlb_stale, ~(1u << cpu->cpu_id), ATOMIC_SEQ_CST);
+    } else if (cpu->tlb_pcid) {
+        pcid = get_cr3().pcid;
+        memset(cpu->tlb_stale_pcids, 0xFF, sizeof(cpu->tlb_stale_pcids));
+        cpu->tlb_stale_pcids[pcid / 64u] &= ~(1ull << (pcid % 64u));
+    }
+}
+
+/*
+** Invalidate the TLB entries of the range of addresses `[start, end)`.
+**
+** This function also sends a single IPI to the other cores that may hold those
+** translations, asking them to do the same for the whole range, and waits until
+** they are done.
+**
+** If the range is within the user half, only the cores running the current
+** address space are interrupted. The others flush its TLB entries the next time
+** they load it.
+**
+** Otherwise, idle cores aren't interrupted: they flush their whole TLB when they
+** wake up instead (see `arch_tlb_lazy_enter()`). That is, unless `freed_tables`
+** is set: their paging-structure caches may still point to the paging structures
+** that are about to be freed, and they could walk them speculatively before
+** waking up, so they are interrupted too.
+*/
+void
+arch_tlb_flush(
+    virtaddr_t start,
+    virtaddr_t end,
+    bool freed_tables
+) {
+    struct vaspace *vaspace;
+    struct cpu *cpu;
+    cpumask_t targets;
+    uint tlb_state;
+    bool state;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    vaspace = is_user_range(start, end) ? atomic_load(&current_cpu()->vaspace, ATOMIC_SEQ_CST) : NULL;
+
+    tlb_flush_local(vaspace, start, end);
+
+    targets = atomic_load(vaspace ? &vaspace->cpus : &g_kernel_vaspace.cpus, ATOMIC_SEQ_CST);
+    targets &= ~(1u << current_cpu()->cpu_id);
+    if (!targets) {
+        goto end;
+    }
 
     spinlock_acquire(&g_tlb_shootdown_target_lock);
 
-    g_tlb_shootdown_target = va;
+    g_tlb_shootdown_target.vaspace = vaspace;
+    g_tlb_shootdown_target.start = start;
+    g_tlb_shootdown_target.end = end;
+
+    for (cpu = g_cpus; cpu < g_cpus + g_cpus_len; ++cpu) {
+        if (!(targets & (1u << cpu->cpu_id))) {
+            continue;
+        }
+
+        if (vaspace) {
+            // Leave the cores that don't run the address space be, they will flush its TLB
+            // entries when they load it. The mark comes first so it can't be missed if they
+            // load it in the meantime.
+            atomic_fetch_or(&vaspace->tlb_stale, 1u << cpu->cpu_id, ATOMIC_SEQ_CST);
+            if (atomic_load(&cpu->vaspace, ATOMIC_SEQ_CST) != vaspace) {
+                targets &= ~(1u << cpu->cpu_id);
+                continue;
+            }
+        } else if (!freed_tables) {
+            // Leave idle cores be, they will flush their TLB when they wake up.
+            tlb_state = TLB_LAZY;
+            if (
+                atomic_compare_exchange(&cpu->tlb_state, &tlb_state, TLB_LAZY_FLUSH, ATOMIC_SEQ_CST, ATOMIC_SEQ_CST)
+                || tlb_state == TLB_LAZY_FLUSH
+            ) {
+                targets &= ~(1u << cpu->cpu_id);
+                continue;
+            }
+        }
+
+        atomic_store(&cpu->tlb_shootdown_pending, true, ATOMIC_RELEASE);
+        apic_ipi_send(cpu, INT_TLB);
+    }
 
-    // Send the IPI to the other cores
-    apic_ipi_broadcast(INT_TLB);
-    apic_ipi_acked();
+    // Wait for the targeted cores to be done.
+    for (cpu = g_cpus; cpu < g_cpus + g_cpus_len; ++cpu) {
+        if (targets & (1u << cpu->cpu_id)) {
+            while (atomic_load(&cpu->tlb_shootdown_pending, ATOMIC_ACQUIRE)) {
+                arch_cpu_relax();
+            }
+        }
+    }
 
     spinlock_release(&g_tlb_shootdown_target_lock);
+
+end:
+    pop_interrupts_state(&state);
+}
+
+/*
+** Perform the shootdown targeting the current CPU, if any, and let the CPU that
+** initiated it know it is done.
+**
+** Besides the TLB shootdown IPI, this is also called while spinning, so a CPU
+** waiting with interrupts disabled for a lock held by the initiator doesn't
+** deadlock it.
+*/
+void
+tlb_shootdown_poll(
+    void
+) {
+    struct cpu *cpu;
+
+    cpu = current_cpu();
+    if (atomic_load(&cpu->tlb_shootdown_pending, ATOMIC_ACQUIRE)) {
+        tlb_flush_local(g_tlb_shootdown_target.vaspace, g_tlb_shootdown_target.start, g_tlb_shootdown_target.end);
+        atomic_store(&cpu->tlb_shootdown_pending, false, ATOMIC_RELEASE);
+    }
+}
+
+/*
+** Put the current CPU in lazy TLB mode, which it must stay in until
+** `arch_tlb_lazy_leave()` is called.
+**
+** Shootdowns of the kernel's half don't interrupt CPUs in lazy TLB mode, unless
+** they free paging structures, so this must only be called right before halting,
+** with the kernel's address space loaded. Any interrupt taken in the meantime
+** leaves that mode.
+**
+** Interrupts must be disabled.
+*/
+void
+arch_tlb_lazy_enter(
+    void
+) {
+    atomic_store(&current_cpu()->tlb_state, TLB_LAZY, ATOMIC_SEQ_CST);
+}
+
+/*
+** Take the current CPU out of lazy TLB mode, if it is in it, flushing its whole
+** TLB if a shootdown was skipped in the meantime.
+**
+** Interrupts must be disabled.
+*/
+void
+arch_tlb_lazy_leave(
+    void
+) {
+    struct cpu *cpu;
+
+    cpu = current_cpu();
+
+    // Only the CPU itself marks itself as active, so this is a safe shortcut.
+    if (atomic_load(&cpu->tlb_state, ATOMIC_RELAXED) == TLB_ACTIVE) {
+        return ;
+    }
+
+    if (atomic_exchange(&cpu->tlb_state, TLB_ACTIVE, ATOMIC_SEQ_CST) == TLB_LAZY_FLUSH) {
+        tlb_flush_local(NULL, NULL, (virtaddr_t)UINTPTR_MAX);
+    }
+}
+
+/*
+** Add the current CPU to the CPUs targeted by shootdowns of the kernel's half,
+** load the kernel's address space and enable PCIDs if they are supported.
+**
+** Its TLB is flushed afterwards, as it may have cached translations that changed
+** before it could be targeted.
+*/
+void
+tlb_cpu_setup(
+    void
+) {
+    struct cpu *cpu;
+    struct cr4 cr4;
+
+    cpu = current_cpu();
+
+    atomic_fetch_or(&g_kernel_vaspace.cpus, 1u << cpu->cpu_id, ATOMIC_SEQ_CST);
+    atomic_store(&cpu->vaspace, &g_kernel_vaspace, ATOMIC_SEQ_CST);
+
+    // Flushing all PCIDs at once relies on CR4.PGE (see `tlb_flush_all_local()`).
+    // CR3 holds PCID 0 at this point, as required to enable them.
+    if (cpu->cpuid.features.pcid && cpu->cpuid.features.pge) {
+        cr4 = get_cr4();
+        cr4.pcide = true;
+        set_cr4(cr4);
+        cpu->tlb_pcid = true;
+    }
+
+    tlb_flush_all_local();
 }
 
 /*
@@ -113,186 +483,1120 @@ tlb_invalidate_page(
 */
 
 /*
-** Test whether the given virtual address is mapped.
+** Walk the paging structures down to the entry mapping the address `val`,
+** whatever the size of the page it maps, and return it.
+**
+** The walk stops at the first entry that isn't present, which is returned
+** instead. The size of the memory covered by the returned entry is stored in
+** `*size` and, unless `user` is `NULL`, whether all the entries walked before it
+** grant access to user-space is stored in `*user`.
 **
-** This is done by testing every entry in the paging structure, ensuring they
-** all have the `present` flag set.
+** The entries following the returned one in its paging structure map the
+** addresses that follow, so ranges are walked by going through them, and only
+** calling this function again once past the end of that paging structure.
+**
+** All levels of entries share the same layout for the bits used here, so the
+** entry is returned as a `struct pte`.
+*/
+static
+struct pte *
+find_page(
+    struct virtaddr_layout val,
+    size_t *size,
+    bool *user
+) {
+    struct pte *entry;
+    bool path;
+
+    path = true;
+
+    entry = (struct pte *)get_pml4()->entries + val.pml4_idx;
+    *size = PML4E_SIZE;
+    if (!entry->present) {
+        goto end;
+    }
+
+    path = entry->user;
+    entry = (struct pte *)get_pdpt_of(val)->entries + val.pdpt_idx;
+    *size = PDPTE_SIZE;
+    if (!entry->present || entry->pat) { // The `size` bit
+        goto end;
+    }
+
+    path &= entry->user;
+    entry = (struct pte *)get_pd_of(val)->entries + val.pd_idx;
+    *size = PDE_SIZE;
+    if (!entry->present || entry->pat) { // The `size` bit
+        goto end;
+    }
+
+    path &= entry->user;
+    entry = get_pt_of(val)->entries + val.pt_idx;
+    *size = PAGE_SIZE;
+
+end:
+    if (user) {
+        *user = path;
+    }
+    return entry;
+}
+
+/*
+** Test whether the given entry, covering `size` bytes, maps a page (instead of
+** pointing to a paging structure or not being present).
+*/
+static inline
+bool
+is_leaf(
+    struct pte const *entry,
+    size_t size
+) {
+    return entry->present && (size == PAGE_SIZE || (entry->raw & ENTRY_SIZE_BIT));
+}
+
+/*
+** Return a pointer past the last entry of the paging structure holding `entry`.
+*/
+static inline
+struct pte *
+table_end(
+    struct pte *entry
+) {
+    return ROUND_DOWN(entry, PAGE_SIZE) + 512u;
+}
+
+/*
+** Test whether the given virtual address is mapped.
 */
 bool
 arch_vmm_is_mapped(
     virtaddr_const_t va
 ) {
     struct virtaddr_layout val;
+    struct spinlock *lock;
+    size_t size;
+    bool mapped;
+    bool state;
 
     val.raw = va;
 
-    return (
-        get_pml4()->entries[val.pml4_idx].present &&
-        get_pdpt_of(val)->entries[val.pdpt_idx].present &&
-        get_pd_of(val)->entries[val.pd_idx].present &&
-        get_pt_of(val)->entries[val.pt_idx].present
-    );
+    lock = pt_lock(va, (uchar const *)va + 1, &state);
+    mapped = find_page(val, &size, NULL)->present;
+    pt_unlock(lock, &state);
+
+    return mapped;
 }
 
 /*
 ** Test whether the given virtual address is mapped and belongs to user-space.
 **
-** This is done by testing every entry in the paging structure, ensuring they
-** all have both the `present` and `user` flag set.
+** This is the case if all the entries mapping it have the `user` flag set.
 */
 bool
 arch_vmm_is_mapped_user(
     virtaddr_const_t va
 ) {
     struct virtaddr_layout val;
+    struct pte const *pte;
+    struct spinlock *lock;
+    size_t size;
+    bool user;
+    bool state;
 
     val.raw = va;
 
-    return (
-        get_pml4()->entries[val.pml4_idx].present &&
-        get_pml4()->entries[val.pml4_idx].user &&
-        get_pdpt_of(val)->entries[val.pdpt_idx].present &&
-        get_pdpt_of(val)->entries[val.pdpt_idx].user &&
-        get_pd_of(val)->entries[val.pd_idx].present &&
-        get_pd_of(val)->entries[val.pd_idx].user &&
-        get_pt_of(val)->entries[val.pt_idx].present &&
-        get_pt_of(val)->entries[val.pt_idx].user
-    );
+    lock = pt_lock(va, (uchar const *)va + 1, &state);
+    pte = find_page(val, &size, &user);
+    user = pte->present && user && pte->user;
+    pt_unlock(lock, &state);
+
+    return user;
 }
 
 /*
-** Map the virtual address `va` to `pa` with the given permissions.
+** Return the amount of bytes at the beginning of the `size` bytes starting at
+** `va` that are either all unmapped, or all mapped and all accessible or not
+** to user-space.
 **
-** Note:
-**   * Any missing intermediate page-table will be allocated on the fly.
-**   * Missing intermediate page-table won't be freed if the final allocation
-**     failed, meaning the memory isn't identical as it was before the call
-**     if the function fails.
-**   * The virtual address needs to be page-aligned.
-**   * The physical address needs to be page-aligned.
-**   * Any PML4E, PDPTE or PDE added mid-way will have the most flexible permissions
-**     (URWX), giving the requested permissions only to the final page table
-**     entry.
+** Whether they are mapped is stored in `*mapped`, and whether they are mapped
+** and accessible to user-space is stored in `*user`.
+**
+** The paging structures are walked once for the first page, and the run is
+** then extended through the following entries of the same paging structure.
 */
-status_t
-arch_vmm_map_frame(
-    virtaddr_t va,
-    physaddr_t pa,
-    mmap_flags_t flags
+size_t
+arch_vmm_probe(
+    virtaddr_const_t va,
+    size_t size,
+    bool *mapped,
+    bool *user
 ) {
     struct virtaddr_layout val;
-    struct pml4e *pml4e;
-    struct pdpte *pdpte;
-    struct pde *pde;
-    struct pte *pte;
-
-    debug_assert(IS_PAGE_ALIGNED(va));
-    debug_assert(IS_PAGE_ALIGNED(pa));
+    struct spinlock *lock;
+    struct pte *entry;
+    struct pte *end;
+    size_t page;
+    size_t run;
+    bool path;
+    bool state;
 
     val.raw = va;
 
-    pml4e = get_pml4()->entries + val.pml4_idx;
-    if (!pml4e->present) {
-        physaddr_t frame = pmm_alloc_frame();
-        if (frame == PHYS_NULL) {
-            return ERR_OUT_OF_MEMORY;
-        }
+    lock = pt_lock(va, (uchar const *)va + size, &state);
 
-        /* Map high-level page tables with the most flexible permissions */
-        pml4e->raw = frame; // This also unsets all flags
-        pml4e->present = true;
-        pml4e->rw = true;
-        pml4e->user = true;
+    entry = find_page(val, &page, &path);
+    end = table_end(entry);
 
-        void *pdpt = get_pdpt_of(val);
-        tlb_invalidate_page(pdpt);
-        memset(pdpt, 0, PAGE_SIZE);
-    }
+    *mapped = entry->present;
+    *user = entry->present && path && entry->user;
 
-    pdpte = get_pdpt_of(val)->entries + val.pdpt_idx;
-    if (!pdpte->present) {
-        physaddr_t frame = pmm_alloc_frame();
-        if (frame == PHYS_NULL) {
-            return ERR_OUT_OF_MEMORY;
+    run = page - ((uintptr)va & (page - 1));
+    for (++entry; run < size && entry < end; ++entry) {
+        if (entry->present != *mapped) {
+            break;
         }
 
-        /* Map high-level page tables with the most flexible permissions */
-        pdpte->raw = frame; // This also unsets all flags
-        pdpte->present = true;
-        pdpte->rw = true;
-        pdpte->user = true;
+        // Paging structures are walked by the next call.
+        if (entry->present && (!is_leaf(entry, page) || (path && entry->user) != *user)) {
+            break;
+        }
 
-        void *pd = get_pd_of(val);
-        tlb_invalidate_page(pd);
-        memset(pd, 0, PAGE_SIZE);
+        run += page;
     }
 
-    pde = get_pd_of(val)->entries + val.pd_idx;
-    if (!pde->present) {
-        physaddr_t frame = pmm_alloc_frame();
-        if (frame == PHYS_NULL) {
-            return ERR_OUT_OF_MEMORY;
-        }
+    pt_unlock(lock, &state);
 
-        /* Map high-level page tables with the most flexible permissions */
-        pde->raw = frame; // This also unsets all flags
-        pde->present = true;
-        pde->rw = true;
-        pde->user = true;
+    return run < size ? run : size;
+}
+
+/*
+** Allocate a zeroed frame for a new page table and tag it as such, or return
+** `PHYS_NULL` if there is no physical memory left.
+*/
+static
+physaddr_t
+alloc_page_table(
+    void
+) {
+    struct frame *desc;
+    physaddr_t frame;
 
-        void *pt = get_pt_of(val);
-        tlb_invalidate_page(pt);
-        memset(pt, 0, PAGE_SIZE);
+    frame = pmm_alloc_frame_zeroed();
+    if (frame != PHYS_NULL) {
+        desc = pmm_get_frame(frame);
+        if (desc) {
+            desc->owner = FRAME_OWNER_PAGE_TABLE;
+        }
     }
+    return frame;
+}
 
-    pte = get_pt_of(val)->entries + val.pt_idx;
+/*
+** If the paging structure `table`, pointed to by `entry`, doesn't hold any
+** present entry, unlink it from `entry` and free it, so a large page can take
+** its place.
+**
+** `va` is any address covered by `entry`.
+**
+** The paging-structure caches are flushed through `tlb`, which also frees the
+** paging structure once no CPU can walk it anymore.
+**
+** Return whether the paging structure was empty.
+*/
+static
+bool
+unlink_empty_table(
+    struct pte *entry,
+    struct page_table const *table,
+    virtaddr_t va,
+    struct tlb_gather *tlb
+) {
+    physaddr_t frame;
+    size_t i;
 
-    if (pte->present) {
-        return ERR_ALREADY_MAPPED;
+    for (i = 0; i < ARRAY_LENGTH(table->entries); ++i) {
+        if (table->entries[i].present) {
+            return false;
+        }
     }
 
-    pte->raw = pa; // This also unsets all flags
-    pte->present = true;
-    pte->rw = (bool)(flags & MMAP_RDWR);
-    pte->user = (bool)(flags & MMAP_USER);
-    pte->xd = !(bool)(flags & MMAP_EXEC);
+    frame = entry->raw & ENTRY_FRAME_MASK;
+    entry->raw = 0;
 
-    tlb_invalidate_page(va);
+    // Flush the paging-structure caches, and the recursive mapping of the table.
+    // The local CPU does it right away as the caller keeps using both.
+    invlpg(va);
+    invlpg(table);
+    tlb_gather_add(tlb, va, PAGE_SIZE);
+    tlb_gather_add(tlb, table, PAGE_SIZE);
 
-    return OK;
+    tlb_gather_free_table(tlb, frame);
+    return true;
 }
 
 /*
-** Unmap the virtual address `va`.
+** Make `entry`, an entry of any level but the last, point to a paging structure,
+** using the empty one in `*spare` if it isn't present.
 **
-** Note:
-**   * Any intermediate pt/pd/pdpt isn't freed, even if it is empty.
+** Fail with `ERR_ALREADY_MAPPED` if it maps a large page instead, and with
+** `ERR_OUT_OF_MEMORY` if a paging structure is needed but `*spare` is
+** `PHYS_NULL`.
 */
-void
-arch_vmm_unmap_frame(
-    virtaddr_t va,
-    munmap_flags_t flags
+static
+status_t
+link_table(
+    struct pte *entry,
+    physaddr_t *spare
 ) {
-    struct virtaddr_layout val;
-    struct pte *pte;
+    if (entry->present) {
+        return (entry->raw & ENTRY_SIZE_BIT) ? ERR_ALREADY_MAPPED : OK;
+    }
 
-    debug_assert(IS_PAGE_ALIGNED(va));
+    if (*spare == PHYS_NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
 
-    val.raw = va;
+    /* Map high-level page tables with the most flexible permissions */
+    entry->raw = *spare; // This also unsets all flags
+    entry->present = true;
+    entry->rw = true;
+    entry->user = true;
+    *spare = PHYS_NULL;
+    return OK;
+}
 
-    if (
-        get_pml4()->entries[val.pml4_idx].present &&
-        get_pdpt_of(val)->entries[val.pdpt_idx].present &&
-        get_pd_of(val)->entries[val.pd_idx].present &&
-        get_pt_of(val)->entries[val.pt_idx].present
-    ) {
-        pte = get_pt_of(val)->entries + val.pt_idx;
+/*
+** Walk the paging structures down to the one holding the entries of the pages
+** of `size` bytes (`PAGE_SIZE`, `PDE_SIZE` or `PDPTE_SIZE`), and store the entry
+** mapping `val` in `*pentry`.
+**
+** A missing intermediate page-table is taken from `*spare` (see `link_table()`).
+*/
+static
+status_t
+walk_alloc(
+    struct virtaddr_layout val,
+    size_t size,
+    struct pte **pentry,
+    physaddr_t *spare
+) {
+    struct pte *entry;
+    status_t s;
+
+    entry = (struct pte *)get_pml4()->entries + val.pml4_idx;
+
+    // The PML4 entries of the kernel's half are shared by copy, so new ones wouldn't be.
+    debug_assert(entry->present || !g_vaspace_kernel_shared || is_user_range(val.raw, (uchar const *)val.raw + size));
+
+    s = link_table(entry, spare);
+    if (s != OK) {
+        return s;
+    }
+
+    entry = (struct pte *)get_pdpt_of(val)->entries + val.pdpt_idx;
+    if (size < PDPTE_SIZE) {
+        s = link_table(entry, spare);
+        if (s != OK) {
+            return s;
+        }
+
+        entry = (struct pte *)get_pd_of(val)->entries + val.pd_idx;
+        if (size < PDE_SIZE) {
+            s = link_table(entry, spare);
+            if (s != OK) {
+                return s;
+            }
+
+            entry = get_pt_of(val)->entries + val.pt_idx;
+        }
+    }
+
+    *pentry = entry;
+    return OK;
+}
+
+/*
+** Map the pages of `page` bytes (`PAGE_SIZE`, `PDE_SIZE` or `PDPTE_SIZE`)
+** starting at `va` to the contiguous frames starting at `pa`, with the given
+** permissions.
+**
+** The paging structures are walked once, and as many consecutive entries as
+** possible are filled in the one holding the entry of `va`. The run stops at
+** the end of that paging structure, at the end of the `size` bytes starting at
+** `va`, at the first page already mapped, or once `tlb` can't hold any more
+** frames. The amount of bytes mapped is stored in `*mapped`.
+**
+** A missing intermediate page-table is taken from `*spare` (see `link_table()`).
+** An empty page-table sitting where a large page goes is freed through `tlb`.
+**
+** Neither the new pages nor the new intermediate page-tables need to be
+** invalidated, as they weren't present before.
+*/
+static
+status_t
+map_pages(
+    virtaddr_t va,
+    physaddr_t pa,
+    size_t size,
+    size_t page,
+    mmap_flags_t flags,
+    size_t *mapped,
+    struct tlb_gather *tlb,
+    physaddr_t *spare
+) {
+    struct virtaddr_layout val;
+    struct page_table *table;
+    struct pte *entry;
+    struct pte *end;
+    status_t s;
+
+    debug_assert(!((uintptr)va & (page - 1)));
+    debug_assert(!(pa & (page - 1)));
+
+    *mapped = 0;
+    val.raw = va;
 
-        if (~(flags & MUNMAP_NO_FREE)) {
-            pmm_free_frame(pte->frame << 12u);
+    s = walk_alloc(val, page, &entry, spare);
+    if (s != OK) {
+        return s;
+    }
+
+    for (end = table_end(entry); entry < end && *mapped + page <= size; ++entry) {
+        if (entry->present) {
+            if (is_leaf(entry, page)) {
+                break;
+            }
+
+            // Leave the rest to the next call if freeing the paging structure would flush `tlb`,
+            // which can't be done with the lock held. The caller flushed it if it was full,
+            // so the first page always fits.
+            if (!tlb_gather_can_free(tlb, entry->raw & ENTRY_FRAME_MASK, PAGE_SIZE)) {
+                break;
+            }
+
+            // An empty paging structure sitting where the large page goes.
+            val.raw = (uchar *)va + *mapped;
+            table = (page == PDE_SIZE) ? get_pt_of(val) : (struct page_table *)get_pd_of(val);
+            if (!unlink_empty_table(entry, table, (uchar *)va + *mapped, tlb)) {
+                break;
+            }
+        }
+
+        entry->raw = pa + *mapped; // This also unsets all flags
+        entry->present = true;
+        entry->rw = (bool)(flags & MMAP_RDWR);
+        entry->user = (bool)(flags & MMAP_USER);
+        entry->xd = !(bool)(flags & MMAP_EXEC);
+        if (page > PAGE_SIZE) {
+            entry->raw |= ENTRY_SIZE_BIT;
         }
 
-        memset(pte, 0, sizeof(*pte));
-        tlb_invalidate_page(va);
+        *mapped += page;
+    }
+
+    return *mapped ? OK : ERR_ALREADY_MAPPED;
+}
+
+/*
+** Map the virtual address `va` to `pa` with the given permissions.
+**
+** Note:
+**   * Any missing intermediate page-table will be allocated on the fly.
+**   * Missing intermediate page-table won't be freed if the final allocation
+**     failed, meaning the memory isn't identical as it was before the call
+**     if the function fails.
+**   * The virtual address needs to be page-aligned.
+**   * The physical address needs to be page-aligned.
+**   * Any PML4E, PDPTE or PDE added mid-way will have the most flexible permissions
+**     (URWX), giving the requested permissions only to the final page table
+**     entry.
+*/
+status_t
+arch_vmm_map_frame(
+    virtaddr_t va,
+    physaddr_t pa,
+    mmap_flags_t flags
+) {
+    struct tlb_gather tlb = TLB_GATHER_INIT;
+    size_t mapped;
+    status_t s;
+
+    s = arch_vmm_map_frames(va, pa, PAGE_SIZE, flags, &mapped, &tlb);
+    tlb_gather_flush(&tlb);
+    return s;
+}
+
+/*
+** Map the beginning of the `size` bytes starting at `va` to the contiguous
+** frames starting at `pa`, using 1GiB or 2MiB pages if both addresses are
+** aligned on them and `size` is big enough, and regular pages otherwise.
+**
+** The pages are mapped in a single pass over the paging structure holding
+** their entries, until its end (see `map_pages()`). The amount of bytes mapped
+** is stored in `*mapped`, and the invalidations needed are added to `tlb`.
+**
+** Large pages are only used if nothing is mapped where the first one goes.
+** Otherwise, smaller pages are tried.
+**
+** The lock of the paging structures must be held (see `pt_lock()`).
+*/
+static
+status_t
+map_frames(
+    virtaddr_t va,
+    physaddr_t pa,
+    size_t size,
+    mmap_flags_t flags,
+    size_t *mapped,
+    struct tlb_gather *tlb,
+    physaddr_t *spare
+) {
+    size_t page;
+    status_t s;
+
+    page = PAGE_SIZE;
+    if (size >= PDE_SIZE && !(((uintptr)va | pa) & (PDE_SIZE - 1))) {
+        page = PDE_SIZE;
+    }
+    if (
+        size >= PDPTE_SIZE
+        && !(((uintptr)va | pa) & (PDPTE_SIZE - 1))
+        && current_cpu()->cpuid.features.pdpe1gb
+    ) {
+        page = PDPTE_SIZE;
+    }
+
+    s = map_pages(va, pa, size, page, flags, mapped, tlb, spare);
+    while (s == ERR_ALREADY_MAPPED && page > PAGE_SIZE) {
+        page /= 512u;
+        s = map_pages(va, pa, size, page, flags, mapped, tlb, spare);
     }
+
+    return s;
+}
+
+/*
+** Map the beginning of the `size` bytes starting at `va` to the contiguous
+** frames starting at `pa` (see `map_frames()`).
+**
+** The amount of bytes mapped is stored in `*mapped`, and the invalidations
+** needed are added to `tlb`.
+**
+** Paging structures are allocated without holding the lock, as running low on
+** memory may shrink the kernel heap, which unmaps pages. When one is missing,
+** the lock is released, a paging structure is allocated and the walk starts
+** over.
+*/
+status_t
+arch_vmm_map_frames(
+    virtaddr_t va,
+    physaddr_t pa,
+    size_t size,
+    mmap_flags_t flags,
+    size_t *mapped,
+    struct tlb_gather *tlb
+) {
+    struct spinlock *lock;
+    physaddr_t spare;
+    status_t s;
+    bool state;
+
+    debug_assert(IS_PAGE_ALIGNED(va));
+    debug_assert(IS_PAGE_ALIGNED(pa));
+    debug_assert(size >= PAGE_SIZE);
+
+    spare = PHYS_NULL;
+    while (true) {
+        // Make room for the page table this may free, as `tlb` can't be flushed with the lock held.
+        if (tlb->nb_pages == TLB_GATHER_SIZE) {
+            tlb_gather_flush(tlb);
+        }
+
+        lock = pt_lock(va, (uchar const *)va + size, &state);
+        s = map_frames(va, pa, size, flags, mapped, tlb, &spare);
+        pt_unlock(lock, &state);
+
+        if (s != ERR_OUT_OF_MEMORY) {
+            break;
+        }
+
+        spare = alloc_page_table();
+        if (spare == PHYS_NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+
+    // Another CPU may have linked the paging structure that was missing.
+    if (spare != PHYS_NULL) {
+        pmm_free_frame(spare);
+    }
+
+    return s;
+}
+
+/*
+** Make the already mapped virtual address `va` point to `pa` instead, and
+** return the frame it was previously mapped to.
+**
+** The other attributes of the mapping are left untouched, and only the TLB of
+** the current CPU is invalidated.
+**
+** `va` must be mapped by a regular page.
+*/
+static
+physaddr_t
+remap_frame_local(
+    virtaddr_t va,
+    physaddr_t pa
+) {
+    struct virtaddr_layout val;
+    struct pte *pte;
+    physaddr_t old;
+    size_t size;
+
+    debug_assert(IS_PAGE_ALIGNED(va));
+    debug_assert(IS_PAGE_ALIGNED(pa));
+
+    val.raw = va;
+
+    pte = find_page(val, &size, NULL);
+    debug_assert(pte->present && size == PAGE_SIZE);
+
+    old = pte->frame << 12u;
+    pte->frame = pa >> 12u;
+
+    invlpg(va);
+
+    return old;
+}
+
+/*
+** Map the current CPU's scratch page to `frame`, storing the frame it was mapped
+** to in `*old` unless `old` is `NULL`, and return it.
+**
+** The scratch page can be mapped to another frame before being unmapped, but
+** only the first call must store the frame it was mapped to.
+**
+** Interrupts must be disabled until `arch_vmm_scratch_unmap()` is called.
+*/
+virtaddr_t
+arch_vmm_scratch_map(
+    physaddr_t frame,
+    physaddr_t *old
+) {
+    virtaddr_t scratch;
+    physaddr_t prev;
+
+    scratch = g_vmm_scratch_pages[current_cpu()->cpu_id];
+    prev = remap_frame_local(scratch, frame);
+    if (old) {
+        *old = prev;
+    }
+    return scratch;
+}
+
+/*
+** Map the current CPU's scratch page back to `old`, the frame it was mapped to
+** before `arch_vmm_scratch_map()` was called.
+*/
+void
+arch_vmm_scratch_unmap(
+    physaddr_t old
+) {
+    remap_frame_local(g_vmm_scratch_pages[current_cpu()->cpu_id], old);
+}
+
+/*
+** Replace the large page `entry`, of `size` bytes and mapping the address `val`,
+** by the empty paging structure `frame`, of the level below, mapping the same
+** frames with the same attributes.
+**
+** The new paging structure is filled before being linked, so the memory it maps
+** stays mapped all along.
+**
+** The invalidations needed are added to `tlb`.
+*/
+static
+void
+split_page(
+    struct virtaddr_layout val,
+    struct pte *entry,
+    size_t size,
+    struct tlb_gather *tlb,
+    physaddr_t frame
+) {
+    uintptr volatile *table;
+    physaddr_t old;
+    uintptr attributes;
+    uintptr base;
+    size_t i;
+    bool state;
+
+    base = entry->raw & ENTRY_FRAME_MASK;
+    attributes = entry->raw & ~ENTRY_FRAME_MASK;
+
+    // The `size` bit is the `pat` bit of PTEs.
+    if (size == PDE_SIZE) {
+        attributes &= ~ENTRY_SIZE_BIT;
+    }
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    table = (uintptr volatile *)arch_vmm_scratch_map(frame, &old);
+
+    for (i = 0; i < PAGE_SIZE / sizeof(*table); ++i) {
+        table[i] = (base + i * (size / 512u)) | attributes;
+    }
+
+    arch_vmm_scratch_unmap(old);
+
+    pop_interrupts_state(&state);
+
+    /* Link the new paging structure with the most flexible permissions */
+    entry->raw = frame; // This also unsets all flags
+    entry->present = true;
+    entry->rw = true;
+    entry->user = true;
+
+    // Flush the large page, and the recursive mappings that went through it, which now
+    // go through the new paging structure. The local CPU does it right away as the caller
+    // walks the new paging structure next.
+    invlpg(val.raw);
+    invlpg(get_pt_of(val));
+    tlb_gather_add(tlb, val.raw, PAGE_SIZE);
+    tlb_gather_add(tlb, get_pt_of(val), PAGE_SIZE);
+
+    if (size == PDPTE_SIZE) {
+        invlpg(get_pd_of(val));
+        tlb_gather_add(tlb, get_pd_of(val), PAGE_SIZE);
+    }
+}
+
+/*
+** Unmap the pages mapping `va` and the addresses that follow.
+**
+** Large pages entirely within the `size` bytes starting at `va` are torn down
+** at once. Those that aren't are split until `va` is mapped by a page that is.
+**
+** The paging structures are walked once, and the run of consecutive entries
+** following the one of `va` in its paging structure is cleared as well. The run
+** stops at the end of that paging structure, at the end of the `size` bytes
+** starting at `va`, at an entry pointing to a paging structure, or once `tlb`
+** can't hold any more frames.
+**
+** Return the amount of bytes starting at `va` that are now unmapped, which is
+** at most `size`. Those that weren't mapped are included, and those that were
+** are added to `*unmapped`.
+**
+** The pages are added to `tlb`, and so are their frames unless `MUNMAP_NO_FREE`
+** is set: they are only freed once the TLBs are flushed.
+**
+** The paging structure a large page is split into is taken from `*spare`. If
+** one is needed but `*spare` is `PHYS_NULL`, nothing is done and 0 is returned.
+**
+** The lock of the paging structures must be held (see `pt_lock()`).
+*/
+static
+size_t
+unmap_pages(
+    virtaddr_t va,
+    size_t size,
+    munmap_flags_t flags,
+    struct tlb_gather *tlb,
+    size_t *unmapped,
+    physaddr_t *spare
+) {
+    struct virtaddr_layout val;
+    struct pte *entry;
+    struct pte *end;
+    uchar *cur;
+    size_t page;
+    size_t done;
+
+    debug_assert(IS_PAGE_ALIGNED(va));
+    debug_assert(IS_PAGE_ALIGNED(size));
+
+    val.raw = va;
+
+    entry = find_page(val, &page, NULL);
+    while (entry->present && page > PAGE_SIZE && (((uintptr)va & (page - 1)) || size < page)) {
+        if (*spare == PHYS_NULL) {
+            return 0;
+        }
+
+        split_page(val, entry, page, tlb, *spare);
+        *spare = PHYS_NULL;
+        entry = find_page(val, &page, NULL);
+    }
+
+    // Only the first entry may cover addresses before `va`, if it isn't present.
+    cur = (uchar *)va - ((uintptr)va & (page - 1));
+
+    for (end = table_end(entry); entry < end; ++entry) {
+        if (entry->present) {
+            // Large pages only partially within the range are split by the next call,
+            // and paging structures are walked by it.
+            if (!is_leaf(entry, page) || cur + page > (uchar *)va + size) {
+                break;
+            }
+
+            if (!(flags & MUNMAP_NO_FREE)) {
+                // Leave the rest to the next call if freeing the frames would flush `tlb`, which
+                // can't be done with the lock held. The caller flushed it if it was full, so the
+                // first page always fits.
+                if (!tlb_gather_can_free(tlb, entry->raw & ENTRY_FRAME_MASK, page)) {
+                    break;
+                }
+
+                tlb_gather_free(tlb, entry->raw & ENTRY_FRAME_MASK, page);
+            }
+
+            entry->raw = 0;
+            tlb_gather_add(tlb, cur, page);
+            *unmapped += page;
+        }
+
+        cur += page;
+        if (cur >= (uchar *)va + size) {
+            break;
+        }
+    }
+
+    done = cur - (uchar *)va;
+    return done < size ? done : size;
+}
+
+/*
+** Unmap the pages mapping `va` and the addresses that follow (see
+** `unmap_pages()`).
+**
+** Return the amount of bytes starting at `va` that are now unmapped, which is
+** at most `size`. Those that weren't mapped are included, and those that were
+** are added to `*unmapped`.
+**
+** Like in `arch_vmm_map_frames()`, the paging structures large pages are split
+** into are allocated without holding the lock. Running out of memory here is
+** fatal.
+**
+** Note:
+**   * Any intermediate pt/pd/pdpt isn't freed, even if it is empty.
+*/
+size_t
+arch_vmm_unmap_frames(
+    virtaddr_t va,
+    size_t size,
+    munmap_flags_t flags,
+    struct tlb_gather *tlb,
+    size_t *unmapped
+) {
+    struct spinlock *lock;
+    physaddr_t spare;
+    size_t done;
+    bool state;
+
+    spare = PHYS_NULL;
+    while (true) {
+        // Make room for the frames this frees, as `tlb` can't be flushed with the lock held.
+        if (tlb->nb_pages == TLB_GATHER_SIZE) {
+            tlb_gather_flush(tlb);
+        }
+
+        lock = pt_lock(va, (uchar const *)va + size, &state);
+        done = unmap_pages(va, size, flags, tlb, unmapped, &spare);
+        pt_unlock(lock, &state);
+
+        if (done) {
+            break;
+        }
+
+        spare = alloc_page_table();
+        if (spare == PHYS_NULL) {
+            panic("vmm: out of memory while splitting a large page");
+        }
+    }
+
+    // Another CPU may have split the large page already.
+    if (spare != PHYS_NULL) {
+        pmm_free_frame(spare);
+    }
+
+    return done;
+}
+
+/*
+** Unmap the virtual address `va`, splitting the large page mapping it if any.
+**
+** Note:
+**   * Any intermediate pt/pd/pdpt isn't freed, even if it is empty.
+*/
+void
+arch_vmm_unmap_frame(
+    virtaddr_t va,
+    munmap_flags_t flags
+) {
+    struct tlb_gather tlb = TLB_GATHER_INIT;
+    size_t unmapped;
+
+    unmapped = 0;
+    arch_vmm_unmap_frames(va, PAGE_SIZE, flags, &tlb, &unmapped);
+    tlb_gather_flush(&tlb);
+}
+
+/*
+** Return the PCID of the given address space, handing it a new one if it doesn't
+** have any or if its PCID belongs to a previous generation.
+**
+** The kernel's address space always uses PCID 0.
+*/
+static
+uint64
+vaspace_pcid(
+    struct vaspace *vaspace
+) {
+    uint64 pcid;
+
+    if (vaspace == &g_kernel_vaspace) {
+        return 0;
+    }
+
+    pcid = atomic_load(&vaspace->pcid, ATOMIC_ACQUIRE);
+    if ((pcid >> PCID_BITS) == (atomic_load(&g_pcid_last, ATOMIC_ACQUIRE) >> PCID_BITS)) {
+        return pcid;
+    }
+
+    spinlock_acquire(&g_pcid_lock);
+
+    // Another CPU may have handed it a new PCID in the meantime.
+    pcid = vaspace->pcid;
+    if ((pcid >> PCID_BITS) != (g_pcid_last >> PCID_BITS)) {
+        if ((g_pcid_last & (PCID_NB - 1)) == PCID_NB - 1) {
+            // Start a new generation. PCID 0 is the kernel's, so it is never handed out.
+            g_pcid_last = ((g_pcid_last >> PCID_BITS) + 1) << PCID_BITS;
+        }
+        pcid = g_pcid_last + 1;
+        atomic_store(&vaspace->pcid, pcid, ATOMIC_RELEASE);
+        atomic_store(&g_pcid_last, pcid, ATOMIC_RELEASE);
+    }
+
+    spinlock_release(&g_pcid_lock);
+
+    return pcid;
+}
+
+/*
+** Prepare the kernel's address space, the one loaded at boot.
+**
+** The PML4 entries of the kernel's half are copied in each new address space,
+** so those that are going to be used are allocated now. Afterwards, the paging
+** structures they point to are shared by all address spaces.
+*/
+status_t
+arch_vaspace_init(
+    void
+) {
+    struct virtaddr_layout val;
+    struct pml4e *pml4e;
+    physaddr_t frame;
+
+    g_kernel_vaspace.pml4 = get_cr3().value & ENTRY_FRAME_MASK;
+    g_kernel_vaspace.pcid = 0;
+
+    val.raw = ARCH_VMALLOC_START;
+    pml4e = get_pml4()->entries + val.pml4_idx;
+    if (!pml4e->present) {
+        frame = alloc_page_table();
+        if (frame == PHYS_NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        /* Map high-level page tables with the most flexible permissions */
+        pml4e->raw = frame; // This also unsets all flags
+        pml4e->present = true;
+        pml4e->rw = true;
+        pml4e->user = true;
+    }
+
+    g_vaspace_kernel_shared = true;
+    return OK;
+}
+
+/*
+** Create the PML4 of a new address space, with an empty user half.
+*/
+status_t
+arch_vaspace_new(
+    struct vaspace *vaspace
+) {
+    uintptr volatile *pml4;
+    physaddr_t frame;
+    physaddr_t old;
+    size_t i;
+    bool state;
+
+    frame = alloc_page_table();
+    if (frame == PHYS_NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    pml4 = (uintptr volatile *)arch_vmm_scratch_map(frame, &old);
+
+    // Share the kernel's half, which is the first entry and the upper half.
+    pml4[0] = get_pml4()->entries[0].raw;
+    for (i = 256; i < 511; ++i) {
+        pml4[i] = get_pml4()->entries[i].raw;
+    }
+
+    // Recursive mapping
+    pml4[511] = frame | 0b11; // Present and read-write
+
+    arch_vmm_scratch_unmap(old);
+
+    pop_interrupts_state(&state);
+
+    vaspace->pml4 = frame;
+    return OK;
+}
+
+/*
+** Free the paging structures of the user half of the given address space, and
+** its PML4.
+**
+** The address space must not be loaded on any CPU. The frames mapped in its
+** user half aren't freed: they must be unmapped beforehand.
+**
+** The paging structures are read through the current CPU's scratch page rather
+** than by loading the address space, which would hand it a PCID again.
+**
+** The address space's PCID is abandoned: it is only handed out again once a new
+** generation starts, which flushes the TLB of every CPU first.
+*/
+void
+arch_vaspace_free(
+    struct vaspace *vaspace
+) {
+    struct pte volatile *table;
+    physaddr_t pdpt;
+    physaddr_t pd;
+    physaddr_t old;
+    size_t i;
+    size_t j;
+    size_t k;
+    bool state;
+
+    debug_assert(vaspace != &g_kernel_vaspace);
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    table = (struct pte volatile *)arch_vmm_scratch_map(vaspace->pml4, &old);
+
+    // The user half spans the PML4 entries 1 to 255. The scratch page is mapped to
+    // each paging structure in turn, so the one above is mapped again afterwards.
+    for (i = 1; i < 256; ++i) {
+        arch_vmm_scratch_map(vaspace->pml4, NULL);
+        if (!table[i].present) {
+            continue;
+        }
+        pdpt = table[i].raw & ENTRY_FRAME_MASK;
+
+        for (j = 0; j < 512; ++j) {
+            arch_vmm_scratch_map(pdpt, NULL);
+            if (!table[j].present || (table[j].raw & ENTRY_SIZE_BIT)) {
+                continue;
+            }
+            pd = table[j].raw & ENTRY_FRAME_MASK;
+
+            arch_vmm_scratch_map(pd, NULL);
+            for (k = 0; k < 512; ++k) {
+                if (table[k].present && !(table[k].raw & ENTRY_SIZE_BIT)) {
+                    pmm_free_frame(table[k].raw & ENTRY_FRAME_MASK);
+                }
+            }
+            pmm_free_frame(pd);
+        }
+        pmm_free_frame(pdpt);
+    }
+
+    arch_vmm_scratch_unmap(old);
+
+    pop_interrupts_state(&state);
+
+    pmm_free_frame(vaspace->pml4);
+}
+
+/*
+** Load the given address space on the current CPU.
+**
+** If the CPU supports PCIDs, the TLB entries of the address space are kept
+** unless some changed while it wasn't loaded, and so are those of the address
+** space it replaces.
+**
+** Interrupts must be disabled.
+*/
+void
+arch_vaspace_switch(
+    struct vaspace *vaspace
+) {
+    struct cpu *cpu;
+    struct cr3 cr3;
+    uint64 pcid;
+    cpumask_t bit;
+    bool flush;
+
+    cpu = current_cpu();
+    bit = 1u << cpu->cpu_id;
+
+    if (atomic_load(&cpu->vaspace, ATOMIC_RELAXED) == vaspace) {
+        return ;
+    }
+
+    // This may spin, which may perform a shootdown, so do it while the previous
+    // address space is still loaded.
+    pcid = 0;
+    if (cpu->tlb_pcid) {
+        pcid = vaspace_pcid(vaspace);
+
+        // A new generation may have started, and been seen by this CPU, right after
+        // the PCID was checked.
+        while ((pcid >> PCID_BITS) && (pcid >> PCID_BITS) < cpu->tlb_generation) {
+            pcid = vaspace_pcid(vaspace);
+        }
+    }
+
+    if (!(atomic_load(&vaspace->cpus, ATOMIC_SEQ_CST) & bit)) {
+        atomic_fetch_or(&vaspace->cpus, bit, ATOMIC_SEQ_CST);
+    }
+
+    // The CPU is published before the stale mark is consumed, so a shootdown of
+    // the address space either marks it as stale or targets it.
+    atomic_store(&cpu->vaspace, vaspace, ATOMIC_SEQ_CST);
+    flush = atomic_fetch_and(&vaspace->tlb_stale, ~bit, ATOMIC_SEQ_CST) & bit;
+
+    cr3.value = vaspace->pml4;
+
+    if (cpu->tlb_pcid) {
+        // Entries tagged with the PCIDs of a previous generation may belong to any
+        // address space.
+        if ((pcid >> PCID_BITS) > cpu->tlb_generation) {
+            tlb_flush_all_local();
+            memset(cpu->tlb_stale_pcids, 0, sizeof(cpu->tlb_stale_pcids));
+            cpu->tlb_generation = pcid >> PCID_BITS;
+            flush = false;
+        }
+
+        pcid &= PCID_NB - 1;
+
+        // The kernel's half may have changed since the PCID was last used.
+        flush |= (bool)(cpu->tlb_stale_pcids[pcid / 64u] & (1ull << (pcid % 64u)));
+        cpu->tlb_stale_pcids[pcid / 64u] &= ~(1ull << (pcid % 64u));
+
+        cr3.pcid = pcid;
+        cr3.noflush = !flush;
+    }
+
+    set_cr3(cr3);
 }
@@ -71,6 +71,13 @@ kmain(
         hook = find_next_init_hook(hook, hook->level);
     }
 
+    /* The boot process is over, release the memory only it needed. */
+    memory_release_boot_memory();
+
+#if KHEAP_PROFILE
+    kheap_profile_dump();
+#endif /* KHEAP_PROFILE */
+
     // Create `kthread`.
     assert_ok(thread_new(thread_test, &kthread1));
     assert_ok(thread_new(thread_test, &kthread2));
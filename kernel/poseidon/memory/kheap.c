@@ -15,29 +15,96 @@
 ** It can definitely be improved, but I hate writing memory allocators.
 ** Like really, I mean it. Feel free to improve it :)
 **
-** `kheap_alloc_aligned()` is using a dirty trick to easily make aligned allocations.
-** It calls `kheap_alloc()` with a size of `size + PAGE_SIZE` bytes and aligns
-** the returned pointer to a page boundary. The old pointer in then added to
-** `g_kheap_aligned_ptrs` so `kheap_free()` can find it.
+** Free blocks are kept in segregated free lists, one per size class (see
+** `KHEAP_FL_COUNT` and `KHEAP_SL_COUNT`), with a two-level bitmap telling which
+** lists aren't empty. Finding a free block big enough therefore takes a couple
+** of bit scans instead of a walk through all the blocks.
 **
-** This definitely deserve an improvement, but eh, it's not fun enough. Big sad.
+** When the last block of the heap is free and big enough, the pages it spans are
+** given back to the PMM (see `trim_heap()`). Under memory pressure, the pages
+** spanned by free blocks in the middle of the heap are released too, and mapped
+** again when the block is used (see `kheap_shrink()`).
+**
+** Allocations of a few pages or more are forwarded to `vmalloc()` (see
+** `KHEAP_VMALLOC_THRESHOLD`), so they don't fragment the heap.
+**
+** Aligned blocks are carved out of bigger ones, giving the unaligned part back
+** to the heap (see `alloc_block_aligned()`), so they are freed like any other.
+**
+** The heap is protected by `g_kheap_lock`. Small allocations and frees first go
+** through a cache of free blocks local to each CPU (see `struct kheap_cpu_cache`),
+** so the common case doesn't take the lock at all.
 */
 
 #include "poseidon/memory/kheap.h"
 #include "poseidon/memory/vmm.h"
+#include "poseidon/memory/pmm.h"
+#include "poseidon/memory/vmalloc.h"
+#include "poseidon/cpu/cpu.h"
+#include "poseidon/interrupt.h"
 #include "poseidon/boot/init_hook.h"
+#include "lib/sync/spinlock.h"
 #include "lib/string.h"
 
+#if KHEAP_PROFILE
+#include "lib/log.h"
+#endif /* KHEAP_PROFILE */
+
+#if KCONFIG_BENCHMARKS
+#include "poseidon/scheduler/scheduler.h"
+#include "poseidon/thread/thread.h"
+#include "arch/target/rdtsc.h"
+#include "lib/log.h"
+#endif /* KCONFIG_BENCHMARKS */
+
+/*
+** Lock protecting the whole heap: its blocks, their free lists and its size.
+**
+** It must only be taken with interrupts disabled, see `kheap_lock()`.
+*/
+static struct spinlock g_kheap_lock = SPINLOCK_DEFAULT;
+
 /* `kheap_alloc()` global variables */
 static struct kheap_block *g_kheap_head;
 static struct kheap_block *g_kheap_tail;
 
+/*
+** The free lists of each size class, and the bitmaps of the non-empty ones:
+** bit `fl` of `g_kheap_fl_bitmap` is set if any bit of `g_kheap_sl_bitmaps[fl]`
+** is, and bit `sl` of `g_kheap_sl_bitmaps[fl]` is set if `g_kheap_free_lists[fl][sl]`
+** isn't empty.
+*/
+static struct kheap_block *g_kheap_free_lists[KHEAP_FL_COUNT][KHEAP_SL_COUNT];
+static uint64 g_kheap_fl_bitmap;
+static uint8 g_kheap_sl_bitmaps[KHEAP_FL_COUNT];
+
 /* `grow_heap()` global variables */
 static size_t g_kernel_heap_size;
 
-/* `kheap_alloc_aligned()` global variables */
-static struct kheap_aligned_metadata *g_kheap_aligned_ptrs;
-static size_t g_kheap_aligned_ptrs_len;
+/*
+** Save the interrupt state, disable interrupts and acquire `g_kheap_lock`.
+*/
+static inline
+void
+kheap_lock(
+    bool *state
+) {
+    push_interrupts_state(state);
+    disable_interrupts();
+    spinlock_acquire(&g_kheap_lock);
+}
+
+/*
+** Release `g_kheap_lock` and restore the interrupt state saved by `kheap_lock()`.
+*/
+static inline
+void
+kheap_unlock(
+    bool const *state
+) {
+    spinlock_release(&g_kheap_lock);
+    pop_interrupts_state(state);
+}
 
 /*
 ** Grow the kernel heap by `inc` bytes, performing the allocation using
@@ -72,7 +139,7 @@ grow_heap(
         s = vmm_map(
             (uchar *)round_old + PAGE_SIZE,
             round_add,
-            MMAP_RDWR
+            MMAP_RDWR | MMAP_ZERO
         );
 
         if (s != OK) {
@@ -84,7 +151,94 @@ grow_heap(
 }
 
 /*
-** Find a free block of at least the given size.
+** Return the links of the given free block.
+*/
+static inline
+struct kheap_free_links *
+free_links(
+    struct kheap_block *block
+) {
+    return (struct kheap_free_links *)(block + 1);
+}
+
+/*
+** Find the size class of blocks of the given size.
+*/
+static inline
+void
+size_class(
+    size_t size,
+    uint *fl,
+    uint *sl
+) {
+    *fl = 63u - __builtin_clzll(size);
+    *sl = (size >> (*fl - KHEAP_SL_LOG2)) & (KHEAP_SL_COUNT - 1);
+}
+
+/*
+** Add the given free block to the free list of its size class.
+*/
+static
+void
+free_list_insert(
+    struct kheap_block *block
+) {
+    struct kheap_block **head;
+    uint fl;
+    uint sl;
+
+    size_class(block->size, &fl, &sl);
+    head = &g_kheap_free_lists[fl][sl];
+
+    free_links(block)->prev = NULL;
+    free_links(block)->next = *head;
+    if (*head) {
+        free_links(*head)->prev = block;
+    }
+    *head = block;
+
+    g_kheap_fl_bitmap |= 1ul << fl;
+    g_kheap_sl_bitmaps[fl] |= 1u << sl;
+}
+
+/*
+** Remove the given free block from the free list of its size class.
+*/
+static
+void
+free_list_remove(
+    struct kheap_block *block
+) {
+    struct kheap_free_links *links;
+    uint fl;
+    uint sl;
+
+    size_class(block->size, &fl, &sl);
+    links = free_links(block);
+
+    if (links->prev) {
+        free_links(links->prev)->next = links->next;
+    } else {
+        g_kheap_free_lists[fl][sl] = links->next;
+    }
+    if (links->next) {
+        free_links(links->next)->prev = links->prev;
+    }
+
+    if (!g_kheap_free_lists[fl][sl]) {
+        g_kheap_sl_bitmaps[fl] &= ~(1u << sl);
+        if (!g_kheap_sl_bitmaps[fl]) {
+            g_kheap_fl_bitmap &= ~(1ul << fl);
+        }
+    }
+}
+
+/*
+** Find a free block of at least the given size and remove it from its free list.
+**
+** The size is rounded up to the next size class first, so that any block of
+** the class found is big enough, and only the first block of a list is ever
+** looked at.
 */
 static
 struct kheap_block *
@@ -92,21 +246,72 @@ find_free_block(
     size_t size
 ) {
     struct kheap_block *block;
+    uint64 fl_map;
+    uint sl_map;
+    uint fl;
+    uint sl;
 
-    block = g_kheap_head;
-    while (block <= g_kheap_tail) {
-        assert(block->magic == KHEAP_MAGIC);
-        if (!block->used && block->size >= size) {
-            return block;
+    size_class(size, &fl, &sl);
+    size += (1ul << (fl - KHEAP_SL_LOG2)) - 1;
+    size_class(size, &fl, &sl);
+
+    // Look for a non-empty list in the same first-level class, then in the bigger ones.
+    sl_map = g_kheap_sl_bitmaps[fl] & (~0u << sl);
+    if (!sl_map) {
+        fl_map = fl + 1 < KHEAP_FL_COUNT ? g_kheap_fl_bitmap & (~0ul << (fl + 1)) : 0;
+        if (!fl_map) {
+            return NULL;
+        }
+        fl = __builtin_ctzll(fl_map);
+        sl_map = g_kheap_sl_bitmaps[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    block = g_kheap_free_lists[fl][sl];
+    assert(block->magic == KHEAP_MAGIC);
+    assert(!block->used);
+    free_list_remove(block);
+    return block;
+}
+
+/*
+** Try to join two blocks into a single one, but only if they are both free.
+**
+** The first block must not be in a free list. The second one is removed from
+** its own.
+*/
+static
+void
+join_block(
+    struct kheap_block *block
+) {
+    struct kheap_block *other;
+    struct kheap_block *next;
+
+    other = (struct kheap_block *)((uchar *)(block + 1) + block->size);
+    if (!block->used && other <= g_kheap_tail && !other->used) {
+        assert(other->magic == KHEAP_MAGIC);
+        free_list_remove(other);
+        block->size += sizeof(struct kheap_block) + other->size;
+        block->decommitted |= other->decommitted;
+        if (other == g_kheap_tail) {
+            g_kheap_tail = block;
+        }
+
+        next = (struct kheap_block *)((uchar *)(other + 1) + other->size);
+        if (next <= g_kheap_tail) {
+            next->prev = block;
         }
-        block = (struct kheap_block *)((uchar *)(block + 1) + block->size);
     }
-    return NULL;
 }
 
 /*
 ** Split the given block at the given size, if possible.
 **
+** The block must not be in a free list. The free block created out of its end,
+** if any, is joined with the next block if it is free too, and added to the free
+** lists.
+**
 ** Note: size must not be greater that the block size.
 */
 static
@@ -118,9 +323,10 @@ split_block(
     struct kheap_block *new;
     struct kheap_block *next;
 
-    if (block->size - size > sizeof(struct kheap_block) + 1) {
+    if (block->size - size >= sizeof(struct kheap_block) + KHEAP_MIN_SIZE) {
         new = (struct kheap_block *)((uchar *)(block + 1) + size);
         new->used = false;
+        new->decommitted = block->decommitted;
         new->magic = KHEAP_MAGIC;
         new->size = block->size - size - sizeof(struct kheap_block);
         if (g_kheap_tail == block) {
@@ -132,99 +338,161 @@ split_block(
         if (next <= g_kheap_tail) {
             next->prev = new;
         }
+        join_block(new);
+        free_list_insert(new);
     }
 }
 
 /*
-** Try to join two blocks into a single one, but only if they are both free.
+** Map again the pages of the first `size` bytes of the given block's content that
+** were unmapped by `decommit_block()`.
+**
+** `g_kheap_lock` must be held.
 */
 static
-void
-join_block(
-    struct kheap_block *block
+status_t
+commit_block(
+    struct kheap_block *block,
+    size_t size
 ) {
-    struct kheap_block *other;
-    struct kheap_block *next;
+    uchar *va;
+    uchar *end;
+    status_t s;
 
-    other = (struct kheap_block *)((uchar *)(block + 1) + block->size);
-    if (!block->used && other <= g_kheap_tail && !other->used) {
-        block->size += sizeof(struct kheap_block) + other->size;
-        if (other == g_kheap_tail) {
-            g_kheap_tail = block;
-        }
+    if (!block->decommitted) {
+        return OK;
+    }
 
-        next = (struct kheap_block *)((uchar *)(other + 1) + other->size);
-        if (next <= g_kheap_tail) {
-            next->prev = block;
+    size = size > block->size ? block->size : size;
+    va = ROUND_DOWN((uchar *)(block + 1), PAGE_SIZE);
+    end = ALIGN((uchar *)(block + 1) + size, PAGE_SIZE);
+    while (va < end) {
+        if (!vmm_is_mapped(va)) {
+            s = vmm_map(va, PAGE_SIZE, MMAP_RDWR | MMAP_ZERO);
+            if (s != OK) {
+                return s;
+            }
         }
+        va += PAGE_SIZE;
     }
+    return OK;
 }
 
 /*
-** Given an aligned virtual address returned from `kheap_aligned()`, find
-** the original virtual address (before it was aligned) so it can be passed to
-** `kheap_free()`.
+** Unmap and free the pages spanned by the content of the given free block,
+** and return the amount of frames released.
 **
-** This is achieved by going trough `g_kheap_aligned_ptrs` and finding an address
-** matching the given one. It is then remove from the array and the original
-** pointer is returned.
+** The page holding the block's header and links is kept, and so is the page
+** holding the end of the block, which may be shared with the next one.
 **
-** This is part of a trick to easily implement a `kheap_alloc_aligned()` without
-** having to heaviliy complexify the current implementation.
+** `g_kheap_lock` must be held.
 */
 static
-virtaddr_t
-find_real_from_aligned_ptr(
-    virtaddr_t ptr
+size_t
+decommit_block(
+    struct kheap_block *block
 ) {
-    struct kheap_aligned_metadata *aligned_ptr;
-    struct kheap_aligned_metadata *new_kheap_aligned_ptrs;
-
-    aligned_ptr = g_kheap_aligned_ptrs;
-    while (aligned_ptr < g_kheap_aligned_ptrs + g_kheap_aligned_ptrs_len) {
-        if (aligned_ptr->aligned == ptr) {
-            ptr = aligned_ptr->original;
-            // We swap the current entry with the last one, and realloc the array
-            *aligned_ptr = g_kheap_aligned_ptrs[g_kheap_aligned_ptrs_len - 1];
-            g_kheap_aligned_ptrs_len -= 1;
-            new_kheap_aligned_ptrs = kheap_realloc(
-                g_kheap_aligned_ptrs,
-                sizeof(*g_kheap_aligned_ptrs) * g_kheap_aligned_ptrs_len
-            );
-            if (new_kheap_aligned_ptrs) {
-                g_kheap_aligned_ptrs = new_kheap_aligned_ptrs;
-            }
-            break;
-        }
-        ++aligned_ptr;
+    uchar *va;
+    uchar *end;
+
+    va = ROUND_DOWN((uchar *)(block + 1) + KHEAP_MIN_SIZE, PAGE_SIZE) + PAGE_SIZE;
+    end = ROUND_DOWN((uchar *)(block + 1) + block->size, PAGE_SIZE);
+    if (va >= end) {
+        return 0;
     }
-    return ptr;
+
+    block->decommitted = true;
+
+    // A single walk and TLB shootdown for the whole range, skipping the pages already decommitted.
+    return vmm_unmap(va, end - va, MUNMAP_FREE) / PAGE_SIZE;
 }
 
 /*
-** `malloc()` but using memory in kernel space.
+** Shrink the heap if its last block is free and spans at least `threshold`
+** bytes worth of whole pages, and return the amount of frames released.
 **
-** TODO Make this function safer (overflow)
+** The last block is kept, with the smallest possible size.
+**
+** `g_kheap_lock` must be held.
+*/
+static
+size_t
+trim_heap(
+    size_t threshold
+) {
+    struct kheap_block *block;
+    uchar *end;
+    uchar *new_end;
+    uchar *unmap_start;
+    uchar *unmap_end;
+
+    block = g_kheap_tail;
+    if (!block || block->used) {
+        return 0;
+    }
+
+    end = (uchar *)(block + 1) + block->size;
+    new_end = (uchar *)(block + 1) + KHEAP_MIN_SIZE;
+
+    // The page holding the end of the heap must stay mapped (see `grow_heap()`).
+    unmap_start = ROUND_DOWN(new_end, PAGE_SIZE) + PAGE_SIZE;
+    unmap_end = ROUND_DOWN(end, PAGE_SIZE) + PAGE_SIZE;
+    if (unmap_end <= unmap_start || (size_t)(unmap_end - unmap_start) < threshold) {
+        return 0;
+    }
+
+    free_list_remove(block);
+    block->size = KHEAP_MIN_SIZE;
+    block->decommitted = false;
+    free_list_insert(block);
+    g_kernel_heap_size -= end - new_end;
+
+    // Keep the memory past the end of the heap filled with zeroes (see `alloc_block()`).
+    memset(new_end, 0, unmap_start - new_end);
+
+    // A single walk and TLB shootdown for the whole range, skipping the pages already decommitted.
+    return vmm_unmap(unmap_start, unmap_end - unmap_start, MUNMAP_FREE) / PAGE_SIZE;
+}
+
+/*
+** Find or make a free block of the given size, mark it as used and return a
+** pointer to its content.
+**
+** `*zeroed` is set to `true` if the content of the block is known to be filled
+** with zeroes (the heap grows using zeroed frames, and nothing is ever written
+** past its end).
+**
+** `g_kheap_lock` must be held.
 */
+static
 virtaddr_t
-kheap_alloc(
-    size_t size
+alloc_block(
+    size_t size,
+    bool *zeroed
 ) {
     struct kheap_block *block;
 
-    size += (size == 0);
-    size = ALIGN(size, sizeof(void *));
+    *zeroed = false;
+    size = size < KHEAP_MIN_SIZE ? KHEAP_MIN_SIZE : ALIGN(size, sizeof(void *));
     block = find_free_block(size);
     if (block) {
+        // Make sure the content, and the header of the block split out of it, are mapped.
+        if (commit_block(block, size + sizeof(struct kheap_block) + KHEAP_MIN_SIZE) != OK) {
+            free_list_insert(block);
+            goto ret_err;
+        }
         block->used = true;
         split_block(block, size);
+        block->decommitted = false;
         goto ret_ok;
     }
     block = grow_heap(sizeof(struct kheap_block) + size);
     if (!block) {
         goto ret_err;
     }
+    *zeroed = true;
     block->used = true;
+    block->decommitted = false;
     block->magic = KHEAP_MAGIC;
     block->size = size;
     block->prev = g_kheap_tail;
@@ -241,104 +509,625 @@ ret_err:
 }
 
 /*
-** `kheap_alloc()` but returning a page-aligned pointer.
+** Mark the given block as free, join it with its free neighbours and add the
+** result to the free lists.
 **
-** TODO Make this function safer (overflow)
+** `g_kheap_lock` must be held.
 */
+static
+void
+free_block(
+    struct kheap_block *block
+) {
+    assert(block->used);
+    assert(block->magic == KHEAP_MAGIC);
+    block->used = false;
+    join_block(block);
+    if (block->prev && !block->prev->used) {
+        assert(block->prev->magic == KHEAP_MAGIC);
+        block = block->prev;
+        free_list_remove(block);
+        join_block(block);
+    }
+    free_list_insert(block);
+
+    if (block == g_kheap_tail) {
+        trim_heap(KHEAP_TRIM_THRESHOLD);
+    }
+}
+
+/*
+** `alloc_block()`, but the returned pointer is aligned to `align` bytes.
+**
+** A block big enough to be aligned is allocated, then the part before the aligned
+** address is given back to the heap as a free block of its own. The aligned
+** block therefore has a regular header, and is freed like any other block.
+**
+** `align` must be a power of two.
+**
+** `g_kheap_lock` must be held.
+*/
+static
 virtaddr_t
-kheap_alloc_aligned(
+alloc_block_aligned(
+    size_t size,
+    size_t align,
+    bool *zeroed
+) {
+    struct kheap_block *block;
+    struct kheap_block *aligned;
+    struct kheap_block *next;
+    uchar *content;
+    uchar *aligned_content;
+
+    debug_assert(align && !(align & (align - 1)));
+
+    if (align <= sizeof(void *)) {
+        return alloc_block(size, zeroed);
+    }
+
+    size = size < KHEAP_MIN_SIZE ? KHEAP_MIN_SIZE : ALIGN(size, sizeof(void *));
+
+    // Leave enough room to fit a free block in front of the aligned one.
+    content = alloc_block(size + align + sizeof(struct kheap_block) + KHEAP_MIN_SIZE, zeroed);
+    if (!content) {
+        return NULL;
+    }
+
+    block = (struct kheap_block *)content - 1;
+    aligned_content = content;
+    if ((uintptr)content & (align - 1)) {
+        aligned_content = ALIGN(content + sizeof(struct kheap_block) + KHEAP_MIN_SIZE, align);
+
+        aligned = (struct kheap_block *)aligned_content - 1;
+        aligned->used = true;
+        aligned->decommitted = false;
+        aligned->magic = KHEAP_MAGIC;
+        aligned->size = block->size - (aligned_content - content);
+        aligned->prev = block;
+
+        next = (struct kheap_block *)(aligned_content + aligned->size);
+        if (next <= g_kheap_tail) {
+            next->prev = aligned;
+        } else {
+            g_kheap_tail = aligned;
+        }
+
+        block->size = (uchar *)aligned - content;
+        free_block(block);
+        block = aligned;
+    }
+
+    split_block(block, size);
+    return aligned_content;
+}
+
+/*
+** Return the class of the per-CPU caches that can hold a block of the given
+** size, or `KHEAP_CPU_CACHE_CLASSES` if the block is too big.
+*/
+static inline
+uint
+kheap_cpu_cache_class(
     size_t size
 ) {
+    size /= KHEAP_CPU_CACHE_GRANULE;
+    return size > KHEAP_CPU_CACHE_CLASSES ? KHEAP_CPU_CACHE_CLASSES : size - 1;
+}
+
+/*
+** Allocate a block of at most `KHEAP_CPU_CACHE_MAX_SIZE` bytes from the cache of
+** the current CPU, refilling it from the heap if needed.
+*/
+static
+virtaddr_t
+kheap_cpu_cache_alloc(
+    size_t size
+) {
+    struct kheap_cpu_cache *cache;
     virtaddr_t ptr;
-    virtaddr_t aligned_ptr;
-    virtaddr_t new_kheap_aligned_ptrs;
+    uint class;
+    bool zeroed;
+    bool state;
+
+    debug_assert(size <= KHEAP_CPU_CACHE_MAX_SIZE);
+
+    // Round the size up to the smallest class whose blocks are big enough.
+    class = size ? (size - 1) / KHEAP_CPU_CACHE_GRANULE : 0;
 
-    ptr = kheap_alloc(size + PAGE_SIZE);
-    aligned_ptr = ALIGN(ptr, PAGE_SIZE);
+    push_interrupts_state(&state);
+    disable_interrupts();
 
-    if (ptr && ptr != aligned_ptr) {
+    cache = &current_cpu()->kheap_cache;
+    if (!cache->len[class]) {
+        spinlock_acquire(&g_kheap_lock);
+        while (cache->len[class] < KHEAP_CPU_CACHE_BATCH) {
+            ptr = alloc_block((class + 1) * KHEAP_CPU_CACHE_GRANULE, &zeroed);
+            if (!ptr) {
+                break;
+            }
+            cache->blocks[class][cache->len[class]++] = ptr;
+        }
+        spinlock_release(&g_kheap_lock);
+    }
+    ptr = cache->len[class] ? cache->blocks[class][--cache->len[class]] : NULL;
 
-        // Make room for the new metadata
-        new_kheap_aligned_ptrs  = kheap_realloc(
-            g_kheap_aligned_ptrs,
-            sizeof(*g_kheap_aligned_ptrs) * (g_kheap_aligned_ptrs_len + 1)
+    pop_interrupts_state(&state);
+
+    return ptr;
+}
+
+/*
+** Give the given block to the cache of the current CPU, draining the oldest
+** blocks of its class back to the heap if needed.
+**
+** Return `false` if the block is too big to be cached.
+*/
+static
+bool
+kheap_cpu_cache_free(
+    struct kheap_block *block
+) {
+    struct kheap_cpu_cache *cache;
+    uint class;
+    uint i;
+    bool state;
+
+    class = kheap_cpu_cache_class(block->size);
+    if (class == KHEAP_CPU_CACHE_CLASSES) {
+        return false;
+    }
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    cache = &current_cpu()->kheap_cache;
+    if (cache->len[class] == KHEAP_CPU_CACHE_SIZE) {
+        spinlock_acquire(&g_kheap_lock);
+        for (i = 0; i < KHEAP_CPU_CACHE_BATCH; ++i) {
+            free_block((struct kheap_block *)cache->blocks[class][i] - 1);
+        }
+        spinlock_release(&g_kheap_lock);
+
+        cache->len[class] -= KHEAP_CPU_CACHE_BATCH;
+        memmove(
+            cache->blocks[class],
+            cache->blocks[class] + KHEAP_CPU_CACHE_BATCH,
+            cache->len[class] * sizeof(cache->blocks[class][0])
         );
+    }
+    cache->blocks[class][cache->len[class]++] = block + 1;
 
-        if (!new_kheap_aligned_ptrs) {
-            kheap_free(ptr);
-            return NULL;
+    pop_interrupts_state(&state);
+
+    return true;
+}
+
+/*
+** Allocate a block of the given size, going through the per-CPU caches for
+** small ones and through `vmalloc()` for big ones.
+**
+** `*zeroed` is set like `alloc_block()` does.
+*/
+static
+virtaddr_t
+kheap_alloc_block(
+    size_t size,
+    bool *zeroed
+) {
+    virtaddr_t ptr;
+    bool state;
+
+    if (size <= KHEAP_CPU_CACHE_MAX_SIZE) {
+        *zeroed = false;
+        return kheap_cpu_cache_alloc(size);
+    }
+
+    if (size >= KHEAP_VMALLOC_THRESHOLD) {
+        *zeroed = false;
+        return vmalloc(size);
+    }
+
+    kheap_lock(&state);
+    ptr = alloc_block(size, zeroed);
+    kheap_unlock(&state);
+
+    return ptr;
+}
+
+#if KHEAP_PROFILE
+
+/*
+** Lock protecting the following profiling data.
+**
+** It must only be taken with interrupts disabled.
+*/
+static struct spinlock g_kheap_profile_lock = SPINLOCK_DEFAULT;
+
+static struct kheap_profile_site g_kheap_profile_sites[KHEAP_PROFILE_SITES];
+static size_t g_kheap_profile_dropped;  // Allocations whose site didn't fit in the table
+static size_t g_kheap_profile_live_bytes;
+static size_t g_kheap_profile_live_blocks;
+static size_t g_kheap_profile_peak_bytes;
+
+/*
+** Return the usable size of the given allocation.
+*/
+static
+size_t
+kheap_profile_size(
+    virtaddr_const_t ptr
+) {
+    if (vmalloc_contains(ptr)) {
+        return vmalloc_size(ptr);
+    }
+    return ((struct kheap_block const *)ptr - 1)->size;
+}
+
+/*
+** Record an allocation of the given pointer, made from `caller`.
+*/
+static
+void
+__kheap_profile_alloc(
+    virtaddr_const_t ptr,
+    virtaddr_const_t caller
+) {
+    struct kheap_profile_site *site;
+    size_t size;
+    size_t probes;
+    size_t i;
+    uint class;
+    bool state;
+
+    if (!ptr) {
+        return ;
+    }
+
+    size = kheap_profile_size(ptr);
+    class = 63u - __builtin_clzll(size | 1u);
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+    spinlock_acquire(&g_kheap_profile_lock);
+
+    g_kheap_profile_live_bytes += size;
+    g_kheap_profile_live_blocks += 1;
+    if (g_kheap_profile_live_bytes > g_kheap_profile_peak_bytes) {
+        g_kheap_profile_peak_bytes = g_kheap_profile_live_bytes;
+    }
+
+    // Open addressing, with linear probing.
+    i = (((uintptr)caller >> 2u) ^ (class * 0x9E3779B1u)) & (KHEAP_PROFILE_SITES - 1);
+    for (probes = 0; probes < KHEAP_PROFILE_SITES; ++probes) {
+        site = &g_kheap_profile_sites[i];
+        if (!site->caller) {
+            site->caller = caller;
+            site->class = class;
+        }
+        if (site->caller == caller && site->class == class) {
+            site->allocs += 1;
+            site->bytes += size;
+            goto end;
         }
+        i = (i + 1) & (KHEAP_PROFILE_SITES - 1);
+    }
+    g_kheap_profile_dropped += 1;
 
-        g_kheap_aligned_ptrs = new_kheap_aligned_ptrs;
+end:
+    spinlock_release(&g_kheap_profile_lock);
+    pop_interrupts_state(&state);
+}
 
-        // Write the new metadata in the array
-        g_kheap_aligned_ptrs[g_kheap_aligned_ptrs_len] = (struct kheap_aligned_metadata) {
-            .aligned = aligned_ptr,
-            .original = ptr,
-        };
-        g_kheap_aligned_ptrs_len += 1;
+/*
+** Record the free of the given pointer.
+*/
+static
+void
+__kheap_profile_free(
+    virtaddr_const_t ptr
+) {
+    size_t size;
+    bool state;
+
+    if (!ptr) {
+        return ;
     }
-    return aligned_ptr;
+
+    size = kheap_profile_size(ptr);
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+    spinlock_acquire(&g_kheap_profile_lock);
+
+    g_kheap_profile_live_bytes -= size;
+    g_kheap_profile_live_blocks -= 1;
+
+    spinlock_release(&g_kheap_profile_lock);
+    pop_interrupts_state(&state);
 }
 
+#define kheap_profile_alloc(ptr)    __kheap_profile_alloc((ptr), __builtin_return_address(0))
+#define kheap_profile_free(ptr)     __kheap_profile_free(ptr)
+
 /*
-** `kheap_alloc_aligned()`, but maps the returned address to the given physical
-** addresses.
+** Log the allocations recorded so far, by call site and size class, together
+** with the usage and the fragmentation of the heap.
 **
-** `pa` and `size` must be page-aligned.
+** External fragmentation is the share of free memory that isn't part of the
+** largest free block, and therefore can't satisfy the biggest allocations.
+*/
+void
+kheap_profile_dump(
+    void
+) {
+    struct kheap_profile_site const *site;
+    struct kheap_block *block;
+    size_t used_blocks;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free;
+    size_t heap_size;
+    bool state;
+
+    used_blocks = 0;
+    free_blocks = 0;
+    free_bytes = 0;
+    largest_free = 0;
+
+    kheap_lock(&state);
+    heap_size = g_kernel_heap_size;
+    block = g_kheap_head;
+    while (block != (void *)1 && block <= g_kheap_tail) {
+        assert(block->magic == KHEAP_MAGIC);
+        if (block->used) {
+            ++used_blocks;
+        } else {
+            ++free_blocks;
+            free_bytes += block->size;
+            largest_free = block->size > largest_free ? block->size : largest_free;
+        }
+        block = (struct kheap_block *)((uchar *)(block + 1) + block->size);
+    }
+    kheap_unlock(&state);
+
+    logln("kheap: profile: %zu bytes live in %zu allocations, %zu bytes at peak",
+        g_kheap_profile_live_bytes,
+        g_kheap_profile_live_blocks,
+        g_kheap_profile_peak_bytes
+    );
+    logln("kheap: profile: heap of %zu bytes, %zu used blocks (including per-CPU caches), %zu free blocks",
+        heap_size,
+        used_blocks,
+        free_blocks
+    );
+    logln("kheap: profile: %zu bytes free, largest free block of %zu bytes, %zu%% external fragmentation",
+        free_bytes,
+        largest_free,
+        free_bytes ? (free_bytes - largest_free) * 100u / free_bytes : 0
+    );
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+    spinlock_acquire(&g_kheap_profile_lock);
+
+    for (site = g_kheap_profile_sites; site < g_kheap_profile_sites + KHEAP_PROFILE_SITES; ++site) {
+        if (site->caller) {
+            logln("kheap: profile:     %p: %8zu allocations of %zu-%zu bytes, %zu bytes in total",
+                site->caller,
+                site->allocs,
+                1ul << site->class,
+                (2ul << site->class) - 1,
+                site->bytes
+            );
+        }
+    }
+    if (g_kheap_profile_dropped) {
+        logln("kheap: profile:     %zu allocations from call sites that didn't fit in the table", g_kheap_profile_dropped);
+    }
+
+    spinlock_release(&g_kheap_profile_lock);
+    pop_interrupts_state(&state);
+}
+
+#else
+
+#define kheap_profile_alloc(ptr)
+#define kheap_profile_free(ptr)
+
+#endif /* KHEAP_PROFILE */
+
+/*
+** `malloc()` but using memory in kernel space.
+**
+** TODO Make this function safer (overflow)
 */
 virtaddr_t
-kheap_alloc_device(
-    physaddr_t pa,
+kheap_alloc(
     size_t size
 ) {
     virtaddr_t ptr;
+    bool zeroed;
 
-    debug_assert(IS_PAGE_ALIGNED(pa));
-    debug_assert(IS_PAGE_ALIGNED(size));
+    ptr = kheap_alloc_block(size, &zeroed);
+    kheap_profile_alloc(ptr);
+    return ptr;
+}
 
-    ptr = kheap_alloc_aligned(size);
+/*
+** `kheap_alloc()` but returning a pointer aligned to `align` bytes, which must
+** be a power of two.
+**
+** TODO Make this function safer (overflow)
+*/
+virtaddr_t
+kheap_alloc_aligned(
+    size_t size,
+    size_t align
+) {
+    virtaddr_t ptr;
+    bool zeroed;
+    bool state;
 
-    if (
-        ptr != NULL &&
-        vmm_remap(ptr, pa, size, MMAP_RDWR, MUNMAP_FREE) == OK
-    ) {
-        return ptr;
+    // Memory returned by `vmalloc()` is page-aligned.
+    if (size >= KHEAP_VMALLOC_THRESHOLD && align <= PAGE_SIZE) {
+        ptr = vmalloc(size);
+    } else {
+        kheap_lock(&state);
+        ptr = alloc_block_aligned(size, align, &zeroed);
+        kheap_unlock(&state);
     }
 
-    return NULL;
+    kheap_profile_alloc(ptr);
+    return ptr;
 }
 
 /*
-** `free()`, but using memory in kernel space.
+** Map the given physical addresses in kernel space and return the address they
+** are mapped to.
 **
-** TODO: make this function safer (overflow)
+** The physical memory isn't freed by `kheap_free()`.
+**
+** `pa` and `size` must be page-aligned.
 */
+virtaddr_t
+kheap_alloc_device(
+    physaddr_t pa,
+    size_t size
+) {
+    virtaddr_t ptr;
+
+    ptr = vmalloc_device(pa, size);
+    kheap_profile_alloc(ptr);
+    return ptr;
+}
+
+/*
+** `kheap_free()`, but without recording the free when profiling.
+*/
+static
 void
-kheap_free(
+free_ptr(
     virtaddr_t ptr
 ) {
     struct kheap_block *block;
+    bool state;
 
     if (!ptr) {
         return ;
     }
-    if (IS_PAGE_ALIGNED(ptr)) {
-        ptr = find_real_from_aligned_ptr(ptr);
+
+    if (vmalloc_contains(ptr)) {
+        vfree(ptr);
+        return ;
     }
+
     block = (struct kheap_block *)ptr - 1;
     assert(block->used);
     assert(block->magic == KHEAP_MAGIC);
-    block->used = false;
-    join_block(block);
-    if (block->prev) {
-        join_block(block->prev);
+    if (kheap_cpu_cache_free(block)) {
+        return ;
     }
+
+    kheap_lock(&state);
+    free_block(block);
+    kheap_unlock(&state);
+}
+
+/*
+** `free()`, but using memory in kernel space.
+**
+** TODO: make this function safer (overflow)
+*/
+void
+kheap_free(
+    virtaddr_t ptr
+) {
+    kheap_profile_free(ptr);
+    free_ptr(ptr);
+}
+
+/*
+** Try to resize the given used block to the given size without moving it.
+**
+** The block is shrunk by splitting it. It is grown by absorbing the next block if
+** it is free, and by growing the heap if the block is its last one. It is never
+** grown to `KHEAP_VMALLOC_THRESHOLD` bytes or more, as blocks that big belong to
+** `vmalloc()`.
+**
+** Return `true` on success.
+**
+** `g_kheap_lock` must be held.
+*/
+static
+bool
+resize_block(
+    struct kheap_block *block,
+    size_t size
+) {
+    struct kheap_block *next;
+    struct kheap_block *after;
+    size_t old_size;
+
+    size = size < KHEAP_MIN_SIZE ? KHEAP_MIN_SIZE : ALIGN(size, sizeof(void *));
+    old_size = block->size;
+
+    if (block->size < size) {
+        if (size >= KHEAP_VMALLOC_THRESHOLD) {
+            return false;
+        }
+
+        next = (struct kheap_block *)((uchar *)(block + 1) + block->size);
+
+        // Absorb the next block if it is free and either big enough or the last one.
+        if (
+            next <= g_kheap_tail
+            && !next->used
+            && (block->size + sizeof(struct kheap_block) + next->size >= size || next == g_kheap_tail)
+        ) {
+            assert(next->magic == KHEAP_MAGIC);
+            free_list_remove(next);
+            block->size += sizeof(struct kheap_block) + next->size;
+            block->decommitted |= next->decommitted;
+            if (next == g_kheap_tail) {
+                g_kheap_tail = block;
+            }
+
+            after = (struct kheap_block *)((uchar *)(next + 1) + next->size);
+            if (after <= g_kheap_tail) {
+                after->prev = block;
+            }
+        }
+
+        // The block ends where the heap does, so growing the heap grows the block.
+        if (block->size < size && block == g_kheap_tail && grow_heap(size - block->size)) {
+            block->size = size;
+        }
+
+        if (block->size < size || commit_block(block, size + sizeof(struct kheap_block) + KHEAP_MIN_SIZE) != OK) {
+            // Give back whatever was absorbed.
+            split_block(block, old_size);
+            block->decommitted = false;
+            return false;
+        }
+    }
+
+    split_block(block, size);
+    block->decommitted = false;
+    return true;
 }
 
 /*
 ** `realloc()`, but using memory in kernel space.
 **
+** The block is resized in place whenever possible (see `resize_block()`).
+** Otherwise, it is moved to a new block at least 50% bigger than the old one, so
+** that arrays growing one element at a time are only copied a logarithmic amount
+** of times.
+**
+** Like with `kheap_alloc()`, the new block is allocated with `vmalloc()` if it
+** is `KHEAP_VMALLOC_THRESHOLD` bytes or more, and within the heap otherwise.
+**
 ** TODO: make this function safer (overflow)
 */
 virtaddr_t
@@ -348,13 +1137,54 @@ kheap_realloc(
 ) {
     void *ptr;
     struct kheap_block *block;
+    size_t old_size;
+    size_t reserve;
+    bool resized;
+    bool zeroed;
+    bool state;
+
+    // The old pointer is recorded as freed, and the returned one (or the old one on failure) as allocated.
+    kheap_profile_free(old_ptr);
 
-    ptr = kheap_alloc(new_size);
-    if (ptr != NULL && old_ptr) {
-        block = (struct kheap_block *)((char *)old_ptr - sizeof(struct kheap_block));
-        memcpy(ptr, old_ptr, block->size > new_size ? new_size : block->size);
-        kheap_free(old_ptr);
+    // `kheap_alloc_block()` forwards big blocks to `vmalloc()`.
+    if (!old_ptr) {
+        ptr = kheap_alloc_block(new_size, &zeroed);
+        goto end;
     }
+
+    if (vmalloc_contains(old_ptr)) {
+        old_size = vmalloc_size(old_ptr);
+        if (new_size <= old_size && new_size >= KHEAP_VMALLOC_THRESHOLD) {
+            ptr = old_ptr;
+            goto end;
+        }
+        goto move;
+    }
+
+    block = (struct kheap_block *)((char *)old_ptr - sizeof(struct kheap_block));
+    assert(block->used);
+    assert(block->magic == KHEAP_MAGIC);
+
+    kheap_lock(&state);
+    resized = resize_block(block, new_size);
+    kheap_unlock(&state);
+
+    if (resized) {
+        ptr = old_ptr;
+        goto end;
+    }
+    old_size = block->size;
+
+move:
+    reserve = new_size > old_size ? old_size + old_size / 2 : 0;
+    ptr = kheap_alloc_block(new_size > reserve ? new_size : reserve, &zeroed);
+    if (ptr != NULL) {
+        memcpy(ptr, old_ptr, old_size > new_size ? new_size : old_size);
+        free_ptr(old_ptr);
+    }
+
+end:
+    kheap_profile_alloc(ptr ? ptr : old_ptr);
     return ptr;
 }
 
@@ -368,11 +1198,18 @@ kheap_alloc_zero(
     size_t size
 ) {
     void *ptr;
+    bool zeroed;
 
-    ptr = kheap_alloc(size);
-    if (likely(ptr != NULL)) {
-        memset(ptr, 0, size);
+    if (size >= KHEAP_VMALLOC_THRESHOLD) {
+        ptr = vmalloc_zero(size);
+    } else {
+        ptr = kheap_alloc_block(size, &zeroed);
+        if (likely(ptr != NULL) && !zeroed) {
+            memset(ptr, 0, size);
+        }
     }
+
+    kheap_profile_alloc(ptr);
     return ptr;
 }
 
@@ -383,11 +1220,160 @@ kheap_init(
     g_kheap_head = (void*)1;
     g_kheap_tail = NULL;
 
+    memset(g_kheap_free_lists, 0, sizeof(g_kheap_free_lists));
+    g_kheap_fl_bitmap = 0;
+    memset(g_kheap_sl_bitmaps, 0, sizeof(g_kheap_sl_bitmaps));
+
     g_kernel_heap_size = 0;
 
-    g_kheap_aligned_ptrs = NULL;
-    g_kheap_aligned_ptrs_len = 0;
+    /*
+    ** `kheap_alloc()` algorithm assumes the first page is mapped.
+    ** Like the rest of the heap, it is zeroed (see `alloc_block()`).
+    */
+    return vmm_map(kernel_heap_start, PAGE_SIZE, MMAP_RDWR | MMAP_ZERO);
+}
+
+/*
+** The heap's shrinker.
+**
+** It trims the heap, then releases the pages spanned by its free blocks, starting
+** with the biggest ones.
+*/
+static
+size_t
+kheap_shrink(
+    enum pmm_pressure pressure [[maybe_unused]],
+    size_t target
+) {
+    struct kheap_block *block;
+    size_t released;
+    uint fl;
+    uint sl;
+    bool state;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    // The shrinkers may be called by the PMM while the heap is growing.
+    if (!spinlock_try_acquire(&g_kheap_lock)) {
+        pop_interrupts_state(&state);
+        return 0;
+    }
+
+    released = trim_heap(0);
+
+    // Only blocks bigger than a page can span a whole page.
+    for (fl = KHEAP_FL_COUNT - 1; (1ul << fl) > PAGE_SIZE && released < target; --fl) {
+        for (sl = 0; sl < KHEAP_SL_COUNT && released < target; ++sl) {
+            block = g_kheap_free_lists[fl][sl];
+            while (block && released < target) {
+                released += decommit_block(block);
+                block = free_links(block)->next;
+            }
+        }
+    }
 
-    /* `kheap_alloc()` algorithm assumes the first page is mapped */
-    return vmm_map(kernel_heap_start, PAGE_SIZE, MMAP_RDWR);
+    kheap_unlock(&state);
+    return released;
 }
+
+REGISTER_PMM_SHRINKER(kheap, &kheap_shrink);
+
+#if KCONFIG_BENCHMARKS
+
+/*
+** Workload of each thread of `kheap_bench()`: `KHEAP_BENCH_ROUNDS` times,
+** allocate `KHEAP_BENCH_BATCH` blocks of various sizes then free them all.
+*/
+#define KHEAP_BENCH_ROUNDS      4096u
+#define KHEAP_BENCH_BATCH       32u
+
+/*
+** The size of the `i`-th block of a batch.
+**
+** The first phase only uses sizes served by the per-CPU caches, the second one
+** only sizes that go through `g_kheap_lock`.
+*/
+#define KHEAP_BENCH_PHASES      2u
+#define KHEAP_BENCH_SIZE(phase, i)                                              \
+    ((phase) == 0 ? 8u + ((i) * 24u) % KHEAP_CPU_CACHE_MAX_SIZE : KHEAP_CPU_CACHE_MAX_SIZE + 8u + ((i) * 56u) % 1024u)
+
+static uint g_kheap_bench_ready[KHEAP_BENCH_PHASES];
+static uint g_kheap_bench_done[KHEAP_BENCH_PHASES];
+static uint64 g_kheap_bench_cycles[KHEAP_BENCH_PHASES];
+static bool g_kheap_bench_over;
+
+/*
+** A thread of `kheap_bench()`. One is started per CPU.
+*/
+int
+kheap_bench_thread(
+    void
+) {
+    virtaddr_t ptrs[KHEAP_BENCH_BATCH];
+    uint64 start;
+    uint phase;
+    uint round;
+    uint i;
+
+    for (phase = 0; phase < KHEAP_BENCH_PHASES; ++phase) {
+
+        // Wait for all the threads, so they all hammer the heap at the same time.
+        atomic_add_fetch(&g_kheap_bench_ready[phase], 1, ATOMIC_ACQ_REL);
+        while (atomic_load(&g_kheap_bench_ready[phase], ATOMIC_ACQUIRE) < g_cpus_len) {
+            yield();
+        }
+
+        start = rdtsc();
+        for (round = 0; round < KHEAP_BENCH_ROUNDS; ++round) {
+            for (i = 0; i < KHEAP_BENCH_BATCH; ++i) {
+                ptrs[i] = kheap_alloc(KHEAP_BENCH_SIZE(phase, i));
+                assert(ptrs[i]);
+            }
+            for (i = 0; i < KHEAP_BENCH_BATCH; ++i) {
+                kheap_free(ptrs[i]);
+            }
+        }
+        atomic_fetch_add(&g_kheap_bench_cycles[phase], rdtsc() - start, ATOMIC_RELAXED);
+
+        if (atomic_add_fetch(&g_kheap_bench_done[phase], 1, ATOMIC_ACQ_REL) == g_cpus_len) {
+            logln(
+                "kheap: bench: %u CPUs, %s: %llu cycles per alloc/free pair",
+                g_cpus_len,
+                phase == 0 ? "small blocks (per-CPU caches)" : "big blocks (shared lock)",
+                atomic_load(&g_kheap_bench_cycles[phase], ATOMIC_RELAXED) / ((uint64)g_cpus_len * KHEAP_BENCH_ROUNDS * KHEAP_BENCH_BATCH)
+            );
+        }
+    }
+
+    while (42) {
+        sleep(&g_kheap_bench_over);
+    }
+}
+
+/*
+** Measure the throughput of the kernel's heap when all CPUs allocate and free
+** memory at the same time.
+**
+** Run it with different amount of CPUs (eg. `make run SMP=4`, `SMP=8` and
+** `SMP=16`) to see how it scales.
+*/
+static
+status_t
+kheap_bench(
+    void
+) {
+    struct thread *thread;
+    uint i;
+
+    for (i = 0; i < g_cpus_len; ++i) {
+        if (thread_new(&kheap_bench_thread, &thread) != OK) {
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+    return OK;
+}
+
+REGISTER_INIT_HOOK(kheap_bench, &kheap_bench, INIT_LEVEL_DRIVERS);
+
+#endif /* KCONFIG_BENCHMARKS */
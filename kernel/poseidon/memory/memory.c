@@ -32,6 +32,7 @@
 #include "poseidon/memory/memory.h"
 #include "poseidon/memory/pmm.h"
 #include "poseidon/memory/kheap.h"
+#include "poseidon/memory/vmm.h"
 #include "poseidon/status.h"
 #include "lib/log.h"
 
@@ -46,6 +47,12 @@ memory_init(
     */
     pmm_early_init();
 
+    /*
+    ** Prepare the kernel's address space, whose half is shared by all the
+    ** others, before anything gets mapped there.
+    */
+    assert_ok(vaspace_init());
+
     /*
     ** Initialize the algorithm used to manage the kernel's heap.
     */
@@ -72,12 +79,65 @@ memory_init(
     */
     pmm_mark_range_as_allocated(
         ROUND_DOWN(g_mb_tag_pa, PAGE_SIZE),
-        ALIGN(g_mb_tag_pa + g_mb_tag_len, PAGE_SIZE)
+        ALIGN(g_mb_tag_pa + g_mb_tag_len, PAGE_SIZE) - ROUND_DOWN(g_mb_tag_pa, PAGE_SIZE)
     );
 
+    /*
+    ** Allocate the descriptors of all frames, now that everything allocated
+    ** so far is marked as such.
+    */
+    assert_ok(pmm_frames_init());
+
     logln("Dynamic memory allocator initialized.");
 
     return OK;
 }
 
 REGISTER_INIT_HOOK(memory_init, &memory_init, INIT_LEVEL_MEMORY);
+
+/*
+** Unmap a section of the kernel only used during the boot process and give its
+** frames back to the PMM.
+**
+** The amount of bytes released is returned.
+*/
+static
+size_t
+release_boot_section(
+    uint8 *start,
+    uint8 *end
+) {
+    if (start >= end) {
+        return 0;
+    }
+
+    // The kernel is identity-mapped.
+    vmm_unmap(start, end - start, MUNMAP_NO_FREE);
+    pmm_release_range((physaddr_t)start, end - start);
+    return end - start;
+}
+
+/*
+** Release the memory only needed during the boot process: the boot heap and
+** the sections holding everything tagged with `[[boot_text]]`,
+** `[[boot_rodata]]` or `[[boot_data]]`.
+**
+** This is called by `kmain()` once all init hooks ran, as none of those can be
+** used afterwards.
+*/
+void
+memory_release_boot_memory(
+    void
+) {
+    size_t released;
+
+    // Uses the boot arena, which lives in the boot data.
+    pmm_release_boot_heap();
+
+    released = 0;
+    released += release_boot_section(kernel_boot_text_start, kernel_boot_text_end);
+    released += release_boot_section(kernel_boot_rodata_start, kernel_boot_rodata_end);
+    released += release_boot_section(kernel_boot_data_start, kernel_boot_data_end);
+
+    logln("Released %zu KiB of boot sections.", released / 1024);
+}
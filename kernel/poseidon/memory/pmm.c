@@ -10,22 +10,93 @@
 /*
 ** The Physical Memory Manager.
 **
-** The current implementation is a pretty naive bitmap and can definitely be
-** optimized.
-**
 ** It works with multiple chunks of continuous memory called arenas.
-** Each arena is represented as a bitmap, where a single bit represents the
-** availability of a frame (1 for taken, 0 for free).
+**
+** Each arena is managed by a buddy allocator: physical memory is split in
+** blocks of `2^order` frames, each block being aligned on its own size. Every
+** order has its own bitmap, where a single bit represents the availability of
+** a block (1 for free, 0 for taken or split in smaller blocks).
+**
+** Those bitmaps are hierarchical (see `struct pmm_bitmap`), so finding a free
+** block takes a couple of word operations regardless of the amount of memory.
+**
+** Allocating a block of a given order takes the first free block of that order,
+** or splits a bigger one. Freeing a block coalesces it with its buddy for as
+** long as the buddy is free too, therefore keeping free memory as contiguous
+** as possible.
+**
+** The bitmaps are kept outside of the frames they describe because physical
+** memory isn't mapped in the kernel's address space.
+**
+** Arenas are sorted by address, so the arena a frame belongs to is found with
+** a binary search. Operations on ranges of frames (marking a range as allocated,
+** bulk allocations and frees) work on whole blocks and whole bitmap words,
+** so their cost depends on the amount of words touched rather than on the
+** amount of frames.
+**
+** Each arena belongs to a single NUMA node. Allocations are served from the
+** arenas of the node of the current CPU first, then from the other nodes by
+** increasing distance.
+**
+** Once `pmm_frames_init()` is called, each arena also holds a descriptor for
+** each of its frames (see `struct frame`), counting the references on that
+** frame. Freeing a frame drops a reference, and the frame only goes back to the
+** arenas once the last one is dropped.
+**
+** Allocating a zeroed frame requires mapping it first, since physical memory
+** isn't mapped. To keep that cost out of the allocation path, idle CPUs zero
+** free frames in advance and put them in a pool of zeroed frames. Each CPU
+** maps the frames it zeroes to its scratch page (see `vmm_scratch_map()`).
+**
+** To keep the boot time short on machines with a lot of memory, only the first
+** `KCONFIG_PMM_EARLY_INIT_SIZE` bytes of memory are made available by
+** `pmm_init()`. The rest of each arena is initialized later, a chunk at a time,
+** by idle CPUs (which includes all APs right after they are started) or when
+** memory runs low.
+**
+** To degrade gracefully when memory runs low, the amount of free frames is
+** compared against a few watermarks (see `struct pmm_watermarks`). Under those,
+** the shrinkers registered by other subsystems are asked to release some of the
+** frames they can live without, either by a dedicated thread or, as a last
+** resort, by the allocating thread itself.
+**
+** Frames can also be allocated by cache color (see `PMM_MAX_COLORS`), so that
+** callers can spread their memory over the sets of the last level cache. A
+** frame of a given color is taken from the per-CPU cache if it holds one, or
+** carved out of a block big enough to hold every color.
+**
+** All arenas are protected by a single lock. To avoid contention on it, single
+** frame allocations go through a small cache of free frames local to each CPU
+** (see `struct pmm_cpu_cache`), which exchanges frames with the arenas in
+** batches.
 */
 
 #include "poseidon/boot/init_hook.h"
 #include "poseidon/boot/multiboot2.h"
+#include "poseidon/atomic.h"
+#include "poseidon/cpu/cpu.h"
+#include "poseidon/interrupt.h"
 #include "poseidon/memory/memory.h"
 #include "poseidon/memory/memory.h"
 #include "poseidon/memory/pmm.h"
+#include "poseidon/memory/vmm.h"
+#include "poseidon/scheduler/scheduler.h"
+#include "poseidon/thread/thread.h"
+#include "lib/sync/spinlock.h"
 #include "lib/string.h"
 #include "lib/log.h"
 
+#if KCONFIG_BENCHMARKS
+#include "poseidon/memory/vmalloc.h"
+#include "arch/target/rdtsc.h"
+#endif /* KCONFIG_BENCHMARKS */
+
+/*
+** An upper bound of the amount of words needed by all the bitmaps of an arena
+** spanning over `frames` frames.
+*/
+#define PMM_BITMAPS_WORDS(frames)   ((frames) / 16u + (PMM_MAX_ORDER + 1u) * (PMM_BITMAP_MAX_LEVELS + 2u))
+
 /*
 ** The arena used early during the boot process, before the PMM can fully be initialized.
 **
@@ -36,7 +107,7 @@
 ** after the kernel, therefore making sure it doesn't take any virtual memory.
 */
 [[boot_data]] static struct pmm_arena g_boot_arena;
-[[boot_data]] static uint8 g_boot_arena_bitmap[KCONFIG_BOOT_KHEAP_SIZE / (4096 * 8)];
+[[boot_data]] static uint64 g_boot_arena_bitmaps[PMM_BITMAPS_WORDS((KCONFIG_BOOT_KHEAP_SIZE + PMM_MAX_BLOCK_SIZE) / PAGE_SIZE)];
 [[gnu::section(".kernel_boot_heap")]] static  uint8 g_kernel_boot_heap[KCONFIG_BOOT_KHEAP_SIZE];
 
 /* A few shortcuts, to make operations more verbose. */
@@ -47,346 +118,2780 @@
 static struct pmm_arena *g_arenas = NULL;
 static size_t g_arenas_len = 0;
 
+/*
+** The amount of NUMA nodes and, for each node, all the nodes sorted by
+** increasing distance from it (starting with itself).
+**
+** Until `pmm_numa_init()` is called, there is a single node.
+*/
+static uint g_pmm_nodes_len = 1;
+static uint8 g_pmm_node_fallbacks[KCONFIG_MAX_NUMA_NODES][KCONFIG_MAX_NUMA_NODES];
+
+/*
+** The amount of cache colors (a power of two, 1 if the geometry of the cache
+** is unknown), and the first color handed out by the next call to
+** `pmm_reserve_colors()`.
+*/
+static uint g_pmm_colors = 1;
+static uint g_pmm_next_color;
+
+/*
+** A pool of allocated frames that are already zeroed, filled by idle CPUs.
+*/
+static physaddr_t g_pmm_zeroed_pool[PMM_ZEROED_POOL_SIZE];
+static size_t g_pmm_zeroed_pool_len;
+static struct spinlock g_pmm_zeroed_pool_lock = SPINLOCK_DEFAULT;
+
+/* Watermarks on the amount of free frames, set by `pmm_init()`. */
+static struct pmm_watermarks g_pmm_watermarks;
+
+/* Set when free frames go below the `low` watermark, cleared once they are back above `high`. */
+static bool g_pmm_low_memory;
+
+/* The thread running the shrinkers in the background, and whether it has some work to do. */
+static struct thread *g_pmm_reclaim_thread;
+static bool g_pmm_reclaim_pending;
+
+/* Set once all the frames deferred by `pmm_init()` are initialized. */
+static bool g_pmm_deferred_done;
+
+/* Set while the shrinkers are running, so only one CPU runs them at a time. */
+static bool g_pmm_shrinking;
+
+/* Protects all the arenas. Per-CPU caches are protected by disabling interrupts instead. */
+static struct spinlock g_pmm_lock = SPINLOCK_DEFAULT;
+
 /* The beginning and end of the `pmm_reserved_area` ELF section. */
 extern struct pmm_reserved_area const __start_pmm_reserved_area[];
 extern struct pmm_reserved_area const __stop_pmm_reserved_area[];
 
+/* The beginning and end of the `pmm_shrinker` ELF section. */
+extern struct pmm_shrinker const __start_pmm_shrinker[];
+extern struct pmm_shrinker const __stop_pmm_shrinker[];
+
 /*
-** Calculate the index within `arena->bitmap` of the given frame.
+** Calculate the index of the given frame within `arena`, counting from
+** `arena->base`.
+**
+** The index of the block of order `n` containing that frame is the returned
+** value shifted right by `n`.
 **
 ** This function assumes `frame` belongs to `arena`.
 */
 static inline
 size_t
 pmm_get_frame_idx(
-    struct pmm_arena *arena,
+    struct pmm_arena const *arena,
     physaddr_t frame
 ) {
-    return ((frame - arena->start) >> 12u) / 8u;
+    return (frame - arena->base) >> 12u;
 }
 
 /*
-** Calculate the mask needed to retrieve the status bit of the given frame.
+** Calculate the amount of words needed by a bitmap of `bits` bits.
 **
-** This function assumes `frame` belongs to `arena`.
+** The depth of such bitmap is stored in `*depth`, unless it is `NULL`.
 */
-static inline
-uint
-pmm_get_frame_mask(
-    struct pmm_arena *arena,
-    physaddr_t frame
+static
+size_t
+pmm_bitmap_words(
+    size_t bits,
+    uint *depth
 ) {
-    return 1u << (((frame - arena->start) >> 12u) % 8u);
+    size_t words;
+    size_t total;
+    uint levels;
+
+    words = bits ? (bits + 63u) / 64u : 1u;
+    total = words;
+    levels = 1;
+    while (words > 1) {
+        words = (words + 63u) / 64u;
+        total += words;
+        ++levels;
+    }
+
+    debug_assert(levels <= PMM_BITMAP_MAX_LEVELS);
+
+    if (depth) {
+        *depth = levels;
+    }
+    return total;
 }
 
 /*
-** Test if `frame` is marked as allocated.
+** Initialize a bitmap of `bits` bits, all cleared, using `words` to store it.
 **
-** This function assumes `frame` belongs to `arena`.
+** `words` must be at least `pmm_bitmap_words(bits, NULL)` words long.
+** The amount of words used is returned.
+*/
+static
+size_t
+pmm_bitmap_init(
+    struct pmm_bitmap *bitmap,
+    size_t bits,
+    uint64 *words
+) {
+    size_t level_words;
+    size_t total;
+    uint i;
+
+    total = pmm_bitmap_words(bits, &bitmap->depth);
+    memset(words, 0, total * sizeof(uint64));
+
+    level_words = bits ? (bits + 63u) / 64u : 1u;
+    for (i = 0; i < bitmap->depth; ++i) {
+        bitmap->levels[i] = words;
+        words += level_words;
+        level_words = (level_words + 63u) / 64u;
+    }
+    return total;
+}
+
+/*
+** Test if the bit at index `idx` is set.
 */
 static inline
 bool
-pmm_is_frame_allocated(
-    struct pmm_arena *arena,
-    physaddr_t frame
+pmm_bitmap_test(
+    struct pmm_bitmap const *bitmap,
+    size_t idx
 ) {
-    return arena->bitmap[pmm_get_frame_idx(arena, frame)] & pmm_get_frame_mask(arena, frame);
+    return (bitmap->levels[0][idx / 64u] >> (idx % 64u)) & 1u;
 }
 
 /*
-** Mark `frame` as allocated.
-**
-** This function assumes `frame` belongs to `arena`.
+** Set the bit at index `idx`, updating the upper levels if needed.
 */
 static inline
 void
-pmm_mark_as_allocated(
-    struct pmm_arena *arena,
-    physaddr_t frame
+pmm_bitmap_set(
+    struct pmm_bitmap *bitmap,
+    size_t idx
 ) {
-    arena->bitmap[pmm_get_frame_idx(arena, frame)] |= pmm_get_frame_mask(arena, frame);
+    uint64 *word;
+    uint64 old;
+    uint i;
+
+    for (i = 0; i < bitmap->depth; ++i) {
+        word = &bitmap->levels[i][idx / 64u];
+        old = *word;
+        *word = old | (1ull << (idx % 64u));
+        if (old) {
+            break;
+        }
+        idx /= 64u;
+    }
 }
 
 /*
-** Mark a range of frames as allocated.
-**
-** The complexity of this function isn't very good, so it shouldn't be used
-** in performance-critical situations.
+** Clear the bit at index `idx`, updating the upper levels if needed.
 */
+static inline
 void
-pmm_mark_range_as_allocated(
-    physaddr_t frame,
-    size_t len
+pmm_bitmap_clear(
+    struct pmm_bitmap *bitmap,
+    size_t idx
 ) {
-    physaddr_t end;
+    uint64 *word;
+    uint i;
 
-    debug_assert(IS_PAGE_ALIGNED(frame));
-    debug_assert(IS_PAGE_ALIGNED(len));
+    for (i = 0; i < bitmap->depth; ++i) {
+        word = &bitmap->levels[i][idx / 64u];
+        *word &= ~(1ull << (idx % 64u));
+        if (*word) {
+            break;
+        }
+        idx /= 64u;
+    }
+}
 
-    end = frame + len;
-    while (frame < end) {
-        struct pmm_arena *arena;
-        bool found;
+/*
+** Clear all the bits of `levels[level]` from index `first` (inclusive) to
+** `last` (exclusive), updating the upper levels if needed.
+**
+** Whole words are cleared at once. The amount of bits that were set in that
+** range is returned.
+*/
+static
+size_t
+pmm_bitmap_clear_range(
+    struct pmm_bitmap *bitmap,
+    uint level,
+    size_t first,
+    size_t last
+) {
+    uint64 *words;
+    uint64 first_mask;
+    uint64 last_mask;
+    size_t first_word;
+    size_t last_word;
+    size_t cleared;
+    size_t i;
 
-        found = false;
-        arena = g_arenas;
+    if (first >= last || level >= bitmap->depth) {
+        return 0;
+    }
 
-        while (arena < g_arenas + g_arenas_len) {
-            if (arena->start <= frame && frame < arena->end) {
-                while (frame < arena->end && frame < end) {
-                    arena->free_frames -= !pmm_is_frame_allocated(arena, frame);
-                    pmm_mark_as_allocated(arena, frame);
-                    frame += PAGE_SIZE;
-                }
-                found = true;
-                break;
-            }
-            ++arena;
+    words = bitmap->levels[level];
+    first_word = first / 64u;
+    last_word = (last - 1) / 64u;
+    first_mask = ~0ull << (first % 64u);
+    last_mask = ~0ull >> (63u - (last - 1) % 64u);
+
+    if (first_word == last_word) {
+        first_mask &= last_mask;
+        cleared = __builtin_popcountll(words[first_word] & first_mask);
+        words[first_word] &= ~first_mask;
+    } else {
+        cleared = __builtin_popcountll(words[first_word] & first_mask);
+        cleared += __builtin_popcountll(words[last_word] & last_mask);
+        words[first_word] &= ~first_mask;
+        words[last_word] &= ~last_mask;
+
+        for (i = first_word + 1; i < last_word; ++i) {
+            cleared += __builtin_popcountll(words[i]);
         }
+        memset(words + first_word + 1, 0, (last_word - first_word - 1) * sizeof(uint64));
+    }
 
-        // Skip this frame if it doesn't belong to any arena
-        if (!found) {
-            frame += PAGE_SIZE;
+    // All the words between `first_word` and `last_word` are now empty, and so may be the edges.
+    pmm_bitmap_clear_range(
+        bitmap,
+        level + 1,
+        first_word + (words[first_word] != 0),
+        last_word + (words[last_word] == 0)
+    );
+
+    return cleared;
+}
+
+/*
+** Return the index of the first bit set, or `SIZE_MAX` if there is none.
+*/
+static inline
+size_t
+pmm_bitmap_find_first(
+    struct pmm_bitmap const *bitmap
+) {
+    uint64 word;
+    size_t idx;
+    uint i;
+
+    idx = 0;
+    i = bitmap->depth;
+    while (i > 0) {
+        --i;
+        word = bitmap->levels[i][idx];
+        if (!word) {
+            return SIZE_MAX;
         }
+        idx = idx * 64u + __builtin_ctzll(word);
     }
+    return idx;
+}
+
+/*
+** Test if the block at index `idx` is free.
+*/
+static inline
+bool
+pmm_is_block_free(
+    struct pmm_free_area const *area,
+    size_t idx
+) {
+    return pmm_bitmap_test(&area->bitmap, idx);
 }
 
 /*
-** Mark `frame` as free.
+** Mark the block at index `idx` as free.
 **
-** This function assumes `frame` belongs to `arena`.
+** This function assumes the block was previously taken.
 */
 static inline
 void
-pmm_mark_as_free(
-    struct pmm_arena *arena,
-    physaddr_t frame
+pmm_mark_block_as_free(
+    struct pmm_free_area *area,
+    size_t idx
 ) {
-    arena->bitmap[pmm_get_frame_idx(arena, frame)] &= ~pmm_get_frame_mask(arena, frame);
+    pmm_bitmap_set(&area->bitmap, idx);
+    area->free_blocks++;
 }
 
 /*
-** Allocate a new frame within the given arena and return it, or `PHYS_NULL` if
-** there is no physical memory left in that arena.
+** Mark the block at index `idx` as taken.
+**
+** This function assumes the block was previously free.
 */
-static
-physaddr_t
-pmm_alloc_frame_in_arena(
-    struct pmm_arena *arena
+static inline
+void
+pmm_mark_block_as_taken(
+    struct pmm_free_area *area,
+    size_t idx
 ) {
-    size_t i;
-    size_t j;
-    size_t final;
-    bool pass;
-
-    i = arena->next_frame;
-    final = arena->bitmap_size;
-    pass = false;
-
-look_for_frame:
-    while (i < final) {
-        if (arena->bitmap[i] != 0xFFu) {
-            j = 0u;
-            // Find which frame is not taken
-            while (j < 7u && (arena->bitmap[i] & (1 << j)) != 0) {
-                ++j;
-            }
-            arena->bitmap[i] |= (1 << j); // mark the frame as taken
-            arena->next_frame = i;
-            arena->free_frames--;
-            return arena->start + PAGE_SIZE * (i * 8u + j);
-        }
-        ++i;
-    }
-    if (!pass) {
-        final = arena->next_frame;
-        i = 0;
-        pass = true;
-        goto look_for_frame;
-    }
-    return PHYS_NULL;
+    pmm_bitmap_clear(&area->bitmap, idx);
+    area->free_blocks--;
 }
 
 /*
-** Allocate a new frame and return it, or `PHYS_NULL` if there is no physical
-** memory left.
+** Find the index of a free block within `area`.
+**
+** This function assumes there is at least one free block in `area`.
 */
-physaddr_t
-pmm_alloc_frame(
-    void
+static
+size_t
+pmm_find_free_block(
+    struct pmm_free_area *area
 ) {
-    struct pmm_arena *arena;
+    size_t idx;
 
-    arena = g_arenas;
-    while (arena < g_arenas + g_arenas_len) {
-        if (arena->free_frames) {
-            return pmm_alloc_frame_in_arena(arena);
-        }
-        ++arena;
+    idx = pmm_bitmap_find_first(&area->bitmap);
+    if (idx == SIZE_MAX) {
+        panic("pmm: the free block counter of an arena is corrupted");
     }
-    return PHYS_NULL;
+    return idx;
 }
 
 /*
-** Free a given frame.
+** Look for the free block containing `frame`.
 **
-** The frame may already be free, in which case this function does nothing.
+** If such block exists, its order is stored in `*order` and `true` is returned.
+** Otherwise, `frame` is allocated and `false` is returned.
+**
+** This function assumes `frame` belongs to `arena`.
 */
-void
-pmm_free_frame(
-    physaddr_t frame
+static
+bool
+pmm_find_free_block_containing(
+    struct pmm_arena const *arena,
+    physaddr_t frame,
+    uint *order
 ) {
-    struct pmm_arena *arena;
+    size_t idx;
+    uint i;
 
-    arena = g_arenas;
-    while (arena < g_arenas + g_arenas_len) {
-        if (arena->start <= frame && frame < arena->end) {
-            arena->free_frames += (pmm_is_frame_allocated(arena, frame));
-            pmm_mark_as_free(arena, frame);
-            arena->next_frame = pmm_get_frame_idx(arena, frame);
+    idx = pmm_get_frame_idx(arena, frame);
+    for (i = 0; i <= PMM_MAX_ORDER; ++i) {
+        if (pmm_is_block_free(&arena->areas[i], idx >> i)) {
+            *order = i;
+            return true;
         }
-        ++arena;
     }
+    return false;
 }
 
 /*
-** Setup a boot arena based on a physical memory region included in the binary.
+** Free the block of order `order` starting at `frame`, coalescing it with its
+** buddies.
 **
-** This is used to solve the egg-chicken problem at the heart of the allocator
-** (see the comment at the beginning of this module).
+** This function assumes the whole block belongs to `arena` and is allocated.
 */
+static
 void
-pmm_early_init(
-    void
+pmm_free_frames_in_arena(
+    struct pmm_arena *arena,
+    physaddr_t frame,
+    uint order
 ) {
-    memset(&g_boot_arena, 0, sizeof(g_boot_arena));
+    size_t idx;
 
-    g_boot_arena.start = (physaddr_t)g_kernel_boot_heap_start;
-    g_boot_arena.end = (physaddr_t)g_kernel_boot_heap_end;
+    debug_assert(frame + (PAGE_SIZE << order) <= arena->end);
 
-    g_boot_arena.bitmap = g_boot_arena_bitmap;
-    g_boot_arena.bitmap_size = sizeof(g_boot_arena_bitmap);
-    g_boot_arena.free_frames = (g_boot_arena.end - g_boot_arena.start) / PAGE_SIZE;
+    idx = pmm_get_frame_idx(arena, frame) >> order;
+    arena->free_frames += 1ul << order;
 
-    memset(g_boot_arena.bitmap, 0, g_boot_arena.bitmap_size);
+    // Merge the block with its buddy for as long as the buddy is free.
+    while (order < PMM_MAX_ORDER && pmm_is_block_free(&arena->areas[order], idx ^ 1u)) {
+        pmm_mark_block_as_taken(&arena->areas[order], idx ^ 1u);
+        idx /= 2;
+        ++order;
+    }
 
-    g_arenas = &g_boot_arena;
-    g_arenas_len = 1;
+    pmm_mark_block_as_free(&arena->areas[order], idx);
 }
 
 /*
-** Fully set-up the physical memory manager, using the boot arena initialized
-** in `pmm_early_init()`.
+** Allocate a block of `2^order` frames within the given arena and return it,
+** or `PHYS_NULL` if there is no block big enough left in that arena.
 */
-status_t
-pmm_init(
-    void
+static
+physaddr_t
+pmm_alloc_frames_in_arena(
+    struct pmm_arena *arena,
+    uint order
 ) {
-    struct pmm_arena *new_arenas;
-    size_t new_arenas_len;
-    struct pmm_reserved_area const *pra;
-    size_t mmap_len;
-    size_t i;
-    size_t j;
+    uint current;
+    size_t idx;
 
-    if (!g_mb_mmap) {
-        return ERR_BAD_STATE;
+    // Find the smallest order with a free block that is big enough
+    current = order;
+    while (current <= PMM_MAX_ORDER && !arena->areas[current].free_blocks) {
+        ++current;
     }
 
-    new_arenas_len = 0;
-    mmap_len = (g_mb_mmap->size - sizeof(*g_mb_mmap)) / g_mb_mmap->entry_size;
-
-    /*
-    ** First, we calculate how many arenas we'll need.
-    */
-
-    i = 0;
-    while (i < mmap_len) {
-        new_arenas_len += (g_mb_mmap->entries[i].type == MULTIBOOT_MEMORY_AVAILABLE);
-        ++i;
+    if (current > PMM_MAX_ORDER) {
+        return PHYS_NULL;
     }
 
-    /*
-    ** Then we allocate and initialize all `pmm_arena`, for each and every
-    ** multiboot mmap tag marked as available memory.
-    */
+    idx = pmm_find_free_block(&arena->areas[current]);
+    pmm_mark_block_as_taken(&arena->areas[current], idx);
 
-    new_arenas = kheap_alloc_zero(sizeof(struct pmm_arena) * new_arenas_len);
-    if (!new_arenas) {
-        return ERR_OUT_OF_MEMORY;
+    // Split the block until it has the requested size, freeing the upper halves.
+    while (current > order) {
+        --current;
+        idx *= 2;
+        pmm_mark_block_as_free(&arena->areas[current], idx + 1);
     }
 
-    logln("Memory regions:");
-
-    i = 0;
-    j = 0;
-    while (i < mmap_len) {
-        struct multiboot_mmap_entry const *entry;
-
-        entry = g_mb_mmap->entries + i;
-
-        logln(
-            "    %i | 0x%p-0x%p | %s",
-            i,
-            entry->addr,
-            entry->addr + entry->len,
-            multiboot_memory_str[entry->type]
-        );
-
-        if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
-            struct pmm_arena *arena;
-
-            arena = new_arenas + j;
+    arena->free_frames -= 1ul << order;
+    return arena->base + ((physaddr_t)idx << order) * PAGE_SIZE;
+}
 
-            /*
-            ** Multiboot might give us a memory region that isn't page-aligned,
-            ** so we round up the start address and round down the end address to
-            ** have the smallest (and therefore safest) region.
-            */
-            arena->start = ALIGN(entry->addr, PAGE_SIZE);
-            arena->end = ROUND_DOWN(entry->addr + entry->len, PAGE_SIZE);
+/*
+** Allocate a single frame of the given color within the given arena and return
+** it, or `PHYS_NULL` if there is no block holding every color left in that arena.
+**
+** The smallest block holding every color is split down to a single frame,
+** keeping at each step the half with the frame of the wanted color and freeing
+** the other one.
+*/
+static
+physaddr_t
+pmm_alloc_frame_color_in_arena(
+    struct pmm_arena *arena,
+    uint color
+) {
+    uint current;
+    uint order;
+    size_t idx;
 
-            arena->bitmap_size = ALIGN((arena->end - arena->start) / PAGE_SIZE, 8) / 8; // One byte per 8 frames.
-            arena->free_frames = (arena->end - arena->start) / PAGE_SIZE;
-            arena->bitmap = kheap_alloc_zero(arena->bitmap_size);
-            if (!arena->bitmap) {
-                return ERR_OUT_OF_MEMORY;
-            }
+    order = __builtin_ctz(g_pmm_colors);
 
-            // TODO Mark as allocated the few bits over arena->end but still
-            // in the bitmap
+    current = order;
+    while (current <= PMM_MAX_ORDER && !arena->areas[current].free_blocks) {
+        ++current;
+    }
 
-            ++j;
-        }
-        ++i;
+    if (current > PMM_MAX_ORDER) {
+        return PHYS_NULL;
     }
 
+    idx = pmm_find_free_block(&arena->areas[current]);
+    pmm_mark_block_as_taken(&arena->areas[current], idx);
+
     /*
-    ** Swap the old arena with the new ones
+    ** `arena->base` is aligned on `PMM_MAX_BLOCK_SIZE`, so the color of a frame
+    ** is given by the lowest bits of its index. Above `order`, both halves hold
+    ** every color, so the lower one is kept.
     */
+    while (current > 0) {
+        --current;
+        idx = idx * 2 + (current < order ? (color >> current) & 1u : 0);
+        pmm_mark_block_as_free(&arena->areas[current], idx ^ 1u);
+    }
+
+    arena->free_frames -= 1;
+    return arena->base + (physaddr_t)idx * PAGE_SIZE;
+}
+
+/*
+** Free all the frames from `start` to `end` using the biggest blocks possible.
+**
+** This function assumes the whole range belongs to `arena` and is allocated.
+*/
+static
+void
+pmm_free_range_in_arena(
+    struct pmm_arena *arena,
+    physaddr_t start,
+    physaddr_t end
+) {
+    uint order;
+
+    while (start < end) {
+        order = PMM_MAX_ORDER;
+        while (
+            order > 0
+            && (
+                (start & ((PAGE_SIZE << order) - 1))
+                || start + (PAGE_SIZE << order) > end
+            )
+        ) {
+            --order;
+        }
+        pmm_free_frames_in_arena(arena, start, order);
+        start += PAGE_SIZE << order;
+    }
+}
+
+/*
+** If `frame` is within a free block but isn't the first frame of that block,
+** split the block until `frame` is the first frame of a free block.
+**
+** The amount of free frames doesn't change, but afterwards no free block
+** overlaps both `frame` and the frame preceding it.
+**
+** This function assumes `frame` belongs to `arena`.
+*/
+static
+void
+pmm_split_free_block_at(
+    struct pmm_arena *arena,
+    physaddr_t frame
+) {
+    size_t idx;
+    uint order;
+
+    if (!pmm_find_free_block_containing(arena, frame, &order)) {
+        return ;
+    }
+
+    idx = pmm_get_frame_idx(arena, frame);
+    if (!(idx & ((1ul << order) - 1))) {
+        return ;
+    }
+
+    pmm_mark_block_as_taken(&arena->areas[order], idx >> order);
+
+    // Split the block, freeing each half that doesn't contain `frame`, until `frame` starts a block.
+    while (idx & ((1ul << order) - 1)) {
+        --order;
+        pmm_mark_block_as_free(&arena->areas[order], (idx >> order) ^ 1u);
+    }
+    pmm_mark_block_as_free(&arena->areas[order], idx >> order);
+}
+
+/*
+** Mark all frames from `start` to `end` as allocated and reserved.
+**
+** Frames of that range may already be allocated.
+**
+** The free blocks overlapping the edges of the range are split first, so that
+** every remaining free block is either entirely within the range or entirely
+** out of it. The blocks within the range are then taken a whole bitmap word
+** at a time.
+**
+** This function assumes the whole range belongs to `arena`.
+*/
+static
+void
+pmm_mark_range_as_allocated_in_arena(
+    struct pmm_arena *arena,
+    physaddr_t start,
+    physaddr_t end
+) {
+    size_t first;
+    size_t last;
+    size_t taken;
+    uint order;
+
+    if (start >= end) {
+        return ;
+    }
+
+    pmm_split_free_block_at(arena, start);
+    if (end < arena->end) {
+        pmm_split_free_block_at(arena, end);
+    }
+
+    first = pmm_get_frame_idx(arena, start);
+    last = pmm_get_frame_idx(arena, end);
+
+    for (order = 0; order <= PMM_MAX_ORDER; ++order) {
+        taken = pmm_bitmap_clear_range(
+            &arena->areas[order].bitmap,
+            0,
+            (first + (1ul << order) - 1) >> order,
+            last >> order
+        );
+        arena->areas[order].free_blocks -= taken;
+        arena->free_frames -= taken << order;
+    }
+
+    if (arena->frames) {
+        for (; start < end; start += PAGE_SIZE) {
+            arena->frames[(start - arena->start) / PAGE_SIZE].flags |= FRAME_RESERVED;
+        }
+    }
+}
+
+/*
+** Initialize the deferred frames of `arena` up to `limit`, freeing them.
+**
+** The amount of frames initialized is returned.
+**
+** `g_pmm_lock` must be held.
+*/
+static
+size_t
+pmm_arena_init_deferred(
+    struct pmm_arena *arena,
+    physaddr_t limit
+) {
+    physaddr_t start;
+
+    limit = limit < arena->end ? limit : arena->end;
+    if (limit <= arena->deferred) {
+        return 0;
+    }
+
+    start = arena->deferred;
+    pmm_free_range_in_arena(arena, start, limit);
+    arena->deferred = limit;
+
+    return (limit - start) / PAGE_SIZE;
+}
+
+/*
+** Find the first arena ending after `frame`, or the end of `g_arenas` if there
+** is none.
+**
+** Arenas are sorted and never modified past `pmm_init()`, therefore this
+** function runs in logarithmic time and doesn't need `g_pmm_lock` to be held.
+*/
+static
+struct pmm_arena *
+pmm_find_arena_after(
+    physaddr_t frame
+) {
+    size_t low;
+    size_t high;
+    size_t mid;
+
+    low = 0;
+    high = g_arenas_len;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (g_arenas[mid].end <= frame) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return g_arenas + low;
+}
+
+/*
+** Find the arena `frame` belongs to, or `NULL` if it doesn't belong to any.
+**
+** Like `pmm_find_arena_after()`, this function doesn't need `g_pmm_lock` to
+** be held.
+*/
+static
+struct pmm_arena *
+pmm_find_arena(
+    physaddr_t frame
+) {
+    struct pmm_arena *arena;
+
+    arena = pmm_find_arena_after(frame);
+    if (arena < g_arenas + g_arenas_len && arena->start <= frame) {
+        return arena;
+    }
+    return NULL;
+}
+
+/*
+** Return the descriptor of `frame`, or `NULL` if the descriptors of `arena`
+** aren't allocated yet.
+**
+** This function assumes `frame` belongs to `arena`.
+*/
+static inline
+struct frame *
+pmm_arena_get_frame(
+    struct pmm_arena const *arena,
+    physaddr_t frame
+) {
+    return arena->frames ? arena->frames + (frame - arena->start) / PAGE_SIZE : NULL;
+}
+
+/*
+** Reset the descriptors of `nb` contiguous frames that were just allocated,
+** giving a single reference to each of them.
+**
+** This function assumes all the frames belong to `arena`.
+*/
+static
+void
+pmm_arena_reset_frames(
+    struct pmm_arena const *arena,
+    physaddr_t frame,
+    size_t nb
+) {
+    struct frame *desc;
+
+    desc = pmm_arena_get_frame(arena, frame);
+    if (!desc) {
+        return ;
+    }
+
+    while (nb--) {
+        atomic_store(&desc->refcount, 1, ATOMIC_RELAXED);
+        desc->flags = 0;
+        desc->owner = FRAME_OWNER_NONE;
+        ++desc;
+    }
+}
+
+/*
+** Same as `pmm_arena_reset_frames()` but looks for the arena the frames belong to.
+*/
+static
+void
+pmm_reset_frames(
+    physaddr_t frame,
+    size_t nb
+) {
+    struct pmm_arena *arena;
+
+    arena = pmm_find_arena(frame);
+    if (arena) {
+        pmm_arena_reset_frames(arena, frame, nb);
+    }
+}
+
+/*
+** Drop a reference on `frame` and return `true` if it was the last one,
+** meaning the frame must be given back to the arenas.
+**
+** Frames without a descriptor are considered to only have one reference.
+** Reserved frames are never given back, except those of the boot heap: the
+** boot heap holds a reference on them until it is released, so they are given
+** back by whoever drops the last one.
+**
+** This function assumes `frame` belongs to `arena`.
+*/
+static
+bool
+pmm_arena_unref_frame(
+    struct pmm_arena const *arena,
+    physaddr_t frame
+) {
+    struct frame *desc;
+    uint32 old;
+
+    desc = pmm_arena_get_frame(arena, frame);
+    if (!desc) {
+        return true;
+    }
+
+    if ((desc->flags & FRAME_RESERVED) && !(desc->flags & FRAME_BOOT_HEAP)) {
+        return false;
+    }
+
+    old = atomic_fetch_sub(&desc->refcount, 1, ATOMIC_ACQ_REL);
+    debug_assert(old > 0);
+    return old == 1;
+}
+
+/*
+** Acquire `g_pmm_lock`, disabling interrupts.
+**
+** The previous interrupt state is stored in `*state`.
+*/
+static inline
+void
+pmm_lock(
+    bool *state
+) {
+    push_interrupts_state(state);
+    disable_interrupts();
+    spinlock_acquire(&g_pmm_lock);
+}
+
+/*
+** Release `g_pmm_lock` and restore the interrupt state saved by `pmm_lock()`.
+*/
+static inline
+void
+pmm_unlock(
+    bool const *state
+) {
+    spinlock_release(&g_pmm_lock);
+    pop_interrupts_state(state);
+}
+
+/*
+** Return the amount of free frames within all arenas.
+**
+** `g_pmm_lock` must be held.
+*/
+static
+size_t
+pmm_count_free_frames(
+    void
+) {
+    struct pmm_arena *arena;
+    size_t free;
+
+    free = 0;
+    for (arena = g_arenas; arena < g_arenas + g_arenas_len; ++arena) {
+        free += arena->free_frames;
+    }
+    return free;
+}
+
+/*
+** Run the shrinkers until they released `target` frames or none of them has
+** anything left to release, and return the amount of frames released.
+**
+** Only one CPU runs the shrinkers at a time. If another CPU is already running
+** them, this function returns 0 right away.
+**
+** `g_pmm_lock` must not be held.
+*/
+size_t
+pmm_shrink(
+    enum pmm_pressure pressure,
+    size_t target
+) {
+    struct pmm_shrinker const *shrinker;
+    size_t released;
+
+    if (atomic_exchange(&g_pmm_shrinking, true, ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    released = 0;
+    shrinker = __start_pmm_shrinker;
+    while (shrinker < __stop_pmm_shrinker && released < target) {
+        released += shrinker->shrink(pressure, target - released);
+        ++shrinker;
+    }
+
+    atomic_store(&g_pmm_shrinking, false, ATOMIC_RELEASE);
+    return released;
+}
+
+/*
+** Compare the amount of free frames left after an allocation, `free`, with
+** the watermarks.
+**
+** Under the `low` watermark, the reclaim thread is woken up. Under the `min`
+** watermark, the shrinkers are also run right away and `true` is returned if
+** they released any frame, in which case a failed allocation is worth trying
+** again.
+**
+** `g_pmm_lock` must not be held.
+*/
+static
+bool
+pmm_check_watermarks(
+    size_t free
+) {
+    if (free >= g_pmm_watermarks.low) {
+        return false;
+    }
+
+    atomic_store(&g_pmm_low_memory, true, ATOMIC_RELAXED);
+
+    if (g_pmm_reclaim_thread && !atomic_exchange(&g_pmm_reclaim_pending, true, ATOMIC_ACQ_REL)) {
+        wakeup(g_pmm_reclaim_thread);
+    }
+
+    if (free >= g_pmm_watermarks.min) {
+        return false;
+    }
+
+    return pmm_shrink(PMM_PRESSURE_MIN, g_pmm_watermarks.min - free) > 0;
+}
+
+/*
+** Allocate a block of `2^order` frames in the first arena that has one,
+** looking at the arenas of `node` first and then at those of the other nodes,
+** by increasing distance.
+**
+** `g_pmm_lock` must be held.
+*/
+static
+physaddr_t
+pmm_alloc_frames_in_arenas(
+    uint node,
+    uint order
+) {
+    struct pmm_arena *arena;
+    physaddr_t frame;
+    uint target;
+    uint i;
+
+    for (i = 0; i < g_pmm_nodes_len; ++i) {
+        target = g_pmm_node_fallbacks[node][i];
+        arena = g_arenas;
+        while (arena < g_arenas + g_arenas_len) {
+            if (arena->node == target && arena->free_frames >= (1ul << order)) {
+                frame = pmm_alloc_frames_in_arena(arena, order);
+                if (frame != PHYS_NULL) {
+                    return frame;
+                }
+            }
+            ++arena;
+        }
+    }
+    return PHYS_NULL;
+}
+
+/*
+** Allocate a single frame of the given color in the first arena that has one,
+** looking at the arenas of `node` first and then at those of the other nodes,
+** by increasing distance.
+**
+** `g_pmm_lock` must be held.
+*/
+static
+physaddr_t
+pmm_alloc_frame_color_in_arenas(
+    uint node,
+    uint color
+) {
+    struct pmm_arena *arena;
+    physaddr_t frame;
+    uint target;
+    uint i;
+
+    for (i = 0; i < g_pmm_nodes_len; ++i) {
+        target = g_pmm_node_fallbacks[node][i];
+        arena = g_arenas;
+        while (arena < g_arenas + g_arenas_len) {
+            if (arena->node == target && arena->free_frames >= g_pmm_colors) {
+                frame = pmm_alloc_frame_color_in_arena(arena, color);
+                if (frame != PHYS_NULL) {
+                    return frame;
+                }
+            }
+            ++arena;
+        }
+    }
+    return PHYS_NULL;
+}
+
+/*
+** Free a block of `2^order` frames, unless it is already free or doesn't belong
+** to any arena.
+**
+** `g_pmm_lock` must be held.
+*/
+static
+void
+pmm_free_frames_in_arenas(
+    physaddr_t frame,
+    uint order
+) {
+    struct pmm_arena *arena;
+    uint free_order;
+
+    arena = pmm_find_arena(frame);
+    if (
+        arena
+        && (
+            !pmm_find_free_block_containing(arena, frame, &free_order)
+            || free_order < order
+        )
+    ) {
+        pmm_free_frames_in_arena(arena, frame, order);
+    }
+}
+
+/*
+** Free the `nb` frames of `frames`, ignoring those that don't belong to any arena.
+**
+** If `unref` is `true`, a reference is dropped on each frame first, and only
+** the frames that lost their last reference are freed.
+**
+** Runs of contiguous frames are freed at once, using the biggest blocks
+** possible.
+**
+** `g_pmm_lock` must be held.
+*/
+static
+void
+pmm_free_frames_bulk_in_arenas(
+    size_t nb,
+    physaddr_t const frames[],
+    bool unref
+) {
+    struct pmm_arena *arena;
+    physaddr_t start;
+    physaddr_t end;
+    size_t i;
+
+    arena = NULL;
+    i = 0;
+    while (i < nb) {
+        start = frames[i++];
+
+        // Consecutive frames usually belong to the same arena, so try the previous one first.
+        if (!arena || start < arena->start || start >= arena->end) {
+            arena = pmm_find_arena(start);
+            if (!arena) {
+                continue;
+            }
+        }
+
+        if (unref && !pmm_arena_unref_frame(arena, start)) {
+            continue;
+        }
+
+        // Find the end of the run of contiguous frames beginning with `start`.
+        end = start + PAGE_SIZE;
+        while (i < nb && frames[i] == end && end < arena->end) {
+            ++i;
+            if (unref && !pmm_arena_unref_frame(arena, end)) {
+                break;
+            }
+            end += PAGE_SIZE;
+        }
+
+        pmm_free_range_in_arena(arena, start, end);
+    }
+}
+
+/*
+** Refill the given per-CPU cache with up to `PMM_CPU_CACHE_BATCH` frames.
+**
+** The amount of free frames left within the arenas is returned.
+**
+** Interrupts must be disabled.
+*/
+static
+size_t
+pmm_cpu_cache_refill(
+    struct pmm_cpu_cache *cache
+) {
+    physaddr_t frame;
+    size_t free;
+    uint node;
+
+    node = current_cpu()->node;
+
+    spinlock_acquire(&g_pmm_lock);
+    while (cache->len < PMM_CPU_CACHE_BATCH) {
+        frame = pmm_alloc_frames_in_arenas(node, 0);
+        if (frame == PHYS_NULL) {
+            break;
+        }
+        cache->frames[cache->len++] = frame;
+    }
+    free = pmm_count_free_frames();
+    spinlock_release(&g_pmm_lock);
+
+    return free;
+}
+
+/*
+** Give back the `PMM_CPU_CACHE_BATCH` oldest frames of the given per-CPU cache
+** to the arenas.
+**
+** Interrupts must be disabled.
+*/
+static
+void
+pmm_cpu_cache_drain(
+    struct pmm_cpu_cache *cache
+) {
+    size_t i;
+
+    debug_assert(cache->len >= PMM_CPU_CACHE_BATCH);
+
+    spinlock_acquire(&g_pmm_lock);
+    for (i = 0; i < PMM_CPU_CACHE_BATCH; ++i) {
+        pmm_free_frames_in_arenas(cache->frames[i], 0);
+    }
+    spinlock_release(&g_pmm_lock);
+
+    cache->len -= PMM_CPU_CACHE_BATCH;
+    memmove(cache->frames, cache->frames + PMM_CPU_CACHE_BATCH, cache->len * sizeof(cache->frames[0]));
+}
+
+/*
+** Mark a range of frames as allocated.
+**
+** Frames of that range sitting in the cache of the current CPU are removed from it.
+** The caches of the other CPUs are left untouched, so this function should only
+** be used before they are started.
+**
+** Only the arenas overlapping the range are visited, and their frames are
+** marked as allocated a whole bitmap word at a time.
+**
+** Once their descriptors exist, the frames are also flagged as reserved so
+** they are never freed.
+**
+** Deferred frames up to the end of the range are initialized first, so that
+** initializing them later doesn't free the range.
+*/
+void
+pmm_mark_range_as_allocated(
+    physaddr_t frame,
+    size_t len
+) {
+    struct pmm_cpu_cache *cache;
+    struct pmm_arena *arena;
+    physaddr_t end;
+    bool state;
+    size_t i;
+
+    debug_assert(IS_PAGE_ALIGNED(frame));
+    debug_assert(IS_PAGE_ALIGNED(len));
+
+    end = frame + len;
+
+    pmm_lock(&state);
+
+    cache = &current_cpu()->pmm_cache;
+    i = 0;
+    while (i < cache->len) {
+        if (frame <= cache->frames[i] && cache->frames[i] < end) {
+            cache->frames[i] = cache->frames[--cache->len];
+        } else {
+            ++i;
+        }
+    }
+
+    arena = pmm_find_arena_after(frame);
+    while (arena < g_arenas + g_arenas_len && arena->start < end) {
+        pmm_arena_init_deferred(arena, end);
+        pmm_mark_range_as_allocated_in_arena(
+            arena,
+            frame > arena->start ? frame : arena->start,
+            end < arena->end ? end : arena->end
+        );
+        ++arena;
+    }
+
+    pmm_unlock(&state);
+}
+
+/*
+** Give a range of frames previously marked as allocated back to the arenas.
+**
+** Nothing must use the range anymore.
+*/
+void
+pmm_release_range(
+    physaddr_t frame,
+    size_t len
+) {
+    struct pmm_arena *arena;
+    physaddr_t start;
+    physaddr_t end;
+    physaddr_t pa;
+    bool state;
+
+    debug_assert(IS_PAGE_ALIGNED(frame));
+    debug_assert(IS_PAGE_ALIGNED(len));
+
+    pmm_lock(&state);
+
+    arena = pmm_find_arena_after(frame);
+    while (arena < g_arenas + g_arenas_len && arena->start < frame + len) {
+        start = frame > arena->start ? frame : arena->start;
+        end = frame + len < arena->end ? frame + len : arena->end;
+
+        if (arena->frames) {
+            for (pa = start; pa < end; pa += PAGE_SIZE) {
+                arena->frames[(pa - arena->start) / PAGE_SIZE].flags &= ~FRAME_RESERVED;
+            }
+        }
+
+        pmm_free_range_in_arena(arena, start, end);
+        ++arena;
+    }
+
+    pmm_unlock(&state);
+}
+
+/*
+** Allocate a block of `2^order` physically contiguous frames, aligned on its
+** own size, and return the first one, or `PHYS_NULL` if there is no block big
+** enough left.
+*/
+physaddr_t
+pmm_alloc_frames(
+    uint order
+) {
+    physaddr_t frame;
+    size_t free;
+    bool state;
+
+    debug_assert(order <= PMM_MAX_ORDER);
+
+    if (order == 0) {
+        return pmm_alloc_frame();
+    }
+
+    pmm_lock(&state);
+    frame = pmm_alloc_frames_in_arenas(current_cpu()->node, order);
+    free = pmm_count_free_frames();
+    pmm_unlock(&state);
+
+    if (pmm_check_watermarks(free) && frame == PHYS_NULL) {
+        // The shrinkers released some frames, try again.
+        return pmm_alloc_frames(order);
+    }
+
+    if (frame != PHYS_NULL) {
+        pmm_reset_frames(frame, 1ul << order);
+    }
+
+    return frame;
+}
+
+/*
+** Allocate `nb` frames and store them in `frames`.
+**
+** The frames aren't necessarily contiguous, but they are taken from the arenas
+** in blocks as big as possible, and stored in ascending order within each block.
+** The arenas of the node of the current CPU are used first.
+** The lock protecting the arenas is only taken once.
+**
+** Either all the frames are allocated and `OK` is returned, or none is and
+** `ERR_OUT_OF_MEMORY` is returned.
+*/
+status_t
+pmm_alloc_frames_bulk(
+    size_t nb,
+    physaddr_t frames[]
+) {
+    struct pmm_arena *arena;
+    physaddr_t frame;
+    physaddr_t end;
+    size_t done;
+    size_t free;
+    uint order;
+    uint node;
+    uint i;
+    bool state;
+
+    done = 0;
+
+    pmm_lock(&state);
+
+    node = current_cpu()->node;
+
+    i = 0;
+    arena = g_arenas;
+    while (done < nb && i < g_pmm_nodes_len) {
+        if (arena == g_arenas + g_arenas_len) {
+            // Move on to the next closest node.
+            arena = g_arenas;
+            ++i;
+            continue;
+        }
+
+        if (arena->node != g_pmm_node_fallbacks[node][i] || !arena->free_frames) {
+            ++arena;
+            continue;
+        }
+
+        // Take the biggest block that fits in the remaining frames.
+        order = 63u - __builtin_clzll(nb - done);
+        order = order > PMM_MAX_ORDER ? PMM_MAX_ORDER : order;
+
+        frame = pmm_alloc_frames_in_arena(arena, order);
+        while (frame == PHYS_NULL) {
+            debug_assert(order > 0);
+            --order;
+            frame = pmm_alloc_frames_in_arena(arena, order);
+        }
+
+        pmm_arena_reset_frames(arena, frame, 1ul << order);
+
+        end = frame + (PAGE_SIZE << order);
+        while (frame < end) {
+            frames[done++] = frame;
+            frame += PAGE_SIZE;
+        }
+    }
+
+    if (done < nb) {
+        pmm_free_frames_bulk_in_arenas(done, frames, false);
+    }
+
+    free = pmm_count_free_frames();
+
+    pmm_unlock(&state);
+
+    if (pmm_check_watermarks(free) && done < nb) {
+        // The shrinkers released some frames, try again.
+        return pmm_alloc_frames_bulk(nb, frames);
+    }
+
+    return done < nb ? ERR_OUT_OF_MEMORY : OK;
+}
+
+/*
+** Drop a reference on each of the `nb` frames of `frames`, freeing those that
+** lost their last one.
+**
+** The frames go straight back to the arenas, bypassing the per-CPU caches, and
+** the lock protecting the arenas is only taken once. Runs of contiguous frames
+** are freed as whole blocks.
+**
+** Frames that don't belong to any arena are ignored. Each frame must be
+** allocated, and must appear only once in `frames`.
+*/
+void
+pmm_free_frames_bulk(
+    size_t nb,
+    physaddr_t const frames[]
+) {
+    bool state;
+
+    pmm_lock(&state);
+    pmm_free_frames_bulk_in_arenas(nb, frames, true);
+    pmm_unlock(&state);
+}
+
+/*
+** Allocate a new frame, preferably within the given NUMA node, and return it,
+** or `PHYS_NULL` if there is no physical memory left.
+**
+** If `node` has no free frame left, the frame is taken from the closest node
+** that has one.
+*/
+physaddr_t
+pmm_alloc_frame_node(
+    uint node
+) {
+    physaddr_t frame;
+    size_t free;
+    bool state;
+
+    debug_assert(node < g_pmm_nodes_len);
+
+    // The cache of the current CPU is filled with frames of its own node.
+    if (node == current_cpu()->node) {
+        return pmm_alloc_frame();
+    }
+
+    pmm_lock(&state);
+    frame = pmm_alloc_frames_in_arenas(node, 0);
+    free = pmm_count_free_frames();
+    pmm_unlock(&state);
+
+    if (pmm_check_watermarks(free) && frame == PHYS_NULL) {
+        // The shrinkers released some frames, try again.
+        return pmm_alloc_frame_node(node);
+    }
+
+    if (frame != PHYS_NULL) {
+        pmm_reset_frames(frame, 1);
+    }
+
+    return frame;
+}
+
+/*
+** Allocate a new frame and return it, or `PHYS_NULL` if there is no physical
+** memory left.
+**
+** The frame is taken from the cache of the current CPU, which is refilled from
+** the arenas if it is empty. The watermarks are only checked when the cache is
+** refilled.
+*/
+physaddr_t
+pmm_alloc_frame(
+    void
+) {
+    struct pmm_cpu_cache *cache;
+    physaddr_t frame;
+    size_t free;
+    bool state;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    cache = &current_cpu()->pmm_cache;
+    free = SIZE_MAX;
+    if (!cache->len) {
+        free = pmm_cpu_cache_refill(cache);
+    }
+    frame = cache->len ? cache->frames[--cache->len] : PHYS_NULL;
+
+    pop_interrupts_state(&state);
+
+    if (pmm_check_watermarks(free) && frame == PHYS_NULL) {
+        // The shrinkers released some frames, try again.
+        return pmm_alloc_frame();
+    }
+
+    if (frame != PHYS_NULL) {
+        pmm_reset_frames(frame, 1);
+    }
+
+    return frame;
+}
+
+/*
+** Return the cache color of the given frame (see `PMM_MAX_COLORS`).
+*/
+uint
+pmm_frame_color(
+    physaddr_t frame
+) {
+    return (frame / PAGE_SIZE) & (g_pmm_colors - 1);
+}
+
+/*
+** Reserve `nb` consecutive colors and return the first one.
+**
+** Callers allocating several frames give them consecutive colors starting at
+** the returned one, so that successive allocations (for example the stacks of
+** all threads) don't all start on the same color, and therefore don't compete
+** for the same cache sets at the same offset.
+*/
+uint
+pmm_reserve_colors(
+    size_t nb
+) {
+    return atomic_fetch_add(&g_pmm_next_color, nb, ATOMIC_RELAXED) & (g_pmm_colors - 1);
+}
+
+/*
+** Allocate a new frame of the given color (modulo the amount of colors) and
+** return it, or `PHYS_NULL` if there is no physical memory left.
+**
+** The color is a hint: if no frame of that color can be found, a frame of any
+** other color is returned instead.
+*/
+physaddr_t
+pmm_alloc_frame_color(
+    uint color
+) {
+    struct pmm_cpu_cache *cache;
+    physaddr_t frame;
+    size_t free;
+    size_t i;
+    bool state;
+
+    if (g_pmm_colors == 1) {
+        return pmm_alloc_frame();
+    }
+
+    color &= g_pmm_colors - 1;
+    frame = PHYS_NULL;
+
+    // Look for a frame of that color in the cache of the current CPU first.
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    cache = &current_cpu()->pmm_cache;
+    for (i = cache->len; i > 0; --i) {
+        if (pmm_frame_color(cache->frames[i - 1]) == color) {
+            frame = cache->frames[i - 1];
+            cache->frames[i - 1] = cache->frames[--cache->len];
+            break;
+        }
+    }
+
+    pop_interrupts_state(&state);
+
+    if (frame == PHYS_NULL) {
+        pmm_lock(&state);
+        frame = pmm_alloc_frame_color_in_arenas(current_cpu()->node, color);
+        if (frame == PHYS_NULL) {
+            // Memory is too fragmented to find that color, any frame will do.
+            frame = pmm_alloc_frames_in_arenas(current_cpu()->node, 0);
+        }
+        free = pmm_count_free_frames();
+        pmm_unlock(&state);
+
+        if (pmm_check_watermarks(free) && frame == PHYS_NULL) {
+            // The shrinkers released some frames, try again.
+            return pmm_alloc_frame_color(color);
+        }
+    }
+
+    if (frame != PHYS_NULL) {
+        pmm_reset_frames(frame, 1);
+    }
+
+    return frame;
+}
+
+/*
+** Fill the given frame with zeroes, using the scratch page of the current CPU
+** to map it.
+*/
+static
+void
+pmm_zero_frame(
+    physaddr_t frame
+) {
+    uint64 volatile *page;
+    physaddr_t old;
+    size_t i;
+    bool state;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    page = (uint64 volatile *)vmm_scratch_map(frame, &old);
+
+    // `volatile` keeps the compiler from turning this loop into a call to the byte-wise `memset()`.
+    for (i = 0; i < PAGE_SIZE / sizeof(uint64); ++i) {
+        page[i] = 0;
+    }
+
+    vmm_scratch_unmap(old);
+
+    pop_interrupts_state(&state);
+}
+
+/*
+** Allocate a new frame filled with zeroes and return it, or `PHYS_NULL` if
+** there is no physical memory left.
+**
+** The frame is taken from the pool of zeroed frames. If that pool is empty,
+** a frame is allocated and zeroed on the spot.
+*/
+physaddr_t
+pmm_alloc_frame_zeroed(
+    void
+) {
+    physaddr_t frame;
+    bool state;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+    spinlock_acquire(&g_pmm_zeroed_pool_lock);
+
+    frame = g_pmm_zeroed_pool_len ? g_pmm_zeroed_pool[--g_pmm_zeroed_pool_len] : PHYS_NULL;
+
+    spinlock_release(&g_pmm_zeroed_pool_lock);
+    pop_interrupts_state(&state);
+
+    if (frame == PHYS_NULL) {
+        frame = pmm_alloc_frame();
+        if (frame != PHYS_NULL) {
+            pmm_zero_frame(frame);
+        }
+    }
+
+    return frame;
+}
+
+/*
+** Zero a free frame and add it to the pool of zeroed frames, unless that pool
+** is already full.
+**
+** This is meant to be called by idle CPUs. It only zeroes a single frame so
+** the caller can check often whether it has something better to do.
+**
+** `true` is returned if a frame was zeroed.
+*/
+bool
+pmm_zeroed_pool_fill(
+    void
+) {
+    physaddr_t frame;
+    size_t free;
+    bool state;
+
+    if (atomic_load(&g_pmm_zeroed_pool_len, ATOMIC_RELAXED) >= PMM_ZEROED_POOL_SIZE) {
+        return false;
+    }
+
+    // Don't take frames away from the rest of the kernel when memory is running low.
+    if (atomic_load(&g_pmm_low_memory, ATOMIC_RELAXED)) {
+        pmm_lock(&state);
+        free = pmm_count_free_frames();
+        pmm_unlock(&state);
+
+        if (free < g_pmm_watermarks.high) {
+            return false;
+        }
+        atomic_store(&g_pmm_low_memory, false, ATOMIC_RELAXED);
+    }
+
+    frame = pmm_alloc_frame();
+    if (frame == PHYS_NULL) {
+        return false;
+    }
+
+    pmm_zero_frame(frame);
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+    spinlock_acquire(&g_pmm_zeroed_pool_lock);
+
+    if (g_pmm_zeroed_pool_len < PMM_ZEROED_POOL_SIZE) {
+        g_pmm_zeroed_pool[g_pmm_zeroed_pool_len++] = frame;
+        frame = PHYS_NULL;
+    }
+
+    spinlock_release(&g_pmm_zeroed_pool_lock);
+    pop_interrupts_state(&state);
+
+    // Another CPU filled the pool in the meantime.
+    if (frame != PHYS_NULL) {
+        pmm_free_frame(frame);
+    }
+
+    return true;
+}
+
+/*
+** A shrinker giving the frames of the pool of zeroed frames back to the arenas.
+*/
+static
+size_t
+pmm_zeroed_pool_shrink(
+    enum pmm_pressure pressure [[maybe_unused]],
+    size_t target
+) {
+    physaddr_t frames[PMM_CPU_CACHE_BATCH];
+    size_t released;
+    size_t nb;
+    bool state;
+
+    released = 0;
+    while (released < target) {
+        push_interrupts_state(&state);
+        disable_interrupts();
+        spinlock_acquire(&g_pmm_zeroed_pool_lock);
+
+        nb = g_pmm_zeroed_pool_len;
+        nb = nb > ARRAY_LENGTH(frames) ? ARRAY_LENGTH(frames) : nb;
+        nb = nb > target - released ? target - released : nb;
+        g_pmm_zeroed_pool_len -= nb;
+        memcpy(frames, g_pmm_zeroed_pool + g_pmm_zeroed_pool_len, nb * sizeof(frames[0]));
+
+        spinlock_release(&g_pmm_zeroed_pool_lock);
+        pop_interrupts_state(&state);
+
+        if (!nb) {
+            break;
+        }
+
+        pmm_free_frames_bulk(nb, frames);
+        released += nb;
+    }
+
+    return released;
+}
+
+REGISTER_PMM_SHRINKER(pmm_zeroed_pool, &pmm_zeroed_pool_shrink);
+
+/*
+** Initialize the next chunk of frames deferred by `pmm_init()`, and return the
+** amount of frames initialized (0 if there's nothing left to initialize).
+*/
+static
+size_t
+pmm_init_deferred_chunk(
+    void
+) {
+    struct pmm_arena *arena;
+    physaddr_t limit;
+    size_t nb;
+    bool state;
+
+    if (atomic_load(&g_pmm_deferred_done, ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    nb = 0;
+
+    pmm_lock(&state);
+    for (arena = g_arenas; arena < g_arenas + g_arenas_len && !nb; ++arena) {
+        limit = ROUND_DOWN(arena->deferred, PMM_DEFERRED_CHUNK_SIZE) + PMM_DEFERRED_CHUNK_SIZE;
+        nb = pmm_arena_init_deferred(arena, limit);
+    }
+    pmm_unlock(&state);
+
+    if (!nb && !atomic_exchange(&g_pmm_deferred_done, true, ATOMIC_RELEASE)) {
+        logln("pmm: all physical memory is initialized");
+    }
+
+    return nb;
+}
+
+/*
+** Initialize the next chunk of frames deferred by `pmm_init()`, and return
+** `true` if there was one.
+**
+** This is meant to be called by idle CPUs, so that all APs share the work
+** right after they are started.
+*/
+bool
+pmm_deferred_init_step(
+    void
+) {
+    return pmm_init_deferred_chunk() > 0;
+}
+
+/*
+** A shrinker initializing the frames deferred by `pmm_init()`, in case memory
+** runs low before idle CPUs are done with them.
+*/
+static
+size_t
+pmm_deferred_shrink(
+    enum pmm_pressure pressure [[maybe_unused]],
+    size_t target
+) {
+    size_t released;
+    size_t nb;
+
+    released = 0;
+    do {
+        nb = pmm_init_deferred_chunk();
+        released += nb;
+    } while (nb && released < target);
+
+    return released;
+}
+
+REGISTER_PMM_SHRINKER(pmm_deferred, &pmm_deferred_shrink);
+
+/*
+** The reclaim thread.
+**
+** It sleeps until free frames go below the `low` watermark, then runs the
+** shrinkers until free frames are back above the `high` watermark or the
+** shrinkers have nothing left to release.
+*/
+int
+pmm_reclaim(
+    void
+) {
+    size_t free;
+    bool state;
+
+    while (42) {
+        sleep(&g_pmm_reclaim_pending);
+        atomic_store(&g_pmm_reclaim_pending, false, ATOMIC_RELEASE);
+
+        do {
+            pmm_lock(&state);
+            free = pmm_count_free_frames();
+            pmm_unlock(&state);
+        } while (free < g_pmm_watermarks.high && pmm_shrink(PMM_PRESSURE_LOW, g_pmm_watermarks.high - free));
+
+        if (free >= g_pmm_watermarks.high) {
+            atomic_store(&g_pmm_low_memory, false, ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+** Start the reclaim thread.
+*/
+static
+status_t
+pmm_reclaim_init(
+    void
+) {
+    return thread_new(&pmm_reclaim, &g_pmm_reclaim_thread);
+}
+
+REGISTER_INIT_HOOK(pmm_reclaim, &pmm_reclaim_init, INIT_LEVEL_PLATFORM);
+
+/*
+** Drop a reference on each frame of a block of `2^order` frames previously
+** allocated with `pmm_alloc_frames()`, freeing those that lost their last one.
+**
+** Frames of a block can also be freed individually, using `pmm_free_frame()`.
+*/
+void
+pmm_free_frames(
+    physaddr_t frame,
+    uint order
+) {
+    struct pmm_arena *arena;
+    uint64 last[(1ul << PMM_MAX_ORDER) / 64u];
+    size_t i;
+    bool all;
+    bool state;
+
+    debug_assert(order <= PMM_MAX_ORDER);
+    debug_assert(IS_PAGE_ALIGNED(frame));
+
+    if (order == 0) {
+        pmm_free_frame(frame);
+        return ;
+    }
+
+    arena = pmm_find_arena(frame);
+    if (!arena) {
+        return ;
+    }
+
+    // Remember the frames whose last reference is dropped here: the others may be
+    // freed by whoever drops theirs, concurrently.
+    memset(last, 0, sizeof(last));
+    all = true;
+    for (i = 0; i < (1ul << order); ++i) {
+        if (pmm_arena_unref_frame(arena, frame + i * PAGE_SIZE)) {
+            last[i / 64u] |= 1ull << (i % 64u);
+        } else {
+            all = false;
+        }
+    }
+
+    pmm_lock(&state);
+    if (all) {
+        pmm_free_frames_in_arenas(frame, order);
+    } else {
+        // Some frames are still referenced, so only free the others one by one.
+        for (i = 0; i < (1ul << order); ++i) {
+            if (last[i / 64u] & (1ull << (i % 64u))) {
+                pmm_free_frames_in_arenas(frame + i * PAGE_SIZE, 0);
+            }
+        }
+    }
+    pmm_unlock(&state);
+}
+
+/*
+** Drop a reference on a given frame, freeing it if it was the last one.
+**
+** The frame is put in the cache of the current CPU, which is drained to the
+** arenas if it is full.
+**
+** Frames that don't belong to any arena are ignored. Because of the per-CPU
+** caches, a frame must not be freed twice.
+*/
+void
+pmm_free_frame(
+    physaddr_t frame
+) {
+    struct pmm_cpu_cache *cache;
+    struct pmm_arena *arena;
+    bool state;
+
+    debug_assert(IS_PAGE_ALIGNED(frame));
+
+    arena = pmm_find_arena(frame);
+    if (!arena || !pmm_arena_unref_frame(arena, frame)) {
+        return ;
+    }
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    cache = &current_cpu()->pmm_cache;
+    if (cache->len == PMM_CPU_CACHE_SIZE) {
+        pmm_cpu_cache_drain(cache);
+    }
+    cache->frames[cache->len++] = frame;
+
+    pop_interrupts_state(&state);
+}
+
+/*
+** Return the descriptor of the given frame, or `NULL` if it doesn't belong to
+** any arena or if the descriptors aren't allocated yet.
+*/
+struct frame *
+pmm_get_frame(
+    physaddr_t frame
+) {
+    struct pmm_arena *arena;
+
+    arena = pmm_find_arena(frame);
+    return arena ? pmm_arena_get_frame(arena, frame) : NULL;
+}
+
+/*
+** Take an extra reference on an allocated frame, for instance to map it at
+** multiple places.
+**
+** Each reference must be dropped with `pmm_free_frame()`.
+*/
+void
+pmm_frame_ref(
+    physaddr_t frame
+) {
+    struct frame *desc;
+    uint32 old [[maybe_unused]];
+
+    desc = pmm_get_frame(frame);
+    if (desc) {
+        old = atomic_fetch_add(&desc->refcount, 1, ATOMIC_RELAXED);
+        debug_assert(old > 0);
+    }
+}
+
+/*
+** Calculate the amount of words needed by all the bitmaps of an arena going
+** from `start` to `end`.
+*/
+static
+size_t
+pmm_arena_bitmaps_words(
+    physaddr_t start,
+    physaddr_t end
+) {
+    size_t frames;
+    size_t words;
+    uint order;
+
+    frames = (end - ROUND_DOWN(start, PMM_MAX_BLOCK_SIZE)) / PAGE_SIZE;
+    words = 0;
+    for (order = 0; order <= PMM_MAX_ORDER; ++order) {
+        words += pmm_bitmap_words((frames + (1ul << order) - 1) >> order, NULL);
+    }
+    return words;
+}
+
+/*
+** Initialize `arena` so it covers all frames from `start` to `end`, using
+** `bitmaps` to store its bitmaps.
+**
+** `bitmaps` must be at least `pmm_arena_bitmaps_words(start, end)` words long.
+**
+** All the frames of the arena are marked as allocated.
+*/
+static
+void
+pmm_arena_init(
+    struct pmm_arena *arena,
+    physaddr_t start,
+    physaddr_t end,
+    uint64 *bitmaps
+) {
+    size_t frames;
+    uint order;
+
+    memset(arena, 0, sizeof(*arena));
+    arena->start = start;
+    arena->end = end;
+    arena->base = ROUND_DOWN(start, PMM_MAX_BLOCK_SIZE);
+    arena->deferred = end;
+
+    frames = (end - arena->base) / PAGE_SIZE;
+    for (order = 0; order <= PMM_MAX_ORDER; ++order) {
+        bitmaps += pmm_bitmap_init(
+            &arena->areas[order].bitmap,
+            (frames + (1ul << order) - 1) >> order,
+            bitmaps
+        );
+    }
+}
+
+/*
+** Mark all reserved areas as allocated, including the kernel itself and the
+** boot heap.
+*/
+static
+void
+pmm_mark_reserved_areas(
+    void
+) {
+    struct pmm_reserved_area const *pra;
+
+    pra = __start_pmm_reserved_area;
+    while (pra < __stop_pmm_reserved_area) {
+		pmm_mark_range_as_allocated(pra->start, pra->end - pra->start);
+        ++pra;
+    }
+
+    /*
+    ** Mark the boot heap as allocated.
+    **
+    ** The frames the boot arena didn't hand out are given back once the boot
+    ** process is over (see `pmm_release_boot_heap()`).
+    */
+
+    pmm_mark_range_as_allocated(
+        (physaddr_t)g_kernel_boot_heap_start,
+        g_kernel_boot_heap_end - g_kernel_boot_heap_start
+    );
+}
+
+/*
+** Give the frames of the boot heap that were never handed out by the boot
+** arena back to the arenas.
+**
+** The other frames were handed out, mostly to the kernel's heap and page
+** tables. They are no longer considered reserved, and the reference the boot
+** heap holds on them is dropped (see `pmm_frames_init()`): those that were
+** freed in the meantime are given back to the arenas, and the others can be
+** freed like any other frame.
+**
+** This must be called before the boot data is released, since the boot arena
+** lives there.
+*/
+void
+pmm_release_boot_heap(
+    void
+) {
+    physaddr_t frame;
+    physaddr_t heap_end;
+    physaddr_t end;
+    struct frame *desc;
+    uint order;
+    bool state;
+
+    frame = (physaddr_t)g_kernel_boot_heap_start;
+    heap_end = (physaddr_t)g_kernel_boot_heap_end;
+
+    while (frame < heap_end) {
+        if (pmm_find_free_block_containing(&g_boot_arena, frame, &order)) {
+            // Release the rest of the free block at once.
+            end = ROUND_DOWN(frame, PAGE_SIZE << order) + (PAGE_SIZE << order);
+            end = end < heap_end ? end : heap_end;
+            pmm_release_range(frame, end - frame);
+            frame = end;
+        } else {
+            pmm_lock(&state);
+            desc = pmm_get_frame(frame);
+            if (desc && (desc->flags & FRAME_BOOT_HEAP)) {
+                desc->flags &= ~(FRAME_RESERVED | FRAME_BOOT_HEAP);
+                if (atomic_fetch_sub(&desc->refcount, 1, ATOMIC_ACQ_REL) == 1) {
+                    pmm_free_frames_in_arenas(frame, 0);
+                }
+            }
+            pmm_unlock(&state);
+            frame += PAGE_SIZE;
+        }
+    }
+}
+
+/*
+** Setup a boot arena based on a physical memory region included in the binary.
+**
+** This is used to solve the egg-chicken problem at the heart of the allocator
+** (see the comment at the beginning of this module).
+*/
+void
+pmm_early_init(
+    void
+) {
+    debug_assert(
+        pmm_arena_bitmaps_words((physaddr_t)g_kernel_boot_heap_start, (physaddr_t)g_kernel_boot_heap_end)
+        <= ARRAY_LENGTH(g_boot_arena_bitmaps)
+    );
+
+    pmm_arena_init(
+        &g_boot_arena,
+        (physaddr_t)g_kernel_boot_heap_start,
+        (physaddr_t)g_kernel_boot_heap_end,
+        g_boot_arena_bitmaps
+    );
+    pmm_free_range_in_arena(&g_boot_arena, g_boot_arena.start, g_boot_arena.end);
+
+    g_arenas = &g_boot_arena;
+    g_arenas_len = 1;
+}
+
+/*
+** Fully set-up the physical memory manager, using the boot arena initialized
+** in `pmm_early_init()`.
+*/
+status_t
+pmm_init(
+    void
+) {
+    struct pmm_arena *new_arenas;
+    size_t new_arenas_len;
+    size_t mmap_len;
+    size_t frames;
+    size_t colors;
+    size_t budget;
+    size_t i;
+    size_t j;
+
+    if (!g_mb_mmap) {
+        return ERR_BAD_STATE;
+    }
+
+    new_arenas_len = 0;
+    mmap_len = (g_mb_mmap->size - sizeof(*g_mb_mmap)) / g_mb_mmap->entry_size;
+
+    /*
+    ** First, we calculate how many arenas we'll need.
+    */
+
+    i = 0;
+    while (i < mmap_len) {
+        new_arenas_len += (g_mb_mmap->entries[i].type == MULTIBOOT_MEMORY_AVAILABLE);
+        ++i;
+    }
+
+    /*
+    ** Then we allocate and initialize all `pmm_arena`, for each and every
+    ** multiboot mmap tag marked as available memory.
+    */
+
+    new_arenas = kheap_alloc_zero(sizeof(struct pmm_arena) * new_arenas_len);
+    if (!new_arenas) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    logln("Memory regions:");
+
+    budget = KCONFIG_PMM_EARLY_INIT_SIZE;
+    i = 0;
+    j = 0;
+    while (i < mmap_len) {
+        struct multiboot_mmap_entry const *entry;
+
+        entry = g_mb_mmap->entries + i;
+
+        logln(
+            "    %i | 0x%p-0x%p | %s",
+            i,
+            entry->addr,
+            entry->addr + entry->len,
+            multiboot_memory_str[entry->type]
+        );
+
+        if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
+            struct pmm_arena *arena;
+            physaddr_t start;
+            physaddr_t end;
+            uint64 *bitmaps;
+
+            arena = new_arenas + j;
+
+            /*
+            ** Multiboot might give us a memory region that isn't page-aligned,
+            ** so we round up the start address and round down the end address to
+            ** have the smallest (and therefore safest) region.
+            */
+            start = ALIGN(entry->addr, PAGE_SIZE);
+            end = ROUND_DOWN(entry->addr + entry->len, PAGE_SIZE);
+            end = end < start ? start : end;
+
+            bitmaps = kheap_alloc(pmm_arena_bitmaps_words(start, end) * sizeof(uint64));
+            if (!bitmaps) {
+                return ERR_OUT_OF_MEMORY;
+            }
+
+            pmm_arena_init(arena, start, end, bitmaps);
+
+            /*
+            ** Only free the frames that fit in what's left of the budget, the
+            ** other ones are initialized later (see `pmm_deferred_init_step()`).
+            */
+            arena->deferred = start + (end - start < budget ? end - start : budget);
+            budget -= arena->deferred - start;
+            pmm_free_range_in_arena(arena, start, arena->deferred);
+
+            ++j;
+        }
+        ++i;
+    }
+
+    /*
+    ** Sort the arenas by address so they can be looked up with a binary search.
+    **
+    ** There are only a handful of them, so an insertion sort does the job.
+    */
+    for (i = 1; i < new_arenas_len; ++i) {
+        struct pmm_arena tmp;
+
+        j = i;
+        while (j > 0 && new_arenas[j - 1].start > new_arenas[j].start) {
+            tmp = new_arenas[j];
+            new_arenas[j] = new_arenas[j - 1];
+            new_arenas[j - 1] = tmp;
+            --j;
+        }
+    }
+
+    /*
+    ** Swap the old arena with the new ones
+    */
+    g_arenas = new_arenas;
+    g_arenas_len = new_arenas_len;
+
+    /*
+    ** The allocator is now initialized but we still have to mark all reserved
+    ** areas as allocated (including the kernel itself).
+    */
+    pmm_mark_reserved_areas();
+
+    /*
+    ** Set the watermarks according to the amount of memory the arenas manage.
+    */
+    frames = 0;
+    for (i = 0; i < g_arenas_len; ++i) {
+        frames += (g_arenas[i].end - g_arenas[i].start) / PAGE_SIZE;
+    }
+
+    g_pmm_watermarks.min = frames / PMM_WATERMARK_RATIO;
+    g_pmm_watermarks.low = g_pmm_watermarks.min + g_pmm_watermarks.min / 4;
+    g_pmm_watermarks.high = g_pmm_watermarks.min + g_pmm_watermarks.min / 2;
+
+    logln(
+        "pmm: watermarks: min=%zu low=%zu high=%zu frames",
+        g_pmm_watermarks.min,
+        g_pmm_watermarks.low,
+        g_pmm_watermarks.high
+    );
+
+    /*
+    ** Find the amount of cache colors, rounded down to a power of two.
+    */
+    colors = arch_cpu_cache_way_size() / PAGE_SIZE;
+    colors = colors > PMM_MAX_COLORS ? PMM_MAX_COLORS : colors;
+    g_pmm_colors = colors ? 1u << (63u - __builtin_clzll(colors)) : 1;
+
+    logln("pmm: %u cache colors", g_pmm_colors);
+
+    return OK;
+}
+
+/*
+** Allocate the descriptors of all frames (see `struct frame`).
+**
+** This must be called once `pmm_init()` is done and everything that was
+** allocated early on is marked as such, since allocating the descriptors takes
+** frames from the arenas.
+**
+** Frames allocated before this function is called are given a single reference.
+** The descriptors of the frames that are still deferred are left as they are,
+** as they are free once they are initialized.
+*/
+status_t
+pmm_frames_init(
+    void
+) {
+    struct pmm_arena *arena;
+    struct frame *frames;
+    struct frame *desc;
+    size_t nb;
+    size_t i;
+    bool state;
+
+    for (arena = g_arenas; arena < g_arenas + g_arenas_len; ++arena) {
+        nb = (arena->end - arena->start) / PAGE_SIZE;
+        if (!nb) {
+            continue;
+        }
+
+        frames = kheap_alloc(nb * sizeof(struct frame));
+        if (!frames) {
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        for (i = 0; i < (arena->deferred - arena->start) / PAGE_SIZE; ++i) {
+            frames[i] = (struct frame){ .refcount = 1 };
+        }
+
+        pmm_lock(&state);
+        arena->frames = frames;
+        pmm_unlock(&state);
+    }
+
+    /*
+    ** Mark the reserved areas again so their frames are flagged as such.
+    */
+    pmm_mark_reserved_areas();
+
+    /*
+    ** Give the boot heap a reference on each of its frames, dropped once it is
+    ** released, so those freed in the meantime aren't lost.
+    */
+    pmm_lock(&state);
+    for (i = 0; i < sizeof(g_kernel_boot_heap) / PAGE_SIZE; ++i) {
+        desc = pmm_get_frame((physaddr_t)g_kernel_boot_heap + i * PAGE_SIZE);
+        if (desc) {
+            desc->flags |= FRAME_BOOT_HEAP;
+            atomic_fetch_add(&desc->refcount, 1, ATOMIC_RELAXED);
+        }
+    }
+    pmm_unlock(&state);
+
+    return OK;
+}
+
+/*
+** Return the NUMA node `addr` belongs to according to `ranges`, or 0 if it
+** isn't covered by any range.
+**
+** `*next` is lowered to the next address where the node may change.
+*/
+static
+uint
+pmm_node_of(
+    struct pmm_node_range const *ranges,
+    size_t nb_ranges,
+    physaddr_t addr,
+    physaddr_t *next
+) {
+    uint node;
+    size_t i;
+
+    node = 0;
+    for (i = 0; i < nb_ranges; ++i) {
+        if (ranges[i].start <= addr && addr < ranges[i].end) {
+            node = ranges[i].node;
+            *next = ranges[i].end < *next ? ranges[i].end : *next;
+        } else if (addr < ranges[i].start && ranges[i].start < *next) {
+            *next = ranges[i].start;
+        }
+    }
+    return node;
+}
+
+/*
+** Find the biggest piece of `arena` starting at `start` and belonging to a
+** single NUMA node.
+**
+** The end of the piece is stored in `*end` and its node is returned.
+*/
+static
+uint
+pmm_arena_next_node_piece(
+    struct pmm_arena const *arena,
+    struct pmm_node_range const *ranges,
+    size_t nb_ranges,
+    physaddr_t start,
+    physaddr_t *end
+) {
+    physaddr_t next;
+    uint node;
+
+    *end = arena->end;
+    node = pmm_node_of(ranges, nb_ranges, start, end);
+
+    // Extend the piece for as long as the memory following it belongs to the same node.
+    while (*end < arena->end) {
+        next = arena->end;
+        if (pmm_node_of(ranges, nb_ranges, *end, &next) != node) {
+            break;
+        }
+        *end = next;
+    }
+    return node;
+}
+
+/*
+** Free all the frames of `dst` that are free in `src`.
+**
+** This function assumes `dst` is within `src` and all its frames are allocated.
+*/
+static
+void
+pmm_arena_import(
+    struct pmm_arena *dst,
+    struct pmm_arena const *src
+) {
+    uint64 word;
+    physaddr_t start;
+    physaddr_t end;
+    size_t first;
+    size_t last;
+    size_t idx;
+    size_t w;
+    uint order;
+
+    for (order = 0; order <= PMM_MAX_ORDER; ++order) {
+        first = pmm_get_frame_idx(src, dst->start) >> order;
+        last = (pmm_get_frame_idx(src, dst->end) + (1ul << order) - 1) >> order;
+
+        for (w = first / 64u; w * 64u < last; ++w) {
+            word = src->areas[order].bitmap.levels[0][w];
+            while (word) {
+                idx = w * 64u + __builtin_ctzll(word);
+                word &= word - 1;
+
+                start = src->base + ((physaddr_t)idx << order) * PAGE_SIZE;
+                end = start + (PAGE_SIZE << order);
+                start = start > dst->start ? start : dst->start;
+                end = end < dst->end ? end : dst->end;
+
+                if (start < end) {
+                    pmm_free_range_in_arena(dst, start, end);
+                }
+            }
+        }
+    }
+}
+
+/*
+** Return the distance between two NUMA nodes, as found in `distances` (or
+** using the ACPI's default values if `distances` is `NULL`).
+**
+** A node is always the closest to itself.
+*/
+static inline
+uint
+pmm_node_distance(
+    uint8 const *distances,
+    uint nb_nodes,
+    uint from,
+    uint to
+) {
+    if (from == to) {
+        return 0;
+    }
+    return distances ? distances[from * nb_nodes + to] : 20u;
+}
+
+/*
+** Make the physical memory manager NUMA-aware.
+**
+** `ranges` tells which node each range of physical memory belongs to, and
+** `distances` is a `nb_nodes * nb_nodes` matrix of the relative distance
+** between each node (`NULL` if unknown).
+**
+** Arenas spanning over multiple nodes are split so that each arena belongs to
+** a single node. Frames keep their state (free or allocated) in the process.
+**
+** This must be called after `pmm_init()` but before other CPUs are started,
+** as it is the only place where arenas are modified past `pmm_init()`.
+*/
+status_t
+pmm_numa_init(
+    struct pmm_node_range const *ranges,
+    size_t nb_ranges,
+    uint nb_nodes,
+    uint8 const *distances
+) {
+    struct pmm_arena *old_arenas;
+    struct pmm_arena *new_arenas;
+    struct pmm_arena *arena;
+    size_t old_arenas_len;
+    size_t new_arenas_len;
+    physaddr_t start;
+    physaddr_t end;
+    uint64 *bitmaps;
+    uint node;
+    uint i;
+    uint j;
+    bool state;
+
+    if (!nb_nodes || nb_nodes > KCONFIG_MAX_NUMA_NODES) {
+        return ERR_INVALID_ARGS;
+    }
+
+    if (g_arenas == &g_boot_arena) {
+        return ERR_BAD_STATE;
+    }
+
+    /*
+    ** First, we calculate how many arenas we'll need once they are split.
+    */
+    new_arenas_len = 0;
+    for (arena = g_arenas; arena < g_arenas + g_arenas_len; ++arena) {
+        for (start = arena->start; start < arena->end; start = end) {
+            pmm_arena_next_node_piece(arena, ranges, nb_ranges, start, &end);
+            ++new_arenas_len;
+        }
+    }
+
+    /*
+    ** Then we allocate and initialize them, with all their frames allocated.
+    **
+    ** This may allocate frames from the current arenas, so we can only
+    ** copy their state once everything is allocated.
+    */
+    new_arenas = kheap_alloc_zero(sizeof(struct pmm_arena) * new_arenas_len);
+    if (!new_arenas) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    j = 0;
+    for (arena = g_arenas; arena < g_arenas + g_arenas_len; ++arena) {
+        for (start = arena->start; start < arena->end; start = end) {
+            node = pmm_arena_next_node_piece(arena, ranges, nb_ranges, start, &end);
+            debug_assert(node < nb_nodes);
+
+            bitmaps = kheap_alloc(pmm_arena_bitmaps_words(start, end) * sizeof(uint64));
+            if (!bitmaps) {
+                goto err;
+            }
+
+            pmm_arena_init(new_arenas + j, start, end, bitmaps);
+            new_arenas[j].node = node;
+            new_arenas[j].deferred = arena->deferred < start ? start : (arena->deferred > end ? end : arena->deferred);
+            new_arenas[j].frames = arena->frames ? arena->frames + (start - arena->start) / PAGE_SIZE : NULL;
+
+            logln("pmm: arena 0x%p-0x%p belongs to node %u", start, end, node);
+            ++j;
+        }
+    }
+
+    /*
+    ** Copy the state of the frames and swap the old arenas with the new ones.
+    */
+    pmm_lock(&state);
+
+    j = 0;
+    for (arena = g_arenas; arena < g_arenas + g_arenas_len; ++arena) {
+        while (j < new_arenas_len && new_arenas[j].start >= arena->start && new_arenas[j].end <= arena->end) {
+            pmm_arena_import(new_arenas + j, arena);
+            ++j;
+        }
+    }
+
+    old_arenas = g_arenas;
+    old_arenas_len = g_arenas_len;
     g_arenas = new_arenas;
     g_arenas_len = new_arenas_len;
 
     /*
-    ** The allocator is now initialized but we still have to mark all reserved
-    ** areas as allocated (including the kernel itself).
+    ** Sort the nodes by increasing distance from each node.
+    **
+    ** There are only a handful of them, so an insertion sort does the job.
     */
+    for (node = 0; node < nb_nodes; ++node) {
+        for (i = 0; i < nb_nodes; ++i) {
+            g_pmm_node_fallbacks[node][i] = i;
 
-    pra = __start_pmm_reserved_area;
-    while (pra < __stop_pmm_reserved_area) {
-		pmm_mark_range_as_allocated(pra->start, pra->end - pra->start);
-        ++pra;
+            j = i;
+            while (
+                j > 0
+                && pmm_node_distance(distances, nb_nodes, node, g_pmm_node_fallbacks[node][j - 1])
+                    > pmm_node_distance(distances, nb_nodes, node, g_pmm_node_fallbacks[node][j])
+            ) {
+                g_pmm_node_fallbacks[node][j] = g_pmm_node_fallbacks[node][j - 1];
+                g_pmm_node_fallbacks[node][j - 1] = i;
+                --j;
+            }
+        }
     }
+    g_pmm_nodes_len = nb_nodes;
+
+    pmm_unlock(&state);
 
     /*
-    ** Mark the boot heap as allocated.
-    ** TODO: Improve this
+    ** Free the old arenas, but not their descriptors which are now used by the
+    ** new ones.
     */
+    for (arena = old_arenas; arena < old_arenas + old_arenas_len; ++arena) {
+        kheap_free(arena->areas[0].bitmap.levels[0]);
+    }
+    kheap_free(old_arenas);
 
-    pmm_mark_range_as_allocated(
-        (physaddr_t)g_kernel_boot_heap_start,
-        (physaddr_t)g_kernel_boot_heap_end
-    );
+    return OK;
+
+err:
+    for (arena = new_arenas; arena < new_arenas + new_arenas_len; ++arena) {
+        kheap_free(arena->areas[0].bitmap.levels[0]);
+    }
+    kheap_free(new_arenas);
+    return ERR_OUT_OF_MEMORY;
+}
+
+#if KCONFIG_BENCHMARKS
+
+/*
+** Size and fragmentation of the bitmaps used by `pmm_bench()`: 4GiB worth of
+** frames, with only one free frame every `PMM_BENCH_STRIDE` frames.
+*/
+#define PMM_BENCH_BITS          (1ul << 20)
+#define PMM_BENCH_STRIDE        4099ul
+
+/*
+** A copy of the frame search used by the PMM before its bitmaps were made
+** hierarchical, kept as a reference for `pmm_bench()`.
+**
+** It scans `bitmap` (1 for taken, 0 for free) byte by byte then bit by bit,
+** starting at the `*next` heuristic and wrapping around once.
+*/
+static
+size_t
+pmm_bench_linear_alloc(
+    uint8 *bitmap,
+    size_t size,
+    size_t *next
+) {
+    size_t i;
+    size_t j;
+    size_t final;
+    bool pass;
+
+    i = *next;
+    final = size;
+    pass = false;
+
+look_for_frame:
+    while (i < final) {
+        if (bitmap[i] != 0xFFu) {
+            j = 0u;
+            while (j < 7u && (bitmap[i] & (1 << j)) != 0) {
+                ++j;
+            }
+            bitmap[i] |= (1 << j);
+            *next = i;
+            return i * 8u + j;
+        }
+        ++i;
+    }
+    if (!pass) {
+        final = *next;
+        i = 0;
+        pass = true;
+        goto look_for_frame;
+    }
+    return SIZE_MAX;
+}
+
+/*
+** Compare the linear bitmap scan with the hierarchical bitmap when looking for
+** free frames in a heavily fragmented bitmap.
+*/
+static
+status_t
+pmm_bench(
+    void
+) {
+    struct pmm_bitmap bitmap;
+    uint64 *words;
+    uint8 *linear;
+    size_t next;
+    size_t allocs;
+    size_t i;
+    uint64 linear_cycles;
+    uint64 hierarchical_cycles;
+    uint64 start;
+
+    linear = kheap_alloc(PMM_BENCH_BITS / 8u);
+    words = kheap_alloc(pmm_bitmap_words(PMM_BENCH_BITS, NULL) * sizeof(uint64));
+    if (!linear || !words) {
+        kheap_free(linear);
+        kheap_free(words);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    memset(linear, 0xFF, PMM_BENCH_BITS / 8u);
+    pmm_bitmap_init(&bitmap, PMM_BENCH_BITS, words);
+
+    allocs = 0;
+    for (i = 0; i < PMM_BENCH_BITS; i += PMM_BENCH_STRIDE) {
+        linear[i / 8u] &= ~(1u << (i % 8u));
+        pmm_bitmap_set(&bitmap, i);
+        ++allocs;
+    }
+
+    // Take every free frame, one after the other.
+    next = 0;
+    start = rdtsc();
+    for (i = 0; i < allocs; ++i) {
+        assert(pmm_bench_linear_alloc(linear, PMM_BENCH_BITS / 8u, &next) != SIZE_MAX);
+    }
+    linear_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = 0; i < allocs; ++i) {
+        size_t idx;
 
+        idx = pmm_bitmap_find_first(&bitmap);
+        assert(idx != SIZE_MAX);
+        pmm_bitmap_clear(&bitmap, idx);
+    }
+    hierarchical_cycles = rdtsc() - start;
+
+    logln("pmm: bench: %zu frames taken from a fragmented bitmap of %zu frames", allocs, PMM_BENCH_BITS);
+    logln("pmm: bench:     linear scan:  %llu cycles/frame", linear_cycles / allocs);
+    logln("pmm: bench:     hierarchical: %llu cycles/frame", hierarchical_cycles / allocs);
+
+    kheap_free(linear);
+    kheap_free(words);
     return OK;
 }
+
+REGISTER_INIT_HOOK(pmm_bench, &pmm_bench, INIT_LEVEL_DRIVERS);
+
+/*
+** Workload of `pmm_color_bench()`: `PMM_COLOR_BENCH_ROUNDS` times, read every
+** cache line of `PMM_COLOR_BENCH_PAGES` pages, walking the pages with a stride
+** of a page so that consecutive reads land in different pages.
+**
+** There are more pages than the associativity of any last level cache, but
+** few enough for all of them to fit in that cache.
+*/
+#define PMM_COLOR_BENCH_PAGES   64u
+#define PMM_COLOR_BENCH_ROUNDS  256u
+#define PMM_COLOR_BENCH_LINE    64u
+
+static bool g_pmm_color_bench_over;
+
+/*
+** Map `PMM_COLOR_BENCH_PAGES` frames, either all of the same color or each of a
+** different one, run the strided workload on them and return how many cycles
+** it took on average for each read.
+*/
+static
+uint64
+pmm_color_bench_run(
+    bool spread
+) {
+    uchar volatile *pages;
+    physaddr_t frame;
+    uint64 start;
+    uint64 cycles;
+    size_t offset;
+    uint round;
+    uint i;
+
+    pages = vmalloc(PMM_COLOR_BENCH_PAGES * PAGE_SIZE);
+    assert(pages);
+
+    // Replace the frames `vmalloc()` picked with frames of the wanted colors.
+    for (i = 0; i < PMM_COLOR_BENCH_PAGES; ++i) {
+        frame = pmm_alloc_frame_color(spread ? i : 0);
+        assert(frame != PHYS_NULL);
+        assert_ok(vmm_remap((uchar *)pages + i * PAGE_SIZE, frame, PAGE_SIZE, MMAP_RDWR, MUNMAP_FREE));
+    }
+
+    cycles = 0;
+
+    // The first round only warms the caches up.
+    for (round = 0; round <= PMM_COLOR_BENCH_ROUNDS; ++round) {
+        start = rdtsc();
+        for (offset = 0; offset < PAGE_SIZE; offset += PMM_COLOR_BENCH_LINE) {
+            for (i = 0; i < PMM_COLOR_BENCH_PAGES; ++i) {
+                (void)pages[i * PAGE_SIZE + offset];
+            }
+        }
+        cycles += round ? rdtsc() - start : 0;
+    }
+
+    vfree((virtaddr_t)pages);
+
+    return cycles / ((uint64)PMM_COLOR_BENCH_ROUNDS * PMM_COLOR_BENCH_PAGES * (PAGE_SIZE / PMM_COLOR_BENCH_LINE));
+}
+
+/*
+** The thread of `pmm_color_bench()`.
+*/
+int
+pmm_color_bench_thread(
+    void
+) {
+    uint64 same;
+    uint64 spread;
+
+    if (g_pmm_colors < PMM_COLOR_BENCH_PAGES) {
+        logln("pmm: bench: only %u cache colors, skipping the page coloring benchmark", g_pmm_colors);
+    } else {
+        same = pmm_color_bench_run(false);
+        spread = pmm_color_bench_run(true);
+
+        logln("pmm: bench: strided reads over %u pages", PMM_COLOR_BENCH_PAGES);
+        logln("pmm: bench:     same color:    %llu cycles/read", same);
+        logln("pmm: bench:     spread colors: %llu cycles/read", spread);
+    }
+
+    while (42) {
+        sleep(&g_pmm_color_bench_over);
+    }
+}
+
+/*
+** Show the conflict misses caused by frames of the same cache color.
+**
+** Caches aren't emulated by QEMU's TCG, so run it on real hardware or with KVM
+** (eg. `make kvm`) to see a difference.
+*/
+static
+status_t
+pmm_color_bench(
+    void
+) {
+    struct thread *thread;
+
+    return thread_new(&pmm_color_bench_thread, &thread);
+}
+
+REGISTER_INIT_HOOK(pmm_color_bench, &pmm_color_bench, INIT_LEVEL_DRIVERS);
+
+#endif /* KCONFIG_BENCHMARKS */
@@ -0,0 +1,174 @@
+/******************************************************************************\
+**
+**  This file is part of the Poseidon Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2018-2024 - The Poseidon Authors
+**
+\******************************************************************************/
+
+/*
+** Region allocator.
+**
+** Batches of work that make many small allocations which all die together
+** (like parsing a firmware table) can allocate them from a region instead of
+** the kernel's heap: an allocation is a pointer bump within a chunk, and
+** releasing the region frees its chunks, not each allocation.
+**
+** Chunks are aligned to `REGION_ALIGN` bytes, and so is the size of each
+** allocation, which keeps every allocation aligned too.
+**
+** The fast path lives in `poseidon/memory/region.h`.
+*/
+
+#include "poseidon/memory/region.h"
+
+#if KCONFIG_BENCHMARKS
+#include "poseidon/boot/init_hook.h"
+#include "lib/log.h"
+#include "lib/string.h"
+#endif /* KCONFIG_BENCHMARKS */
+
+/* Offset of the first allocation within a chunk. */
+#define REGION_CHUNK_HEADER     ALIGN(sizeof(struct region_chunk), REGION_ALIGN)
+
+/*
+** Allocate `size` bytes within the given region when the chunk being filled
+** doesn't have enough room left.
+**
+** `size` must be aligned to `REGION_ALIGN`.
+*/
+virtaddr_t
+region_alloc_slow(
+    struct region *region,
+    size_t size
+) {
+    struct region_chunk *chunk;
+
+    // Big allocations get a chunk of their own, so the chunk being filled isn't wasted.
+    if (REGION_CHUNK_HEADER + size > REGION_CHUNK_SIZE) {
+        chunk = kheap_alloc_aligned(REGION_CHUNK_HEADER + size, REGION_ALIGN);
+        if (!chunk) {
+            return NULL;
+        }
+
+        if (region->chunks) {
+            chunk->next = region->chunks->next;
+            region->chunks->next = chunk;
+        } else {
+            chunk->next = NULL;
+            region->chunks = chunk;
+        }
+        return (uchar *)chunk + REGION_CHUNK_HEADER;
+    }
+
+    chunk = kheap_alloc_aligned(REGION_CHUNK_SIZE, REGION_ALIGN);
+    if (!chunk) {
+        return NULL;
+    }
+
+    chunk->next = region->chunks;
+    region->chunks = chunk;
+    region->cur = (uchar *)chunk + REGION_CHUNK_HEADER + size;
+    region->end = (uchar *)chunk + REGION_CHUNK_SIZE;
+    return (uchar *)chunk + REGION_CHUNK_HEADER;
+}
+
+/*
+** Free all the memory allocated within the given region.
+**
+** The region is left empty, and can be used again.
+*/
+void
+region_release(
+    struct region *region
+) {
+    struct region_chunk *chunk;
+    struct region_chunk *next;
+
+    chunk = region->chunks;
+    while (chunk) {
+        next = chunk->next;
+        kheap_free(chunk);
+        chunk = next;
+    }
+    *region = REGION_DEFAULT;
+}
+
+#if KCONFIG_BENCHMARKS
+
+/*
+** Sizes of the allocations made by `region_self_check()`: small ones, one that
+** still fits in a chunk, and one that doesn't.
+*/
+#define REGION_CHECK_SMALL_NB   64u
+#define REGION_CHECK_MEDIUM     (REGION_CHUNK_SIZE / 2u)
+#define REGION_CHECK_BIG        (2u * REGION_CHUNK_SIZE)
+
+/*
+** Check that the allocations made within a region are aligned, don't overlap
+** and that allocations that don't fit in a chunk don't waste the chunk being
+** filled, then release the region.
+*/
+static
+status_t
+region_self_check(
+    void
+) {
+    struct region region;
+    uchar *small[REGION_CHECK_SMALL_NB];
+    uchar *medium;
+    uchar *big;
+    uchar *next;
+    size_t i;
+    size_t j;
+
+    region = REGION_DEFAULT;
+
+    for (i = 0; i < REGION_CHECK_SMALL_NB; ++i) {
+        small[i] = region_alloc(&region, i);
+        assert(small[i]);
+        assert(!((uintptr)small[i] & (REGION_ALIGN - 1)));
+        memset(small[i], (int)i, i);
+    }
+
+    medium = region_alloc(&region, REGION_CHECK_MEDIUM);
+    assert(medium);
+    assert(!((uintptr)medium & (REGION_ALIGN - 1)));
+    memset(medium, 0xA5, REGION_CHECK_MEDIUM);
+
+    // The big allocation gets a chunk of its own, and the next small one goes right after the medium one.
+    big = region_alloc(&region, REGION_CHECK_BIG);
+    assert(big);
+    assert(!((uintptr)big & (REGION_ALIGN - 1)));
+    memset(big, 0x5A, REGION_CHECK_BIG);
+
+    next = region_alloc(&region, 1);
+    assert(next == medium + REGION_CHECK_MEDIUM);
+
+    for (i = 0; i < REGION_CHECK_SMALL_NB; ++i) {
+        for (j = 0; j < i; ++j) {
+            assert(small[i][j] == (uchar)i);
+        }
+    }
+    for (j = 0; j < REGION_CHECK_MEDIUM; ++j) {
+        assert(medium[j] == 0xA5);
+    }
+    for (j = 0; j < REGION_CHECK_BIG; ++j) {
+        assert(big[j] == 0x5A);
+    }
+
+    region_release(&region);
+    assert(!region.chunks && region.cur == region.end);
+
+    // A released region can be used again.
+    assert(region_alloc(&region, 1));
+    region_release(&region);
+
+    logln("region: self-check passed");
+    return OK;
+}
+
+REGISTER_INIT_HOOK(region_self_check, &region_self_check, INIT_LEVEL_DRIVERS);
+
+#endif /* KCONFIG_BENCHMARKS */
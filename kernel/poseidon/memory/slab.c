@@ -0,0 +1,242 @@
+/******************************************************************************\
+**
+**  This file is part of the Poseidon Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2018-2024 - The Poseidon Authors
+**
+\******************************************************************************/
+
+/*
+** The slab allocator.
+**
+** It allocates objects of a fixed size, grouped by type in caches
+** (see `struct kmem_cache`), which saves both the per-allocation header and
+** the block walk of the kernel's heap.
+**
+** Each cache carves its objects out of slabs, single pages taken from the
+** kernel's heap. Slabs with free objects are roughly sorted so the fullest
+** ones are used first, which packs objects in as few pages as possible.
+**
+** Like the physical memory manager, each cache has a small cache of free
+** objects local to each CPU, so most allocations and frees are a single
+** pointer push or pop, without any lock.
+*/
+
+#include "poseidon/cpu/cpu.h"
+#include "poseidon/interrupt.h"
+#include "poseidon/memory/memory.h"
+#include "poseidon/memory/slab.h"
+#include "lib/sync/spinlock.h"
+#include "lib/list.h"
+#include "lib/string.h"
+
+/*
+** Compute the layout of the slabs of the given cache: how many objects each
+** slab holds, and where the first one is.
+*/
+static
+void
+kmem_cache_layout(
+    struct kmem_cache *cache
+) {
+    size_t size;
+    size_t nb;
+
+    size = ALIGN(cache->size, cache->align);
+    nb = (PAGE_SIZE - sizeof(struct kmem_slab)) / (size + sizeof(uint16));
+    while (ALIGN(sizeof(struct kmem_slab) + nb * sizeof(uint16), cache->align) + nb * size > PAGE_SIZE) {
+        --nb;
+    }
+
+    cache->size = size;
+    cache->objs_per_slab = nb;
+    cache->objs_offset = ALIGN(sizeof(struct kmem_slab) + nb * sizeof(uint16), cache->align);
+}
+
+/*
+** Create a new slab, calling the cache's constructor on each of its objects,
+** and add it to the cache's partial slabs.
+**
+** The cache must be locked.
+*/
+static
+struct kmem_slab *
+kmem_cache_grow(
+    struct kmem_cache *cache
+) {
+    struct kmem_slab *slab;
+    size_t i;
+
+    if (!cache->objs_per_slab) {
+        debug_assert(cache->size <= KMEM_CACHE_MAX_SIZE);
+        kmem_cache_layout(cache);
+    }
+
+    slab = kheap_alloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    if (!slab) {
+        return NULL;
+    }
+
+    slab->cache = cache;
+    slab->nb_free = cache->objs_per_slab;
+
+    // Free objects are popped from the end, so hand out the first ones first.
+    for (i = 0; i < cache->objs_per_slab; ++i) {
+        slab->free[i] = cache->objs_per_slab - i - 1;
+        if (cache->ctor) {
+            cache->ctor((uchar *)slab + cache->objs_offset + i * cache->size);
+        }
+    }
+
+    list_add_tail(&cache->partial_slabs, &slab->slabs);
+    cache->nb_empty_slabs += 1;
+    return slab;
+}
+
+/*
+** Refill the given per-CPU cache with up to `KMEM_CPU_CACHE_BATCH` objects,
+** taken from the fullest slabs first.
+**
+** Interrupts must be disabled.
+*/
+static
+void
+kmem_cpu_cache_refill(
+    struct kmem_cache *cache,
+    struct kmem_cpu_cache *cpu_cache
+) {
+    struct kmem_slab *slab;
+
+    spinlock_acquire(&cache->lock);
+    while (cpu_cache->len < KMEM_CPU_CACHE_BATCH) {
+        slab = list_first_entry_or_null(&cache->partial_slabs, struct kmem_slab, slabs);
+        if (!slab) {
+            slab = kmem_cache_grow(cache);
+            if (!slab) {
+                break;
+            }
+        }
+
+        if (slab->nb_free == cache->objs_per_slab) {
+            cache->nb_empty_slabs -= 1;
+        }
+
+        slab->nb_free -= 1;
+        cpu_cache->objs[cpu_cache->len++] = (uchar *)slab + cache->objs_offset + slab->free[slab->nb_free] * cache->size;
+
+        if (!slab->nb_free) {
+            list_move_tail(&cache->full_slabs, &slab->slabs);
+        }
+    }
+    spinlock_release(&cache->lock);
+}
+
+/*
+** Give the `KMEM_CPU_CACHE_BATCH` oldest objects of the given per-CPU cache back
+** to their slab.
+**
+** Slabs that end up without any allocated object are given back to the
+** kernel's heap, except one which is kept around to absorb the next allocations.
+**
+** Interrupts must be disabled.
+*/
+static
+void
+kmem_cpu_cache_drain(
+    struct kmem_cache *cache,
+    struct kmem_cpu_cache *cpu_cache
+) {
+    struct kmem_slab *slab;
+    uchar *obj;
+    size_t i;
+
+    debug_assert(cpu_cache->len >= KMEM_CPU_CACHE_BATCH);
+
+    spinlock_acquire(&cache->lock);
+    for (i = 0; i < KMEM_CPU_CACHE_BATCH; ++i) {
+        obj = cpu_cache->objs[i];
+        slab = (struct kmem_slab *)ROUND_DOWN(obj, PAGE_SIZE);
+
+        debug_assert(slab->cache == cache);
+
+        slab->free[slab->nb_free++] = (obj - (uchar *)slab - cache->objs_offset) / cache->size;
+
+        if (slab->nb_free == 1) {
+            // The slab was full. It is now the fullest of the partial ones.
+            list_remove(&slab->slabs);
+            list_add_head(&cache->partial_slabs, &slab->slabs);
+        } else if (slab->nb_free == cache->objs_per_slab) {
+            list_remove(&slab->slabs);
+            if (cache->nb_empty_slabs) {
+                kheap_free(slab);
+            } else {
+                list_add_tail(&cache->partial_slabs, &slab->slabs);
+                cache->nb_empty_slabs += 1;
+            }
+        }
+    }
+    spinlock_release(&cache->lock);
+
+    cpu_cache->len -= KMEM_CPU_CACHE_BATCH;
+    memmove(cpu_cache->objs, cpu_cache->objs + KMEM_CPU_CACHE_BATCH, cpu_cache->len * sizeof(cpu_cache->objs[0]));
+}
+
+/*
+** Allocate an object from the given cache and return it, or `NULL` if there is
+** no memory left.
+**
+** The object is in the state the cache's constructor left it in, or in the
+** state it was freed in.
+*/
+virtaddr_t
+kmem_cache_alloc(
+    struct kmem_cache *cache
+) {
+    struct kmem_cpu_cache *cpu_cache;
+    virtaddr_t obj;
+    bool state;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    cpu_cache = &cache->cpu_caches[current_cpu()->cpu_id];
+    if (!cpu_cache->len) {
+        kmem_cpu_cache_refill(cache, cpu_cache);
+    }
+    obj = cpu_cache->len ? cpu_cache->objs[--cpu_cache->len] : NULL;
+
+    pop_interrupts_state(&state);
+
+    return obj;
+}
+
+/*
+** Give an object back to the cache it was allocated from.
+**
+** If the cache has a constructor, the object must be in the state the
+** constructor leaves it in.
+*/
+void
+kmem_cache_free(
+    struct kmem_cache *cache,
+    virtaddr_t obj
+) {
+    struct kmem_cpu_cache *cpu_cache;
+    bool state;
+
+    if (!obj) {
+        return ;
+    }
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    cpu_cache = &cache->cpu_caches[current_cpu()->cpu_id];
+    if (cpu_cache->len == KMEM_CPU_CACHE_SIZE) {
+        kmem_cpu_cache_drain(cache, cpu_cache);
+    }
+    cpu_cache->objs[cpu_cache->len++] = obj;
+
+    pop_interrupts_state(&state);
+}
@@ -0,0 +1,310 @@
+/******************************************************************************\
+**
+**  This file is part of the Poseidon Kernel, and is made available under
+**  the terms of the GNU General Public License version 2.
+**
+**  Copyright (C) 2018-2024 - The Poseidon Authors
+**
+\******************************************************************************/
+
+/*
+** The allocator of large kernel memory.
+**
+** Allocations of a few pages or more are kept out of the kernel's heap (see
+** `KHEAP_VMALLOC_THRESHOLD`): each one gets its own range of virtual addresses
+** within `ARCH_VMALLOC_START` and `ARCH_VMALLOC_END`, backed by frames allocated
+** independently of each other. This keeps them from fragmenting the heap, and
+** their frames are given back to the PMM as soon as they are freed.
+**
+** An unmapped guard page sits in front of each allocation, so overflowing one
+** (like a thread's stack) faults instead of corrupting its neighbour.
+**
+** The areas are kept in a list sorted by address, and a new one is placed in
+** the first gap big enough. Areas of a large page or more are aligned on it, so
+** `vmm_map()` can map them with large pages.
+**
+** They are also kept in a hash table indexed by their address, so finding the
+** area of a pointer being freed doesn't walk the list.
+*/
+
+#include "poseidon/memory/vmalloc.h"
+#include "poseidon/memory/vmm.h"
+#include "poseidon/interrupt.h"
+#include "lib/sync/spinlock.h"
+#include "lib/list.h"
+
+/*
+** Lock protecting `g_vmalloc_areas` and `g_vmalloc_hash`.
+**
+** The mappings themselves are made without it, the range of each area being
+** reserved first. The paging structures they go through are protected by the
+** VMM's own lock.
+*/
+static struct spinlock g_vmalloc_lock = SPINLOCK_DEFAULT;
+
+/* All areas, sorted by address. */
+static struct linked_list g_vmalloc_areas = LIST_HEAD_INIT(g_vmalloc_areas);
+
+/* All areas, hashed by address. */
+static struct vmalloc_area *g_vmalloc_hash[VMALLOC_HASH_SIZE];
+
+/*
+** Return the bucket of the hash table holding the area starting at `start`.
+*/
+static inline
+struct vmalloc_area **
+vmalloc_bucket(
+    virtaddr_const_t start
+) {
+    return &g_vmalloc_hash[((uintptr)start / PAGE_SIZE) % VMALLOC_HASH_SIZE];
+}
+
+/*
+** Reserve a range of `size` bytes of virtual addresses, followed by a guard page,
+** and return the area describing it, or `NULL` if there is no room left.
+**
+** `size` must be page-aligned.
+*/
+static
+struct vmalloc_area *
+vmalloc_reserve(
+    size_t size
+) {
+    struct vmalloc_area *area;
+    struct vmalloc_area *next;
+    struct vmalloc_area **bucket;
+    struct linked_list *cursor;
+    uchar *start;
+    size_t align;
+    bool state;
+
+    area = kheap_alloc(sizeof(*area));
+    if (!area) {
+        return NULL;
+    }
+
+    // Big areas are aligned so they can be mapped with large pages.
+    align = size >= ARCH_VMM_LARGE_PAGE_SIZE ? ARCH_VMM_LARGE_PAGE_SIZE : PAGE_SIZE;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+    spinlock_acquire(&g_vmalloc_lock);
+
+    // Find the first gap that fits the area and its guard page.
+    start = ALIGN((uchar *)ARCH_VMALLOC_START + PAGE_SIZE, align);
+    list_for_each(cursor, &g_vmalloc_areas) {
+        next = list_entry(cursor, struct vmalloc_area, areas);
+        if (start + size <= (uchar *)next->start - PAGE_SIZE) {
+            break;
+        }
+        start = ALIGN((uchar *)next->start + next->size + PAGE_SIZE, align);
+    }
+
+    // Keep a guard page at the end of the range too.
+    if (start + size > (uchar *)ARCH_VMALLOC_END - PAGE_SIZE) {
+        spinlock_release(&g_vmalloc_lock);
+        pop_interrupts_state(&state);
+        kheap_free(area);
+        return NULL;
+    }
+
+    area->start = start;
+    area->size = size;
+    area->device = false;
+
+    // Insert the area before the one following the gap, keeping the list sorted.
+    list_add_tail(cursor, &area->areas);
+
+    bucket = vmalloc_bucket(start);
+    area->hash_next = *bucket;
+    *bucket = area;
+
+    spinlock_release(&g_vmalloc_lock);
+    pop_interrupts_state(&state);
+
+    return area;
+}
+
+/*
+** Give the range of virtual addresses of the given area back, and free the area.
+**
+** The area must not be mapped anymore.
+*/
+static
+void
+vmalloc_release(
+    struct vmalloc_area *area
+) {
+    struct vmalloc_area **bucket;
+    bool state;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+    spinlock_acquire(&g_vmalloc_lock);
+
+    list_remove(&area->areas);
+
+    bucket = vmalloc_bucket(area->start);
+    while (*bucket != area) {
+        bucket = &(*bucket)->hash_next;
+    }
+    *bucket = area->hash_next;
+
+    spinlock_release(&g_vmalloc_lock);
+    pop_interrupts_state(&state);
+
+    kheap_free(area);
+}
+
+/*
+** Find the area starting at the given address, through the hash table.
+**
+** The area must exist.
+*/
+static
+struct vmalloc_area *
+vmalloc_find(
+    virtaddr_const_t ptr
+) {
+    struct vmalloc_area *area;
+    bool state;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+    spinlock_acquire(&g_vmalloc_lock);
+
+    area = *vmalloc_bucket(ptr);
+    while (area && area->start != ptr) {
+        area = area->hash_next;
+    }
+
+    spinlock_release(&g_vmalloc_lock);
+    pop_interrupts_state(&state);
+
+    assert(area);
+    return area;
+}
+
+/*
+** Allocate and map an area of at least `size` bytes with the given flags.
+*/
+static
+virtaddr_t
+vmalloc_map(
+    size_t size,
+    mmap_flags_t flags
+) {
+    struct vmalloc_area *area;
+
+    size = ALIGN(size, PAGE_SIZE);
+    if (!size) {
+        return NULL;
+    }
+
+    area = vmalloc_reserve(size);
+    if (!area) {
+        return NULL;
+    }
+
+    if (vmm_map(area->start, size, flags) != OK) {
+        vmalloc_release(area);
+        return NULL;
+    }
+    return area->start;
+}
+
+/*
+** Allocate at least `size` bytes of page-aligned, virtually contiguous kernel
+** memory, and return a pointer to it, or `NULL` if there is no memory left.
+*/
+virtaddr_t
+vmalloc(
+    size_t size
+) {
+    return vmalloc_map(size, MMAP_RDWR);
+}
+
+/*
+** `vmalloc()`, but the memory is filled with zeroes.
+*/
+virtaddr_t
+vmalloc_zero(
+    size_t size
+) {
+    return vmalloc_map(size, MMAP_RDWR | MMAP_ZERO);
+}
+
+/*
+** `vmalloc()`, but the pages are given consecutive cache colors, starting
+** where the previous such allocation stopped.
+**
+** This keeps the same offset within different areas (like the top of the
+** stacks of all threads) from always landing on the same cache sets.
+*/
+virtaddr_t
+vmalloc_color(
+    size_t size
+) {
+    return vmalloc_map(size, MMAP_RDWR | MMAP_COLOR);
+}
+
+/*
+** Map `size` bytes of physical memory, starting at `pa`, to a new area.
+**
+** The frames aren't freed when the area is.
+**
+** `pa` and `size` must be page-aligned.
+*/
+virtaddr_t
+vmalloc_device(
+    physaddr_t pa,
+    size_t size
+) {
+    struct vmalloc_area *area;
+
+    debug_assert(IS_PAGE_ALIGNED(pa));
+    debug_assert(IS_PAGE_ALIGNED(size));
+
+    area = vmalloc_reserve(size);
+    if (!area) {
+        return NULL;
+    }
+
+    area->device = true;
+    if (vmm_map_device(area->start, pa, size, MMAP_RDWR) != OK) {
+        vmm_unmap(area->start, size, MUNMAP_NO_FREE);
+        vmalloc_release(area);
+        return NULL;
+    }
+    return area->start;
+}
+
+/*
+** Return the size of the area starting at the given address, which must have
+** been returned by one of the `vmalloc()` functions.
+*/
+size_t
+vmalloc_size(
+    virtaddr_const_t ptr
+) {
+    return vmalloc_find(ptr)->size;
+}
+
+/*
+** Unmap an area allocated by one of the `vmalloc()` functions, giving its frames
+** back to the PMM right away.
+*/
+void
+vfree(
+    virtaddr_t ptr
+) {
+    struct vmalloc_area *area;
+
+    if (!ptr) {
+        return ;
+    }
+
+    area = vmalloc_find(ptr);
+    vmm_unmap(area->start, area->size, area->device ? MUNMAP_NO_FREE : MUNMAP_FREE);
+    vmalloc_release(area);
+}
@@ -15,12 +15,64 @@
 #include "poseidon/memory/memory.h"
 #include "poseidon/memory/vmm.h"
 #include "poseidon/memory/pmm.h"
+#include "poseidon/memory/slab.h"
+#include "lib/string.h"
+
+#if KCONFIG_BENCHMARKS
+#include "poseidon/scheduler/scheduler.h"
+#include "poseidon/thread/thread.h"
+#include "poseidon/interrupt.h"
+#include "arch/target/rdtsc.h"
+#include "lib/log.h"
+#endif /* KCONFIG_BENCHMARKS */
+
+struct vaspace g_kernel_vaspace;
+
+static struct kmem_cache g_vaspace_cache = KMEM_CACHE_DEFAULT(g_vaspace_cache, struct vaspace, NULL);
+
+/*
+** Test whether none of the `size` bytes starting at `va` are mapped.
+*/
+static
+bool
+vmm_is_unmapped(
+    virtaddr_const_t va,
+    size_t size
+) {
+    size_t run;
+    bool mapped;
+    bool user;
+
+    while (size) {
+        run = vmm_probe(va, size, &mapped, &user);
+        if (mapped) {
+            return false;
+        }
+        va = (uchar const *)va + run;
+        size -= run;
+    }
+    return true;
+}
 
 /*
 ** Map a range of contiguous virtual pages to free, random, physical frames.
 **
+** The frames are allocated in blocks as big as possible, both to limit the
+** amount of calls to the physical memory manager and to keep the mapping
+** physically contiguous when possible. Parts of a block aligned on a large page
+** (see `vmm_map_frames()`) are mapped with that large page.
+**
+** If `MMAP_ZERO` is set, the frames are taken one by one from the pool of
+** zeroed frames instead.
+**
+** Otherwise, if `MMAP_COLOR` is set, the frames are allocated one by one with
+** consecutive cache colors (see `pmm_reserve_colors()`), so the mapping is
+** spread evenly over the sets of the cache whatever the state of the PMM.
+**
 ** In case of error, no memory is retained allocated.
 **
+** The whole operation ends with a single TLB flush (see `struct tlb_gather`).
+**
 ** Both `va` and `size` must be page-aligned.
 */
 status_t
@@ -29,8 +81,14 @@ vmm_map(
     size_t size,
     mmap_flags_t flags
 ) {
+    struct tlb_gather tlb = TLB_GATHER_INIT;
     uchar *origin;
     physaddr_t pa;
+    physaddr_t pa_end;
+    size_t mapped;
+    size_t pages;
+    uint order;
+    uint color;
     status_t s;
 
     if (
@@ -43,37 +101,68 @@ vmm_map(
     // Quick-check round-up to limit failures later
     // TODO Pre-allocate memory
 
-    origin = va;
-    while ((uchar *)va < origin + size) {
-        if (vmm_is_mapped(va)) {
-            return ERR_ALREADY_MAPPED;
-        }
-        va = (uchar *)va + PAGE_SIZE;
+    if (!vmm_is_unmapped(va, size)) {
+        return ERR_ALREADY_MAPPED;
     }
 
-    va = origin;
+    origin = va;
+    order = PMM_MAX_ORDER;
+    color = (flags & MMAP_COLOR) ? pmm_reserve_colors(size / PAGE_SIZE) : 0;
 
     // The mapping can now be performed
     while ((uchar *)va < origin + size) {
-        pa = pmm_alloc_frame();
+
+        if (flags & MMAP_ZERO) {
+            // Zeroed frames come one by one from the pool of zeroed frames.
+            order = 0;
+            pa = pmm_alloc_frame_zeroed();
+        } else if (flags & MMAP_COLOR) {
+            order = 0;
+            pa = pmm_alloc_frame_color(color++);
+        } else {
+            // Find the biggest block that fits in the remaining pages.
+            pages = (origin + size - (uchar *)va) / PAGE_SIZE;
+            while ((1ul << order) > pages) {
+                --order;
+            }
+
+            pa = pmm_alloc_frames(order);
+            while (pa == PHYS_NULL && order > 0) {
+                --order;
+                pa = pmm_alloc_frames(order);
+            }
+        }
+
         if (pa == PHYS_NULL) {
             s = ERR_OUT_OF_MEMORY;
             goto err;
         }
 
-        s = vmm_map_frame(va, pa, flags);
-        if (s != OK) {
-            // We checked for that earlier, it shouldn't happen
-            debug_assert(s != ERR_ALREADY_MAPPED);
-            goto err;
+        pa_end = pa + (PAGE_SIZE << order);
+        while (pa < pa_end) {
+            s = vmm_map_frames(va, pa, pa_end - pa, flags, &mapped, &tlb);
+            if (s != OK) {
+                // We checked for that earlier, it shouldn't happen
+                debug_assert(s != ERR_ALREADY_MAPPED);
+
+                // Free the part of the block that isn't mapped yet
+                while (pa < pa_end) {
+                    pmm_free_frame(pa);
+                    pa += PAGE_SIZE;
+                }
+                goto err;
+            }
+            va = (uchar *)va + mapped;
+            pa += mapped;
         }
-        va = (uchar *)va + PAGE_SIZE;
     }
 
+    tlb_gather_flush(&tlb);
     return OK;
 
 err:
     // In case of error, unmap what has been done
+    tlb_gather_flush(&tlb);
     vmm_unmap(origin, (uchar *)va - origin, MUNMAP_FREE);
     return s;
 }
@@ -84,6 +173,9 @@ err:
 ** This function doesn't mark the given physical range as allocated nor increases
 ** any reference counter.
 **
+** Large pages are used wherever the alignment of both ranges allows it, which
+** keeps big device windows cheap both in page tables and in TLB entries.
+**
 ** In case of error, no memory is retained allocated.
 **
 ** Both `va` and `size` must be page-aligned.
@@ -95,7 +187,9 @@ vmm_map_device(
     size_t size,
     mmap_flags_t flags
 ) {
+    struct tlb_gather tlb = TLB_GATHER_INIT;
     uchar *origin;
+    size_t mapped;
     status_t s;
 
     if (
@@ -108,29 +202,28 @@ vmm_map_device(
 
     // Quick-check round-up to limit failures later
 
-    origin = va;
-    while ((uchar *)va < origin + size) {
-        if (vmm_is_mapped(va)) {
-            return ERR_ALREADY_MAPPED;
-        }
-        va = (uchar *)va + PAGE_SIZE;
+    if (!vmm_is_unmapped(va, size)) {
+        return ERR_ALREADY_MAPPED;
     }
 
-    va = origin;
+    origin = va;
+
+    s = OK;
 
     // The mapping can now be performed
     while ((uchar *)va < origin + size) {
-        s = vmm_map_frame(va, pa, flags);
+        s = vmm_map_frames(va, pa, origin + size - (uchar *)va, flags, &mapped, &tlb);
         if (s != OK) {
             // We checked for that earlier, it shouldn't happen
             debug_assert(s != ERR_ALREADY_MAPPED);
-            return s;
+            break;
         }
-        va = (uchar *)va + PAGE_SIZE;
-        pa += PAGE_SIZE;
+        va = (uchar *)va + mapped;
+        pa += mapped;
     }
 
-    return OK;
+    tlb_gather_flush(&tlb);
+    return s;
 }
 
 /*
@@ -157,27 +250,165 @@ vmm_remap(
 ** Non-mapped pages are ignored.
 ** No operation are performed if `size` is 0.
 **
+** Large pages entirely within the range are torn down at once, while those only
+** partially within it are split first.
+**
+** The whole range is invalidated with a single TLB flush, after which the
+** frames are freed (see `struct tlb_gather`).
+**
+** Return the amount of bytes that were mapped.
+**
 ** This function assumes `va` and `size` are page-aligned and will panic
 ** otherwise.
 */
-void
+size_t
 vmm_unmap(
     virtaddr_t va,
     size_t size,
     munmap_flags_t flags
 ) {
+    struct tlb_gather tlb = TLB_GATHER_INIT;
     virtaddr_t origin;
+    size_t unmapped;
 
     debug_assert(IS_PAGE_ALIGNED(va));
     debug_assert(IS_PAGE_ALIGNED(size));
 
+    unmapped = 0;
     origin = va;
     while ((uchar *)va < (uchar *)origin + size) {
-        vmm_unmap_frame(va, flags);
-        va = (uchar *)va + PAGE_SIZE;
+        va = (uchar *)va + vmm_unmap_frames(va, (uchar *)origin + size - (uchar *)va, flags, &tlb, &unmapped);
+    }
+
+    tlb_gather_flush(&tlb);
+    return unmapped;
+}
+
+/*
+** Add the `size` bytes starting at `va` to the range of addresses `tlb` has to
+** invalidate.
+**
+** The range is the smallest one covering all the addresses added so far, as it
+** is cheaper to invalidate a few extra pages than to send several shootdowns.
+*/
+void
+tlb_gather_add(
+    struct tlb_gather *tlb,
+    virtaddr_const_t va,
+    size_t size
+) {
+    if ((uintptr)va < tlb->start) {
+        tlb->start = (uintptr)va;
+    }
+    if ((uintptr)va + size > tlb->end) {
+        tlb->end = (uintptr)va + size;
     }
 }
 
+/*
+** Give the frames of a page of `size` bytes starting at `pa` back to the PMM
+** once `tlb` is flushed.
+**
+** A page physically following the last one added, and of the same size, joins
+** its run. Otherwise, if `tlb` can't hold any more runs, it is flushed first.
+*/
+void
+tlb_gather_free(
+    struct tlb_gather *tlb,
+    physaddr_t pa,
+    size_t size
+) {
+    if (tlb->nb_pages) {
+        if (
+            tlb->pages[tlb->nb_pages - 1].page == size
+            && tlb->pages[tlb->nb_pages - 1].pa + tlb->pages[tlb->nb_pages - 1].size == pa
+        ) {
+            tlb->pages[tlb->nb_pages - 1].size += size;
+            return ;
+        }
+    }
+
+    if (tlb->nb_pages == TLB_GATHER_SIZE) {
+        tlb_gather_flush(tlb);
+    }
+
+    tlb->pages[tlb->nb_pages].pa = pa;
+    tlb->pages[tlb->nb_pages].size = size;
+    tlb->pages[tlb->nb_pages].page = size;
+    ++tlb->nb_pages;
+}
+
+/*
+** Test whether the frames of a page of `size` bytes starting at `pa` can be
+** added to `tlb` without flushing it first (see `tlb_gather_free()`).
+*/
+bool
+tlb_gather_can_free(
+    struct tlb_gather const *tlb,
+    physaddr_t pa,
+    size_t size
+) {
+    return (
+        tlb->nb_pages < TLB_GATHER_SIZE
+        || (
+            tlb->pages[tlb->nb_pages - 1].page == size
+            && tlb->pages[tlb->nb_pages - 1].pa + tlb->pages[tlb->nb_pages - 1].size == pa
+        )
+    );
+}
+
+/*
+** Give the frame of a paging structure, unlinked from the paging structures,
+** back to the PMM once `tlb` is flushed.
+**
+** The flush then also targets idle CPUs (see `arch_tlb_flush()`).
+*/
+void
+tlb_gather_free_table(
+    struct tlb_gather *tlb,
+    physaddr_t pa
+) {
+    tlb_gather_free(tlb, pa, PAGE_SIZE);
+    tlb->freed_tables = true;
+}
+
+/*
+** Invalidate the range of addresses gathered in `tlb` on all CPUs, with a single
+** shootdown, and then free the frames it holds.
+**
+** `tlb` is left empty and can be reused.
+*/
+void
+tlb_gather_flush(
+    struct tlb_gather *tlb
+) {
+    physaddr_t pa;
+    physaddr_t end;
+    size_t i;
+    uint order;
+
+    if (tlb->start < tlb->end) {
+        arch_tlb_flush((virtaddr_t)tlb->start, (virtaddr_t)tlb->end, tlb->freed_tables);
+    }
+
+    // Free the frames in blocks as big as the pages they were mapped with.
+    for (i = 0; i < tlb->nb_pages; ++i) {
+        pa = tlb->pages[i].pa;
+        end = pa + tlb->pages[i].size;
+        order = __builtin_ctzll(tlb->pages[i].page / PAGE_SIZE);
+        order = order > PMM_MAX_ORDER ? PMM_MAX_ORDER : order;
+
+        for (; pa < end; pa += PAGE_SIZE << order) {
+            pmm_free_frames(pa, order);
+        }
+    }
+
+    tlb->start = UINTPTR_MAX;
+    tlb->end = 0;
+    tlb->nb_pages = 0;
+    tlb->freed_tables = false;
+}
+
 /*
 ** Test if the given buffer is mapped and belongs to user-space.
 **
@@ -191,16 +422,29 @@ vmm_validate_user_buffer(
 ) {
     uchar const *buff_start;
     uchar const *buff_end;
+    size_t run;
+    bool mapped;
+    bool user;
+
+    // Buffers past the end of the user half (or wrapping around) don't belong to user-space.
+    if (
+        (uchar const *)buffer >= (uchar const *)ARCH_VASPACE_USER_END
+        || len > (size_t)((uchar const *)ARCH_VASPACE_USER_END - (uchar const *)buffer)
+    ) {
+        return ERR_PERMISSION_DENIED;
+    }
 
     buff_start = ROUND_DOWN(buffer, PAGE_SIZE);
-    buff_end = ROUND_DOWN((uchar const *)buffer + len, PAGE_SIZE);
+    buff_end = ROUND_DOWN((uchar const *)buffer + len, PAGE_SIZE) + PAGE_SIZE;
 
+    // Iterate run by run, each of them costing a single walk of the paging structures
     do {
-        if (!vmm_is_mapped_user(buff_start)) {
+        run = vmm_probe(buff_start, buff_end - buff_start, &mapped, &user);
+        if (!user) {
             return ERR_PERMISSION_DENIED;
         }
-        buff_start += PAGE_SIZE;
-    } while (buff_start <= buff_end);
+        buff_start += run;
+    } while (buff_start < buff_end);
 
     return OK;
 }
@@ -221,18 +465,26 @@ vmm_validate_user_str(
 ) {
     char const *str_align;
     char const *str_start;
+    size_t run;
+    bool mapped;
+    bool user;
 
     str_start = str;
     str_align = ROUND_DOWN(str, PAGE_SIZE);
 
-    // Iterate page by page and then char by char
+    // Iterate run by run and then char by char, up to the end of the user half
 
     while (true) {
-        if (!vmm_is_mapped_user(str_align)) {
+        if ((uchar const *)str_align >= (uchar const *)ARCH_VASPACE_USER_END) {
+            return ERR_PERMISSION_DENIED;
+        }
+
+        run = vmm_probe(str_align, (uchar const *)ARCH_VASPACE_USER_END - (uchar const *)str_align, &mapped, &user);
+        if (!user) {
             return ERR_PERMISSION_DENIED;
         }
 
-        while (str < str_align + PAGE_SIZE) {
+        while (str < str_align + run) {
             if (*str == '\0') { // Stop here
                 if (len) {
                     *len = str - str_start;
@@ -242,6 +494,151 @@ vmm_validate_user_str(
             ++str;
         }
 
-        str_align += PAGE_SIZE;
+        str_align += run;
     }
 }
+
+/*
+** Create a new address space, sharing the kernel's half with all the others,
+** and store it in `*pvaspace`.
+**
+** If the address space couldn't be created, `*pvaspace` is set to `NULL`.
+*/
+status_t
+vaspace_new(
+    struct vaspace **pvaspace
+) {
+    struct vaspace *vaspace;
+    status_t s;
+
+    *pvaspace = NULL;
+
+    vaspace = kmem_cache_alloc(&g_vaspace_cache);
+    if (!vaspace) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    memset(vaspace, 0, sizeof(*vaspace));
+
+    s = arch_vaspace_new(vaspace);
+    if (s != OK) {
+        kmem_cache_free(&g_vaspace_cache, vaspace);
+        return s;
+    }
+
+    *pvaspace = vaspace;
+    return OK;
+}
+
+/*
+** Destroy an address space created by `vaspace_new()`.
+**
+** It must not be loaded on any CPU anymore, and its user half must already be
+** unmapped: only the paging structures are freed.
+*/
+void
+vaspace_free(
+    struct vaspace *vaspace
+) {
+    arch_vaspace_free(vaspace);
+    kmem_cache_free(&g_vaspace_cache, vaspace);
+}
+
+#if KCONFIG_BENCHMARKS
+
+/*
+** Amount of address space switches made by `vaspace_bench()`.
+*/
+#define VASPACE_BENCH_ROUNDS    100000u
+
+static bool g_vaspace_bench_over;
+
+/*
+** Make the given address space the one of the current thread, and load it.
+*/
+static
+void
+vaspace_bench_load(
+    struct vaspace *vaspace
+) {
+    bool state;
+
+    push_interrupts_state(&state);
+    disable_interrupts();
+
+    current_thread()->vaspace = vaspace;
+    vaspace_switch(vaspace);
+
+    pop_interrupts_state(&state);
+}
+
+/*
+** The thread of `vaspace_bench()`.
+**
+** It maps a different page at the same user address in two new address spaces,
+** switches back and forth between them, checking each time that the page seen
+** is the one of the address space loaded, and destroys them.
+*/
+int
+vaspace_bench_thread(
+    void
+) {
+    struct vaspace *vaspaces[2];
+    uint64 volatile *page;
+    uint64 start;
+    uint64 cycles;
+    uint round;
+    uint i;
+
+    page = (uint64 volatile *)ARCH_VASPACE_USER_START;
+
+    for (i = 0; i < ARRAY_LENGTH(vaspaces); ++i) {
+        assert_ok(vaspace_new(&vaspaces[i]));
+        vaspace_bench_load(vaspaces[i]);
+        assert_ok(vmm_map((virtaddr_t)page, PAGE_SIZE, MMAP_USER | MMAP_RDWR));
+        *page = i;
+    }
+
+    start = rdtsc();
+    for (round = 0; round < VASPACE_BENCH_ROUNDS; ++round) {
+        i = round % ARRAY_LENGTH(vaspaces);
+        vaspace_bench_load(vaspaces[i]);
+        assert(*page == i);
+    }
+    cycles = rdtsc() - start;
+
+    logln("vmm: bench: %llu cycles per address space switch", cycles / VASPACE_BENCH_ROUNDS);
+
+    for (i = 0; i < ARRAY_LENGTH(vaspaces); ++i) {
+        vaspace_bench_load(vaspaces[i]);
+        vmm_unmap((virtaddr_t)page, PAGE_SIZE, MUNMAP_FREE);
+    }
+
+    vaspace_bench_load(&g_kernel_vaspace);
+
+    for (i = 0; i < ARRAY_LENGTH(vaspaces); ++i) {
+        vaspace_free(vaspaces[i]);
+    }
+
+    while (42) {
+        sleep(&g_vaspace_bench_over);
+    }
+}
+
+/*
+** Measure the cost of switching between two address spaces, which keeps their
+** TLB entries when PCIDs are supported.
+*/
+static
+status_t
+vaspace_bench(
+    void
+) {
+    struct thread *thread;
+
+    return thread_new(&vaspace_bench_thread, &thread);
+}
+
+REGISTER_INIT_HOOK(vaspace_bench, &vaspace_bench, INIT_LEVEL_DRIVERS);
+
+#endif /* KCONFIG_BENCHMARKS */
@@ -10,6 +10,8 @@
 #include "poseidon/scheduler/scheduler.h"
 #include "arch/x86_64/api/cpu.h"
 #include "poseidon/thread/thread.h"
+#include "poseidon/memory/pmm.h"
+#include "poseidon/memory/vmm.h"
 #include "poseidon/interrupt.h"
 #include "lib/list.h"
 #include "lib/sync/spinlock.h"
@@ -68,12 +70,24 @@ reschedule(
         set_current_thread(NULL);
     }
 
-    /* Find the new thread or halt (to save power) */
+    /*
+    ** Find the new thread. In the meantime, use the idle time to initialize the
+    ** memory the PMM deferred at boot time and to zero frames in advance, or
+    ** halt (to save power) if there's nothing left to do. While halted, the CPU
+    ** isn't interrupted by TLB shootdowns.
+    */
     new = find_next_thread(); // `new` is already read-write locked
     while (!new) {
-        enable_interrupts();
-        halt();
-        disable_interrupts();
+        if (!pmm_deferred_init_step() && !pmm_zeroed_pool_fill()) {
+            // Idle on the kernel's address space, so shootdowns of the previous one's
+            // user half don't wake this CPU up.
+            vaspace_switch(&g_kernel_vaspace);
+            tlb_lazy_enter();
+            enable_interrupts();
+            halt();
+            disable_interrupts();
+            tlb_lazy_leave();
+        }
         new = find_next_thread();
     }
 
@@ -82,7 +96,7 @@ reschedule(
     new->sched_info.state = RUNNING;
 
     //arch_set_kernel_stack((uintptr)new->kstack_top);
-    //arch_vaspace_switch(new->vaspace);
+    vaspace_switch(new->vaspace);
 
     stack_saved = new->sched_info.stack_saved;
     spin_rwlock_release_write(&new->sched_info.lock);
@@ -131,3 +145,74 @@ yield(
     }
     pop_interrupts_state(&state);
 }
+
+/*
+** Put the current thread to sleep until another thread calls `wakeup()` on it.
+**
+** To avoid missing a wake up, the caller sets `*wakeup_pending` before calling
+** `wakeup()`. If it is already set when this function is called, the current
+** thread doesn't sleep at all. Either way, `*wakeup_pending` is left untouched.
+**
+** _WARNING_:
+** The current thread must NOT be acquired before calling this, NOR its address space.
+*/
+void
+sleep(
+    bool const *wakeup_pending
+) {
+    struct cpu const *cpu;
+    struct thread *thread;
+    bool state;
+
+    push_interrupts_state(&state);
+    {
+        disable_interrupts();
+
+        cpu = current_cpu();
+        thread = current_thread();
+        assert(thread);
+
+        /*
+        ** `wakeup()` acquires the thread after `*wakeup_pending` is set, so checking it
+        ** with the thread acquired ensures the wake up can't happen in-between.
+        */
+        spin_rwlock_acquire_write(&thread->sched_info.lock); /* Released in `reschedule()` */
+        if (atomic_load(wakeup_pending, ATOMIC_ACQUIRE)) {
+            spin_rwlock_release_write(&thread->sched_info.lock);
+        } else {
+            assert(thread->sched_info.state == RUNNING);
+            thread->sched_info.state = SLEEPING;
+            enter_scheduler(cpu->scheduler_stack_top);
+        }
+    }
+    pop_interrupts_state(&state);
+}
+
+/*
+** Make the given thread runnable again if it is sleeping (see `sleep()`).
+**
+** It does nothing if the thread isn't sleeping.
+*/
+void
+wakeup(
+    struct thread *thread
+) {
+    bool state;
+
+    push_interrupts_state(&state);
+    {
+        disable_interrupts();
+
+        spinlock_acquire(&g_sched_runnable_threads_lock);
+        {
+            spin_rwlock_acquire_write(&thread->sched_info.lock);
+            if (thread->sched_info.state == SLEEPING) {
+                thread->sched_info.state = RUNNABLE;
+                list_add_tail(&g_sched_runnable_threads, &thread->sched_info.runnable_threads);
+            }
+            spin_rwlock_release_write(&thread->sched_info.lock);
+        }
+        spinlock_release(&g_sched_runnable_threads_lock);
+    }
+    pop_interrupts_state(&state);
+}
@@ -11,6 +11,8 @@
 #include "poseidon/poseidon.h"
 #include "poseidon/thread/thread.h"
 #include "poseidon/memory/memory.h"
+#include "poseidon/memory/slab.h"
+#include "poseidon/memory/vmalloc.h"
 #include "poseidon/scheduler/scheduler.h"
 #include "lib/sync/spinrwlock.h"
 #include "lib/list.h"
@@ -18,6 +20,7 @@
 
 static struct linked_list g_threads_list = LIST_HEAD_INIT(g_threads_list);
 static tid_t g_next_pid = 1;
+static struct kmem_cache g_thread_cache = KMEM_CACHE_DEFAULT(g_thread_cache, struct thread, NULL);
 
 /*
 ** Set the new name of the thread
@@ -37,6 +40,9 @@ thread_set_name(
 ** The kernel stack is created only if t->sched_info.kstack == NULL, otherwise it
 ** reuses the existing kernel stack.
 **
+** Stacks are spread over the cache colors, so the hot top of each stack doesn't
+** compete for the same cache sets as the top of all the others.
+**
 ** This assumes the given thread and it's virtual address space are both
 ** locked as writers.
 */
@@ -45,7 +51,7 @@ thread_create_stacks(
     struct thread *thread
 ) {
     /* Allocate the user stack */
-    thread->sched_info.stack = kheap_alloc_aligned(KCONFIG_THREAD_STACK_SIZE);
+    thread->sched_info.stack = vmalloc_color(KCONFIG_THREAD_STACK_SIZE);
     if (!thread->sched_info.stack) {
         return ERR_OUT_OF_MEMORY;
     }
@@ -53,11 +59,11 @@ thread_create_stacks(
 
     /* Allocate the kernel stack */
     if (!thread->sched_info.kstack) {
-        thread->sched_info.kstack = kheap_alloc_aligned(KCONFIG_KERNEL_STACK_SIZE);
+        thread->sched_info.kstack = vmalloc_color(KCONFIG_KERNEL_STACK_SIZE);
 
         /* In case of failure, we free the user stack previously allocated*/
         if (!thread->sched_info.kstack) {
-            kheap_free(thread->sched_info.stack);
+            vfree(thread->sched_info.stack);
             return ERR_OUT_OF_MEMORY;
         }
 
@@ -85,13 +91,15 @@ thread_new(
     /* Set the initial value of `*thread`, so we can easily return in case of failure. */
     *pthread = NULL;
 
-    /* First, find an unused thread in `thread_table` */
-    thread = kheap_alloc_zero(sizeof(*thread));
+    /* First, allocate the new thread */
+    thread = kmem_cache_alloc(&g_thread_cache);
 
     if (!thread) {
         return ERR_OUT_OF_MEMORY;
     }
 
+    memset(thread, 0, sizeof(*thread));
+
     thread->tid = g_next_pid++;             // Set the thread's TID
     thread->entry = entry;                  // Set the thread's entry point
     thread->sched_info.state = RUNNABLE;    // Set the state of the new thread to `RUNNABLE`
@@ -100,14 +108,16 @@ thread_new(
     if (current_thread()) {
         thread->parent = current_thread();                  // Set the current thread as the new thread's parent
         thread_set_name(thread, current_thread()->name);    // And copy its name (FIXME)
+        thread->vaspace = current_thread()->vaspace;        // And share its address space
     } else {
         thread->parent = NULL;
         thread_set_name(thread, "kthread");                 // Hard-code the name to `kthread`.
+        thread->vaspace = &g_kernel_vaspace;
     }
 
     s = thread_create_stacks(thread);       // Create two stacks (user and kernel) for this process
     if (s != OK) {
-        kheap_free(thread);
+        kmem_cache_free(&g_thread_cache, thread);
         return s;
     }
 